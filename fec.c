@@ -45,6 +45,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "fec.h"
 
 /*
  * compatibility stuff
@@ -235,22 +244,73 @@ gf_mul(x,y)
  */
 
 /*
- * i use malloc so many times, it is easier to put checks all in
- * one place.
+ * All the memory used by the library comes from a pluggable allocator
+ * (see fec_set_allocator() in fec.h). The default one returns blocks
+ * aligned to FEC_ALIGN bytes, so that matrix rows and packet buffers
+ * start on a cache line and are suitable for aligned vector loads.
+ * Failures are reported to the caller, the library never exit()s.
+ * Compiling with -DFEC_HUGEPAGES makes the default allocator back
+ * large blocks with huge pages where the system supports it.
  */
+#define FEC_ALIGN	64
+#define HUGE_SIZE	(2*1024*1024)
+
 static void *
-my_malloc(int sz, char *err_string)
+default_alloc(void *arg, size_t sz, size_t align)
 {
-    void *p = malloc( sz );
-    if (p == NULL) {
-	fprintf(stderr, "-- malloc failure allocating %s\n", err_string);
-	exit(1) ;
+    void *p ;
+
+#if defined(FEC_HUGEPAGES) && defined(MADV_HUGEPAGE)
+    if (sz >= HUGE_SIZE) {
+	if (posix_memalign(&p, HUGE_SIZE, sz) != 0)
+	    return NULL ;
+	madvise(p, sz, MADV_HUGEPAGE);
+	return p ;
     }
+#endif
+    if (posix_memalign(&p, align, sz) != 0)
+	return NULL ;
     return p ;
 }
 
+static void
+default_free(void *arg, void *p, size_t sz)
+{
+    free(p);
+}
+
+static struct fec_allocator allocator = { default_alloc, default_free, NULL };
+
+void
+fec_set_allocator(struct fec_allocator *a)
+{
+    if (a == NULL) {
+	allocator.alloc = default_alloc ;
+	allocator.free = default_free ;
+	allocator.arg = NULL ;
+    } else
+	allocator = *a ;
+}
+
+static void *
+my_malloc(size_t sz)
+{
+    if (sz == 0)
+	sz = 1 ;
+    return allocator.alloc(allocator.arg, sz, FEC_ALIGN);
+}
+
+static void
+my_free(void *p, size_t sz)
+{
+    if (p != NULL)
+	allocator.free(allocator.arg, p, sz == 0 ? 1 : sz);
+}
+
 #define NEW_GF_MATRIX(rows, cols) \
-    (gf *)my_malloc(rows * cols * sizeof(gf), " ## __LINE__ ## " )
+    (gf *)my_malloc((size_t)(rows) * (cols) * sizeof(gf))
+#define FREE_GF_MATRIX(m, rows, cols) \
+    my_free(m, (size_t)(rows) * (cols) * sizeof(gf))
 
 /*
  * initialize the data structures used for computations in GF.
@@ -332,7 +392,7 @@ generate_gf(void)
  * Note that gcc on
  */
 #define addmul(dst, src, c, sz) \
-    if (c != 0) addmul1(dst, src, c, sz)
+    if (c != 0) addmul_kernel[SIZE_CLASS(sz)](dst, src, c, sz)
 
 #define UNROLL 16 /* 1, 4, 8, 16 */
 static void
@@ -374,22 +434,163 @@ addmul1(gf *dst1, gf *src1, gf c, int sz)
 }
 
 /*
- * computes C = AB where A is n*k, B is k*m, C is n*m
+ * addmul_swar() is a portable alternative to the table lookups of
+ * addmul1(), for targets where neither the tables nor SIMD are fast.
+ * It works on 64-bit words, i.e. 8 (or 4, for GF_BITS > 8) elements
+ * at a time, bit-sliced: since c*x is the sum of c*alpha^i over the
+ * bits i of x, each bit plane of the word, (x >> i) & SWAR_ONES, is
+ * multiplied by the scalar c*alpha^i (no carries cross the lanes)
+ * and the results are xor-ed. The result is the same as addmul1().
+ */
+#define SWAR_ONES	(~(uint64_t)0 / ((1 << (8 * sizeof(gf))) - 1))
+#define SWAR_BLOCK	32	/* bytes per iteration, 4 words */
+
+static void
+addmul_swar(gf *dst1, gf *src1, gf c, int sz)
+{
+    USE_GF_MULC ;
+    unsigned char *dst = (unsigned char *)dst1, *src = (unsigned char *)src1 ;
+    uint64_t cp[GF_BITS], x[4], d[4], b ;
+    int i, n = sz * sizeof(gf) / SWAR_BLOCK ;
+
+    if (c == 0)
+	return ;
+    for (i = 0 ; i < GF_BITS ; i++)
+	cp[i] = gf_mul(c, gf_exp[i]) ;
+    for (; n > 0 ; n--, dst += SWAR_BLOCK, src += SWAR_BLOCK) {
+	memcpy(x, src, SWAR_BLOCK);	/* may be unaligned */
+	memcpy(d, dst, SWAR_BLOCK);
+	for (i = 0 ; i < GF_BITS ; i++) {
+	    b = cp[i] ;
+	    d[0] ^= ((x[0] >> i) & SWAR_ONES) * b ;
+	    d[1] ^= ((x[1] >> i) & SWAR_ONES) * b ;
+	    d[2] ^= ((x[2] >> i) & SWAR_ONES) * b ;
+	    d[3] ^= ((x[3] >> i) & SWAR_ONES) * b ;
+	}
+	memcpy(dst, d, SWAR_BLOCK);
+    }
+    GF_MULC0(c) ;
+    for (n = sz % (SWAR_BLOCK / sizeof(gf)) ; n > 0 ; n--) {
+	GF_ADDMULC( *(gf *)dst , *(gf *)src );
+	dst += sizeof(gf) ;
+	src += sizeof(gf) ;
+    }
+}
+
+/*
+ * The addmul kernels. Which one is fastest depends on the CPU, the
+ * compiler and the size of the packets, so at init each kernel is
+ * timed on one size per class, as the Linux raid6 code does, and
+ * the fastest is used for the class. The FEC_KERNEL environment
+ * variable, fec_set_kernel() or compiling with -DFEC_KERNEL_SWAR
+ * force a kernel instead.
+ */
+static struct {
+    const char *name ;
+    void (*fn)(gf *dst, gf *src, gf c, int sz) ;
+} kernels[] = {
+    { "table",	addmul1 },
+    { "swar64",	addmul_swar },
+} ;
+#define NKERNELS	(sizeof(kernels) / sizeof(kernels[0]))
+
+/*
+ * size classes: packets below class_max[c] bytes (and not in a lower
+ * class) are in class c, the last one has no limit. class_bench[] is
+ * the size timed for each.
+ */
+static const int class_max[FEC_NCLASSES] = { 1024, 16384, 0 } ;
+static const int class_bench[FEC_NCLASSES] = { 256, 4096, 32768 } ;
+#define SIZE_CLASS(sz) \
+	((sz) * sizeof(gf) < (size_t)class_max[0] ? 0 : \
+	 (sz) * sizeof(gf) < (size_t)class_max[1] ? 1 : 2)
+#define BENCH_MAX	32768
+
+static int cur_kernel[FEC_NCLASSES] ;		/* index in kernels[] */
+static double kernel_mbps[FEC_NCLASSES][NKERNELS] ;
+static void (*addmul_kernel[FEC_NCLASSES])(gf *, gf *, gf, int) =
+	{ addmul1, addmul1, addmul1 } ;
+
+static void
+use_kernel(int cls, int i)
+{
+    cur_kernel[cls] = i ;
+    addmul_kernel[cls] = kernels[i].fn ;
+}
+
+static int
+find_kernel(const char *name)
+{
+    int i ;
+
+    for (i = 0 ; i < NKERNELS ; i++)
+	if (strcmp(name, kernels[i].name) == 0)
+	    return i ;
+    return -1 ;
+}
+
+static double
+elapsed(struct timespec *t0)
+{
+    struct timespec t1 ;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) * 1e-9 ;
+}
+
+/*
+ * MB/s of a kernel on sz bytes: the best of a few runs of at least
+ * 100us each, with varying coefficients. About 2ms in total.
  */
+static double
+bench_kernel(void (*fn)(gf *, gf *, gf, int), gf *dst, gf *src, int sz)
+{
+    struct timespec t0 ;
+    double dt, mbps, best = 0 ;
+    int rep, i, n ;
+
+    for (rep = 0 ; rep < 3 ; rep++) {
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	n = 0 ;
+	do {
+	    for (i = 0 ; i < 8 ; i++, n++)
+		fn(dst, src, 2 + n % (GF_SIZE - 1), sz / sizeof(gf));
+	} while ( (dt = elapsed(&t0)) < 100e-6) ;
+	mbps = (double)n * sz / dt / 1e6 ;
+	if (mbps > best)
+	    best = mbps ;
+    }
+    return best ;
+}
+
+static gf bench_buf[2][BENCH_MAX / sizeof(gf)] ;
+
 static void
-matmul(gf *a, gf *b, gf *c, int n, int k, int m)
-{
-    int row, col, i ;
-
-    for (row = 0; row < n ; row++) {
-	for (col = 0; col < m ; col++) {
-	    gf *pa = &a[ row * k ];
-	    gf *pb = &b[ col ];
-	    gf acc = 0 ;
-	    for (i = 0; i < k ; i++, pa++, pb += m )
-		acc ^= gf_mul( *pa, *pb ) ;
-	    c[ row * m + col ] = acc ;
+init_kernels(void)
+{
+    char *env = getenv("FEC_KERNEL") ;
+    int cls, i, forced = -1 ;
+
+#ifdef FEC_KERNEL_SWAR
+    forced = find_kernel("swar64");
+#endif
+    if (env != NULL && find_kernel(env) >= 0)
+	forced = find_kernel(env);
+    if (forced >= 0) {
+	for (cls = 0 ; cls < FEC_NCLASSES ; cls++)
+	    use_kernel(cls, forced);
+	return ;
+    }
+    for (i = 0 ; i < BENCH_MAX / sizeof(gf) ; i++)
+	bench_buf[0][i] = i * 7 ;
+    for (cls = 0 ; cls < FEC_NCLASSES ; cls++) {
+	for (i = 0 ; i < NKERNELS ; i++) {
+	    kernel_mbps[cls][i] = bench_kernel(kernels[i].fn, bench_buf[1],
+		bench_buf[0], class_bench[cls]);
+	    if (kernel_mbps[cls][i] > kernel_mbps[cls][cur_kernel[cls]])
+		cur_kernel[cls] = i ;
 	}
+	use_kernel(cls, cur_kernel[cls]);
     }
 }
 
@@ -413,27 +614,288 @@ is_identity(gf *m, int k)
 }
 #endif /* debug */
 
+/*
+ * Scratch memory for decoding: the k*k decoding matrix, the work
+ * vectors of invert_mat() and the buffers for reconstructed packets.
+ * A few of these are cached in each code descriptor and reused
+ * across calls, so that in steady state fec_decode() does not
+ * allocate anything. The fixed part is a single block, carved
+ * into FEC_ALIGN-aligned pieces.
+ */
+#define ALIGN_UP(x) (((x) + FEC_ALIGN - 1) & ~(size_t)(FEC_ALIGN - 1))
+
+struct fec_scratch {
+    int k ;
+    gf *matrix ;		/* k*k decoding matrix */
+    gf *sub ;			/* l*l submatrix for selective decoding */
+    int *indxc, *indxr, *ipiv ;	/* used by invert_mat() */
+    gf *id_row ;
+    gf *row ;			/* a row of the encoding matrix */
+    int *lost ;			/* positions of missing packets */
+    int *outpos ;		/* position of each reconstructed packet */
+    gf **rows ;			/* and its row of coefficients */
+    gf **new_pkt ;		/* reconstructed packets, point into buf */
+    gf *buf ;
+    size_t buf_len ;		/* bytes allocated for buf */
+    gf *aug ;			/* for invert_blocked() */
+    size_t aug_len ;
+} ;
+
+static size_t
+scratch_size(int k)
+{
+    return ALIGN_UP(sizeof(struct fec_scratch)) +
+	2 * ALIGN_UP((size_t)k * k * sizeof(gf)) +
+	5 * ALIGN_UP(k * sizeof(int)) +
+	2 * ALIGN_UP(k * sizeof(gf)) +
+	2 * ALIGN_UP(k * sizeof(gf *)) ;
+}
+
+static struct fec_scratch *
+new_scratch(int k)
+{
+    char *p = my_malloc(scratch_size(k));
+    struct fec_scratch *s = (struct fec_scratch *)p ;
+
+    if (p == NULL)
+	return NULL ;
+    s->k = k ;
+    p += ALIGN_UP(sizeof(struct fec_scratch)) ;
+    s->matrix = (gf *)p ;	p += ALIGN_UP((size_t)k * k * sizeof(gf)) ;
+    s->sub = (gf *)p ;		p += ALIGN_UP((size_t)k * k * sizeof(gf)) ;
+    s->indxc = (int *)p ;	p += ALIGN_UP(k * sizeof(int)) ;
+    s->indxr = (int *)p ;	p += ALIGN_UP(k * sizeof(int)) ;
+    s->ipiv = (int *)p ;	p += ALIGN_UP(k * sizeof(int)) ;
+    s->lost = (int *)p ;	p += ALIGN_UP(k * sizeof(int)) ;
+    s->outpos = (int *)p ;	p += ALIGN_UP(k * sizeof(int)) ;
+    s->id_row = (gf *)p ;	p += ALIGN_UP(k * sizeof(gf)) ;
+    bzero(s->id_row, k * sizeof(gf));
+    s->row = (gf *)p ;		p += ALIGN_UP(k * sizeof(gf)) ;
+    s->rows = (gf **)p ;	p += ALIGN_UP(k * sizeof(gf *)) ;
+    s->new_pkt = (gf **)p ;
+    s->buf = NULL ;
+    s->buf_len = 0 ;
+    s->aug = NULL ;
+    s->aug_len = 0 ;
+    return s ;
+}
+
+static void
+free_scratch(struct fec_scratch *s)
+{
+    my_free(s->buf, s->buf_len);
+    my_free(s->aug, s->aug_len);
+    my_free(s, scratch_size(s->k));
+}
+
+/*
+ * make room for 'rows' packet buffers of sz elements each, and
+ * set new_pkt[0..rows-1] to point to them.
+ */
+static int
+scratch_bufs(struct fec_scratch *s, int rows, int sz)
+{
+    size_t stride = ALIGN_UP(sz * sizeof(gf)) ;
+    size_t need = stride * rows ;
+    int i ;
+
+    if (need > s->buf_len) {
+	gf *b = my_malloc(need);
+	if (b == NULL)
+	    return FEC_ENOMEM ;
+	my_free(s->buf, s->buf_len);
+	s->buf = b ;
+	s->buf_len = need ;
+    }
+    for (i = 0 ; i < rows ; i++)
+	s->new_pkt[i] = (gf *)((char *)s->buf + i * stride) ;
+    return FEC_OK ;
+}
+
+/*
+ * Blocked Gauss-Jordan for large matrices. The inverse is built in
+ * an augmented k x 2k matrix [A | Y], Y starting as the identity, in
+ * panels of GJ_BLOCK columns:
+ *  - the pivots of the panel are found on a copy of its columns, by
+ *    elimination below the diagonal only; a pivot is the first non
+ *    zero in its column, no search over the whole matrix;
+ *  - the panel rows are reduced among themselves, so their panel
+ *    part becomes the identity;
+ *  - all other rows are updated with GJ_BLOCK addmul()s each, split
+ *    in groups of GJ_ROWS rows handed to the runner, which can run
+ *    them on several threads.
+ * The columns of Y are kept permuted so that a row not yet used as a
+ * pivot has its own 1 in column k+row and the rest of Y in the first
+ * c0 columns. Then the part of a row touched by the update of the
+ * panel starting at c0 is the contiguous range c0+b .. k+c0+b-1, and
+ * the work is the same k^3 as for the unblocked version.
+ * In a single thread this is a few percent slower than invert_mat(),
+ * so it is only used when a runner has been set.
+ */
+#ifndef GJ_MIN_K
+#define GJ_MIN_K	128	/* smallest k for the blocked version */
+#endif
+#define GJ_BLOCK	32
+#define GJ_ROWS		32
+
+static void
+run_serial(void *arg, fec_task_fn *fn, void *ctx, int n)
+{
+    int i ;
+
+    for (i = 0 ; i < n ; i++)
+	fn(ctx, i);
+}
+
+static fec_runner_fn *runner = run_serial ;
+static void *runner_arg ;
+
+/*
+ * set the function used to run the row updates of large inversions,
+ * NULL for the default, which runs them in the calling thread.
+ */
+void
+fec_set_runner(fec_runner_fn *run, void *arg)
+{
+    runner_arg = arg ;
+    runner = run != NULL ? run : run_serial ;
+}
+
+struct gj_panel {
+    gf *m ;		/* the k x 2k matrix */
+    int k ;
+    int c0, b ;		/* the panel */
+} ;
+
+static void
+gj_update(void *ctx, int t)
+{
+    struct gj_panel *g = ctx ;
+    int k = g->k, c0 = g->c0, b = g->b, r, j, end ;
+    gf *row, *piv = &g->m[c0 * 2 * k + c0 + b] ;
+
+    end = (t + 1) * GJ_ROWS < k ? (t + 1) * GJ_ROWS : k ;
+    for (r = t * GJ_ROWS ; r < end ; r++) {
+	if (r >= c0 && r < c0 + b)
+	    continue ;
+	row = &g->m[r * 2 * k] ;
+	for (j = 0 ; j < b ; j++)
+	    addmul(row + c0 + b, piv + j * 2 * k, row[c0 + j], k);
+	bzero(row + c0, b * sizeof(gf));
+    }
+}
+
+static int
+scratch_aug(struct fec_scratch *s, size_t need)
+{
+    if (need > s->aug_len) {
+	gf *b = my_malloc(need);
+	if (b == NULL)
+	    return FEC_ENOMEM ;
+	my_free(s->aug, s->aug_len);
+	s->aug = b ;
+	s->aug_len = need ;
+    }
+    return FEC_OK ;
+}
+
+static int
+invert_blocked(gf *src, int k, struct fec_scratch *s)
+{
+    int w = 2 * k, c0, b, i, j, r, rows, nswap = 0 ;
+    int *swa = s->indxr, *swb = s->indxc ; /* Y columns swapped */
+    gf *m, *sl, c, t ;
+    struct gj_panel g ;
+
+    if (scratch_aug(s, (size_t)k * (w + GJ_BLOCK) * sizeof(gf)) != FEC_OK)
+	return FEC_ENOMEM ;
+    m = s->aug ;
+    sl = m + k * w ;		/* copy of the panel, k x GJ_BLOCK */
+    for (r = 0 ; r < k ; r++) {
+	bcopy(&src[r * k], &m[r * w], k * sizeof(gf));
+	bzero(&m[r * w + k], k * sizeof(gf));
+	m[r * w + k + r] = 1 ;
+    }
+    g.m = m ;
+    g.k = k ;
+    for (c0 = 0 ; c0 < k ; c0 += b) {
+	b = k - c0 < GJ_BLOCK ? k - c0 : GJ_BLOCK ;
+	rows = k - c0 ;
+	for (r = 0 ; r < rows ; r++)
+	    bcopy(&m[(c0 + r) * w + c0], &sl[r * b], b * sizeof(gf));
+	for (j = 0 ; j < b ; j++) {
+	    for (r = j ; r < rows && sl[r * b + j] == 0 ; r++)
+		;
+	    if (r == rows)
+		return FEC_EINVAL ;	/* singular */
+	    if (r != j) {
+		gf *x = &m[(c0 + j) * w], *y = &m[(c0 + r) * w] ;
+
+		for (i = 0 ; i < b ; i++)
+		    SWAP(sl[j * b + i], sl[r * b + i], gf);
+		for (i = c0 ; i < w ; i++)
+		    SWAP(x[i], y[i], gf);
+		/* put their own 1s back in place, see above */
+		SWAP(x[k + c0 + j], x[k + c0 + r], gf);
+		SWAP(y[k + c0 + j], y[k + c0 + r], gf);
+		swa[nswap] = k + c0 + j ;
+		swb[nswap++] = k + c0 + r ;
+	    }
+	    c = inverse[sl[j * b + j]] ;
+	    for (r = j + 1 ; r < rows ; r++)
+		if (sl[r * b + j] != 0) {
+		    t = gf_mul(c, sl[r * b + j]) ;
+		    addmul(&sl[r * b + j], &sl[j * b + j], t, b - j);
+		}
+	}
+	/* reduce the panel rows among themselves */
+	for (j = 0 ; j < b ; j++) {
+	    gf *p = &m[(c0 + j) * w + c0] ;
+
+	    c = inverse[p[j]] ;
+	    if (c != 1)
+		for (i = j ; i < k + b ; i++)
+		    p[i] = gf_mul(c, p[i]);
+	    for (i = 0 ; i < b ; i++)
+		if (i != j)
+		    addmul(p + (i - j) * w, p, p[(i - j) * w + j], k + b);
+	}
+	g.c0 = c0 ;
+	g.b = b ;
+	runner(runner_arg, gj_update, &g, (k + GJ_ROWS - 1) / GJ_ROWS);
+    }
+    /* undo the permutation of Y and return it */
+    while (nswap-- > 0) {
+	for (r = 0 ; r < k ; r++)
+	    SWAP(m[r * w + swa[nswap]], m[r * w + swb[nswap]], gf);
+    }
+    for (r = 0 ; r < k ; r++)
+	bcopy(&m[r * w + k], &src[r * k], k * sizeof(gf));
+    return FEC_OK ;
+}
+
 /*
  * invert_mat() takes a matrix and produces its inverse
- * k is the size of the matrix.
+ * k is the size of the matrix, s provides the work vectors.
  * (Gauss-Jordan, adapted from Numerical Recipes in C)
- * Return non-zero if singular.
+ * Return non-zero if singular (FEC_ENOMEM if out of memory).
  */
 DEB( int pivloops=0; int pivswaps=0 ; /* diagnostic */)
 static int
-invert_mat(gf *src, int k)
+invert_mat(gf *src, int k, struct fec_scratch *s)
 {
     gf c, *p ;
     int irow, icol, row, col, i, ix ;
 
     int error = 1 ;
-    int *indxc = my_malloc(k*sizeof(int), "indxc");
-    int *indxr = my_malloc(k*sizeof(int), "indxr");
-    int *ipiv = my_malloc(k*sizeof(int), "ipiv");
-    gf *id_row = NEW_GF_MATRIX(1, k);
-    gf *temp_row = NEW_GF_MATRIX(1, k);
+    int *indxc = s->indxc ;
+    int *indxr = s->indxr ;
+    int *ipiv = s->ipiv ;
+    gf *id_row = s->id_row ;	/* all zero between calls */
+
+    if (k >= GJ_MIN_K && runner != run_serial)
+	return invert_blocked(src, k, s) ;
 
-    bzero(id_row, k*sizeof(gf));
     DEB( pivloops=0; pivswaps=0 ; /* diagnostic */ )
     /*
      * ipiv marks elements already used as pivots.
@@ -538,84 +1000,124 @@ found_piv:
     }
     error = 0 ;
 fail:
-    free(indxc);
-    free(indxr);
-    free(ipiv);
-    free(id_row);
-    free(temp_row);
     return error ;
 }
 
 /*
- * fast code for inverting a vandermonde matrix.
- * XXX NOTE: It assumes that the matrix
- * is not singular and _IS_ a vandermonde matrix. Only uses
- * the second column of the matrix, containing the p_i's.
- *
- * Algorithm borrowed from "Numerical recipes in C" -- sec.2.8, but
- * largely revised for my purposes.
- * p = coefficients of the matrix (p_i)
- * q = values of the polynomial (known)
+ * CRC32C (Castagnoli polynomial, reflected 0x82F63B78), used to
+ * checksum packets in the same pass that produces them. The portable
+ * version uses slicing-by-8 tables; on x86-64 we switch at init time
+ * to the crc32 instruction if the CPU has SSE4.2.
  */
+#define CRC32C_POLY	0x82F63B78
 
-int
-invert_vdm(gf *src, int k)
+static uint32_t crc32c_table[8][256] ;
+
+static uint32_t
+crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
 {
-    int i, j, row, col ;
-    gf *b, *c, *p;
-    gf t, xx ;
+    while (len > 0 && ((size_t)p & 7) != 0) {
+	crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8) ;
+	len-- ;
+    }
+    for (; len >= 8 ; len -= 8, p += 8) {
+	uint32_t lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24) ;
+	uint32_t hi = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24 ;
+
+	crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+	      crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+	      crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+	      crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24] ;
+    }
+    while (len-- > 0)
+	crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8) ;
+    return crc ;
+}
 
-    if (k == 1) 	/* degenerate case, matrix must be p^0 = 1 */
-	return 0 ;
-    /*
-     * c holds the coefficient of P(x) = Prod (x - p_i), i=0..k-1
-     * b holds the coefficient for the matrix inversion
-     */
-    c = NEW_GF_MATRIX(1, k);
-    b = NEW_GF_MATRIX(1, k);
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <nmmintrin.h>
+#define HAVE_CRC32C_HW
+
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint64_t crc64 ;
 
-    p = NEW_GF_MATRIX(1, k);
-   
-    for ( j=1, i = 0 ; i < k ; i++, j+=k ) {
-	c[i] = 0 ;
-	p[i] = src[j] ;    /* p[i] */
+    while (len > 0 && ((size_t)p & 7) != 0) {
+	crc = _mm_crc32_u8(crc, *p++);
+	len-- ;
     }
-    /*
-     * construct coeffs. recursively. We know c[k] = 1 (implicit)
-     * and start P_0 = x - p_0, then at each stage multiply by
-     * x - p_i generating P_i = x P_{i-1} - p_i P_{i-1}
-     * After k steps we are done.
-     */
-    c[k-1] = p[0] ;	/* really -p(0), but x = -x in GF(2^m) */
-    for (i = 1 ; i < k ; i++ ) {
-	gf p_i = p[i] ; /* see above comment */
-	for (j = k-1  - ( i - 1 ) ; j < k-1 ; j++ )
-	    c[j] ^= gf_mul( p_i, c[j+1] ) ;
-	c[k-1] ^= p_i ;
+    for (crc64 = crc ; len >= 8 ; len -= 8, p += 8)
+	crc64 = _mm_crc32_u64(crc64, *(const uint64_t *)p);
+    crc = (uint32_t)crc64 ;
+    while (len-- > 0)
+	crc = _mm_crc32_u8(crc, *p++);
+    return crc ;
+}
+#endif
+
+static uint32_t (*crc32c_update)(uint32_t, const unsigned char *, size_t) =
+	crc32c_sw ;
+
+static void
+init_crc32c(void)
+{
+    uint32_t crc ;
+    int i, j ;
+
+    for (i = 0 ; i < 256 ; i++) {
+	crc = i ;
+	for (j = 0 ; j < 8 ; j++)
+	    crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0) ;
+	crc32c_table[0][i] = crc ;
     }
+    for (i = 0 ; i < 256 ; i++)
+	for (j = 1 ; j < 8 ; j++)
+	    crc32c_table[j][i] = crc32c_table[0][crc32c_table[j-1][i] & 0xff] ^
+		(crc32c_table[j-1][i] >> 8) ;
+#ifdef HAVE_CRC32C_HW
+    if (__builtin_cpu_supports("sse4.2"))
+	crc32c_update = crc32c_hw ;
+#endif
+}
 
-    for (row = 0 ; row < k ; row++ ) {
-	/*
-	 * synthetic division etc.
-	 */
-	xx = p[row] ;
-	t = 1 ;
-	b[k-1] = 1 ; /* this is in fact c[k] */
-	for (i = k-2 ; i >= 0 ; i-- ) {
-	    b[i] = c[i+1] ^ gf_mul(xx, b[i+1]) ;
-	    t = gf_mul(xx, t) ^ b[i] ;
-	}
-	for (col = 0 ; col < k ; col++ )
-	    src[col*k + row] = gf_mul(inverse[t], b[col] );
+/*
+ * The fused kernels process CRC_CHUNK bytes at a time, checksumming
+ * each chunk right after producing it, while it is still in L1.
+ * addmul_crc() also works for c == 0 (it only computes the crc).
+ */
+#define CRC_CHUNK	512
+
+static uint32_t
+addmul_crc(gf *dst, gf *src, gf c, int sz, uint32_t crc)
+{
+    int n, step = CRC_CHUNK / sizeof(gf) ;
+
+    for (; sz > 0 ; dst += n, src += n, sz -= n) {
+	n = sz < step ? sz : step ;
+	if (c != 0)
+	    addmul_kernel[SIZE_CLASS(n)](dst, src, c, n);
+	crc = crc32c_update(crc, (unsigned char *)dst, n * sizeof(gf));
+    }
+    return crc ;
+}
+
+static uint32_t
+copy_crc(gf *dst, gf *src, int sz, uint32_t crc)
+{
+    int n, step = CRC_CHUNK / sizeof(gf) ;
+
+    for (; sz > 0 ; dst += n, src += n, sz -= n) {
+	n = sz < step ? sz : step ;
+	bcopy(src, dst, n * sizeof(gf));
+	crc = crc32c_update(crc, (unsigned char *)dst, n * sizeof(gf));
     }
-    free(c) ;
-    free(b) ;
-    free(p) ;
-    return 0 ;
+    return crc ;
 }
 
 static int fec_initialized = 0 ;
-static void
+void
 init_fec()
 {
     TICK(ticks[0]);
@@ -626,6 +1128,8 @@ init_fec()
     init_mul_table();
     TOCK(ticks[0]);
     DDB(fprintf(stderr, "init_mul_table took %ldus\n", ticks[0]);)
+    init_crc32c();
+    init_kernels();
     fec_initialized = 1 ;
 }
 
@@ -633,138 +1137,624 @@ init_fec()
  * This section contains the proper FEC encoding/decoding routines.
  * The encoding matrix is computed starting with a Vandermonde matrix,
  * and then transforming it into a systematic matrix.
+ *
+ * Row i of the Vandermonde matrix holds the powers of x_i, with
+ * x_0 = 0 and x_i = alpha^(i-1), so the systematic matrix is
+ * V * Vtop^-1, whose row for packet i >= k has the values at x_i of
+ * the Lagrange polynomials of the nodes x_0 .. x_{k-1}:
+ *	E[i][j] = w_j * P(x_i) / (x_i - x_j)
+ * with P(x) = prod_j (x - x_j) and the barycentric weights
+ * w_j = 1 / prod_{m != j} (x_j - x_m).
+ * So fec_new() only computes the k weights, and each parity row is
+ * built in O(k) the first time its index is used, then kept in a
+ * cache of at most ROW_CACHE bytes (the top k rows are the identity
+ * and are never stored). Memory and setup time depend on the parity
+ * indexes in use, not on n.
  */
 
 #define FEC_MAGIC	0xFECC0DEC
+#define SCRATCH_SLOTS	4	/* scratch areas cached per code */
+#ifndef ROW_CACHE
+#define ROW_CACHE	(1024*1024)	/* bytes of parity rows per code */
+#endif
 
 struct fec_parms {
     u_long magic ;
     int k, n ;		/* parameters of the code */
-    gf *enc_matrix ;
+    gf *weights ;	/* k barycentric weights */
+    gf *rows ;		/* nslots cached parity rows, k each */
+    int *tag ;		/* index held by each slot, or -1 */
+    int nslots ;	/* n - k if all parity rows fit */
+    int lock ;		/* protects the row cache */
+    struct fec_scratch *scratch[SCRATCH_SLOTS] ;
+    void *map ;		/* from fec_open(), holds weights and all rows */
+    size_t map_len ;
 } ;
 
+/*
+ * The scratch cache may be used by several threads sharing the
+ * same code, so slots are taken and returned with atomic operations.
+ */
+#ifdef __GNUC__
+#define XCHG_PTR(p, v)		__sync_lock_test_and_set(p, v)
+#define CAS_PTR(p, old, v)	__sync_bool_compare_and_swap(p, old, v)
+#define SPIN_LOCK(l)		while (__sync_lock_test_and_set(l, 1)) \
+				    while (*(volatile int *)(l))
+#define SPIN_UNLOCK(l)		__sync_lock_release(l)
+#define LOAD_ACQ(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE_REL(p, v)		__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#else	/* no atomics: the caches are not thread safe */
+#define SPIN_LOCK(l)
+#define SPIN_UNLOCK(l)
+#define LOAD_ACQ(p)		(*(p))
+#define STORE_REL(p, v)		(*(p) = (v))
+static inline void *
+XCHG_PTR(void *p, void *v)
+{
+    void *old = *(void **)p ;
+    *(void **)p = v ;
+    return old ;
+}
+static inline int
+CAS_PTR(void *p, void *old, void *v)
+{
+    if (*(void **)p != old)
+	return 0 ;
+    *(void **)p = v ;
+    return 1 ;
+}
+#endif
+
+static struct fec_scratch *
+get_scratch(struct fec_parms *code)
+{
+    struct fec_scratch *s ;
+    int i ;
+
+    for (i = 0 ; i < SCRATCH_SLOTS ; i++)
+	if ( (s = XCHG_PTR(&code->scratch[i], NULL)) != NULL)
+	    return s ;
+    return new_scratch(code->k);
+}
+
+static void
+put_scratch(struct fec_parms *code, struct fec_scratch *s)
+{
+    int i ;
+
+    for (i = 0 ; i < SCRATCH_SLOTS ; i++)
+	if (CAS_PTR(&code->scratch[i], NULL, s))
+	    return ;
+    free_scratch(s);
+}
+
+/*
+ * the Vandermonde node of row i
+ */
+#define NODE(i)	((i) == 0 ? 0 : gf_exp[(i) - 1])
+
+/*
+ * store in row[] the coefficients of parity packet 'index'.
+ */
+static void
+make_row(struct fec_parms *code, int index, gf *row)
+{
+    int j, k = code->k ;
+    gf x = NODE(index), px = 1 ;
+
+    for (j = 0 ; j < k ; j++)
+	px = gf_mul(px, x ^ NODE(j)) ;
+    for (j = 0 ; j < k ; j++)
+	row[j] = gf_mul(code->weights[j], gf_mul(px, inverse[x ^ NODE(j)])) ;
+}
+
+/*
+ * return the coefficients of parity packet 'index', from the cache.
+ * If buf is not NULL they are copied there, and the cache slot may
+ * be reused later; with buf NULL the cache must hold all the rows
+ * (nslots == n - k), and the result stays valid.
+ */
+static gf *
+parity_row(struct fec_parms *code, int index, gf *buf)
+{
+    int slot = (index - code->k) % code->nslots ;
+    gf *row = &code->rows[(size_t)slot * code->k] ;
+
+    if (code->map != NULL) {	/* all there, and read only */
+	if (buf == NULL)
+	    return row ;
+	bcopy(row, buf, code->k * sizeof(gf));
+	return buf ;
+    }
+    if (buf == NULL && LOAD_ACQ(&code->tag[slot]) == index)
+	return row ;
+    SPIN_LOCK(&code->lock);
+    if (code->tag[slot] != index) {
+	make_row(code, index, row);
+	STORE_REL(&code->tag[slot], index);
+    }
+    if (buf != NULL) {
+	bcopy(row, buf, code->k * sizeof(gf));
+	row = buf ;
+    }
+    SPIN_UNLOCK(&code->lock);
+    return row ;
+}
+
+#define ALL_ROWS_CACHED(code)	((code)->nslots == (code)->n - (code)->k)
+
 void
-fec_free(struct fec_parms *p)
+fec_free(void *p1)
 {
+    struct fec_parms *p = p1 ;
+    int i ;
+
     if (p==NULL ||
-       p->magic != ( ( (FEC_MAGIC ^ p->k) ^ p->n) ^ (int)(p->enc_matrix)) ) {
+       p->magic != ( ( (FEC_MAGIC ^ p->k) ^ p->n) ^ (u_long)(p->weights)) ) {
 	fprintf(stderr, "bad parameters to fec_free\n");
 	return ;
     }
-    free(p->enc_matrix);
-    free(p);
+    for (i = 0 ; i < SCRATCH_SLOTS ; i++)
+	if (p->scratch[i] != NULL)
+	    free_scratch(p->scratch[i]);
+    if (p->map != NULL) {
+	munmap(p->map, p->map_len);
+	my_free(p, sizeof(struct fec_parms));
+	return ;
+    }
+    FREE_GF_MATRIX(p->weights, 1, p->k);
+    FREE_GF_MATRIX(p->rows, p->nslots, p->k);
+    my_free(p->tag, p->nslots * sizeof(int));
+    my_free(p, sizeof(struct fec_parms));
 }
 
 /*
  * create a new encoder, returning a descriptor. This contains k,n and
- * the encoding matrix.
+ * what is needed to build the encoding matrix. Returns NULL if the
+ * parameters are invalid or memory is not available.
  */
-struct fec_parms *
+void *
 fec_new(int k, int n)
 {
-    int row, col ;
-    gf *p, *tmp_m ;
+    int i, j ;
+    gf d ;
 
     struct fec_parms *retval ;
 
     if (fec_initialized == 0)
 	init_fec();
 
-    if (k > GF_SIZE + 1 || n > GF_SIZE + 1 || k > n ) {
+    if (k < 1 || k > GF_SIZE + 1 || n > GF_SIZE + 1 || k > n ) {
 	fprintf(stderr, "Invalid parameters k %d n %d GF_SIZE %d\n",
 		k, n, GF_SIZE );
 	return NULL ;
     }
-    retval = my_malloc(sizeof(struct fec_parms), "new_code");
+    retval = my_malloc(sizeof(struct fec_parms));
+    if (retval == NULL)
+	return NULL ;
+    bzero(retval, sizeof(struct fec_parms));
     retval->k = k ;
     retval->n = n ;
-    retval->enc_matrix = NEW_GF_MATRIX(n, k);
-    retval->magic = ( ( FEC_MAGIC ^ k) ^ n) ^ (int)(retval->enc_matrix) ;
-    tmp_m = NEW_GF_MATRIX(n, k);
-    /*
-     * fill the matrix with powers of field elements, starting from 0.
-     * The first row is special, cannot be computed with exp. table.
-     */
-    tmp_m[0] = 1 ;
-    for (col = 1; col < k ; col++)
-	tmp_m[col] = 0 ;
-    for (p = tmp_m + k, row = 0; row < n-1 ; row++, p += k) {
-	for ( col = 0 ; col < k ; col ++ )
-	    p[col] = gf_exp[modnn(row*col)];
-    }
+    retval->nslots = ROW_CACHE / (k * sizeof(gf)) ;
+    if (retval->nslots < 16)
+	retval->nslots = 16 ;
+    if (retval->nslots > n - k)
+	retval->nslots = n - k ;
+    retval->weights = NEW_GF_MATRIX(1, k);
+    retval->rows = NEW_GF_MATRIX(retval->nslots, k);
+    retval->tag = my_malloc(retval->nslots * sizeof(int));
+    if (retval->weights == NULL || retval->rows == NULL || retval->tag == NULL)
+	goto fail ;
+    retval->magic = ( ( FEC_MAGIC ^ k) ^ n) ^ (u_long)(retval->weights) ;
+    for (i = 0 ; i < retval->nslots ; i++)
+	retval->tag[i] = -1 ;
 
-    /*
-     * quick code to build systematic matrix: invert the top
-     * k*k vandermonde matrix, multiply right the bottom n-k rows
-     * by the inverse, and construct the identity matrix at the top.
-     */
     TICK(ticks[3]);
-    invert_vdm(tmp_m, k); /* much faster than invert_mat */
-    matmul(tmp_m + k*k, tmp_m, retval->enc_matrix + k*k, n - k, k, k);
-    /*
-     * the upper matrix is I so do not bother with a slow multiply
-     */
-    bzero(retval->enc_matrix, k*k*sizeof(gf) );
-    for (p = retval->enc_matrix, col = 0 ; col < k ; col++, p += k+1 )
-	*p = 1 ;
-    free(tmp_m);
+    for (j = 0 ; j < k ; j++) {
+	for (d = 1, i = 0 ; i < k ; i++)
+	    if (i != j)
+		d = gf_mul(d, NODE(j) ^ NODE(i)) ;
+	retval->weights[j] = inverse[d] ;
+    }
     TOCK(ticks[3]);
 
     DDB(fprintf(stderr, "--- %ld us to build encoding matrix\n",
 	    ticks[3]);)
-    DEB(pr_matrix(retval->enc_matrix, n, k, "encoding_matrix");)
     return retval ;
+
+fail:
+    FREE_GF_MATRIX(retval->weights, 1, k);
+    FREE_GF_MATRIX(retval->rows, retval->nslots, k);
+    my_free(retval->tag, retval->nslots * sizeof(int));
+    my_free(retval, sizeof(struct fec_parms));
+    return NULL ;
 }
 
 /*
- * fec_encode accepts as input pointers to n data packets of size sz,
- * and produces as output a packet pointed to by fec, computed
- * with index "index".
+ * return the parameters of a code, for layers built on top of it.
  */
 void
-fec_encode(struct fec_parms *code, gf *src[], gf *fec, int index, int sz)
+fec_params(void *code1, int *k, int *n)
 {
-    int i, k = code->k ;
-    gf *p ;
+    struct fec_parms *code = code1 ;
 
-    if (GF_BITS > 8)
-	sz /= 2 ;
-
-    if (index < k)
-         bcopy(src[index], fec, sz*sizeof(gf) ) ;
-    else if (index < code->n) {
-	p = &(code->enc_matrix[index*k] );
-	bzero(fec, sz*sizeof(gf));
-	for (i = 0; i < k ; i++)
-	    addmul(fec, src[i], p[i], sz ) ;
-    } else
-	fprintf(stderr, "Invalid index %d (max %d)\n",
-	    index, code->n - 1 );
+    if (k != NULL)
+	*k = code->k ;
+    if (n != NULL)
+	*n = code->n ;
 }
 
 /*
- * shuffle move src packets in their position
+ * Building blocks for codes layered on top of this one: the field
+ * arithmetic, the addmul kernel and the rows of the encoding matrix.
+ * Sizes are in bytes, as in the rest of the API.
  */
-static int
-shuffle(gf *pkt[], int index[], int k)
+int
+fec_gf_mul(int a, int b)
 {
-    int i;
+    if (fec_initialized == 0)
+	init_fec();
+    return gf_mul(a, b);
+}
 
-    for ( i = 0 ; i < k ; ) {
-	if (index[i] >= k || index[i] == i)
-	    i++ ;
-	else {
-	    /*
-	     * put pkt in the right position (first check for conflicts).
+int
+fec_gf_inv(int a)
+{
+    if (fec_initialized == 0)
+	init_fec();
+    return inverse[a] ;
+}
+
+void
+fec_addmul(void *dst, const void *src, int c, int sz)
+{
+    if (fec_initialized == 0)
+	init_fec();
+    if (GF_BITS > 8)
+	sz /= 2 ;
+    addmul((gf *)dst, (gf *)src, (gf)c, sz);
+}
+
+/*
+ * force the addmul kernel for all sizes and all the codes, or go back
+ * to the one measured fastest for each size if name is NULL. Returns
+ * FEC_EINVAL if there is no such kernel.
+ */
+int
+fec_set_kernel(const char *name)
+{
+    int cls, i, best ;
+
+    if (fec_initialized == 0)
+	init_fec();
+    for (cls = 0 ; cls < FEC_NCLASSES ; cls++) {
+	if (name != NULL) {
+	    if ( (best = find_kernel(name)) < 0)
+		return FEC_EINVAL ;
+	} else
+	    for (best = 0, i = 1 ; i < NKERNELS ; i++)
+		if (kernel_mbps[cls][i] > kernel_mbps[cls][best])
+		    best = i ;
+	use_kernel(cls, best);
+    }
+    return FEC_OK ;
+}
+
+/*
+ * name of the kernel used for packets of sz bytes
+ */
+const char *
+fec_kernel_name(int sz)
+{
+    if (fec_initialized == 0)
+	init_fec();
+    return kernels[cur_kernel[SIZE_CLASS(sz / sizeof(gf))]].name ;
+}
+
+/*
+ * what init measured for size class cls
+ */
+int
+fec_kernel_info(int cls, struct fec_kernel_info *info)
+{
+    int i ;
+
+    if (cls < 0 || cls >= FEC_NCLASSES)
+	return FEC_EINVAL ;
+    if (fec_initialized == 0)
+	init_fec();
+    info->max_sz = class_max[cls] ? class_max[cls] - 1 : 0 ;
+    info->bench_sz = class_bench[cls] ;
+    info->nkernels = NKERNELS ;
+    info->chosen = cur_kernel[cls] ;
+    for (i = 0 ; i < NKERNELS ; i++) {
+	info->name[i] = kernels[i].name ;
+	info->mbps[i] = kernel_mbps[cls][i] ;
+    }
+    return FEC_OK ;
+}
+
+/*
+ * copy into row[] the k coefficients that give packet 'index'
+ * as a combination of the source packets.
+ */
+int
+fec_matrix_row(void *code1, int index, fec_gf row[])
+{
+    struct fec_parms *code = code1 ;
+
+    if (index < 0 || index >= code->n)
+	return FEC_EINVAL ;
+    if (index < code->k) {
+	bzero(row, code->k * sizeof(gf));
+	row[index] = 1 ;
+    } else
+	parity_row(code, index, (gf *)row);
+    return FEC_OK ;
+}
+
+/*
+ * encode() does the work for fec_encode() and fec_encode_crc().
+ * If crc is not NULL, the CRC32C of the output is computed in the
+ * same pass that produces it: the copy for source packets, the
+ * last addmul with a non-zero coefficient for the others.
+ */
+static int
+encode(struct fec_parms *code, gf *src[], gf *fec, int index, int sz,
+	uint32_t *crc)
+{
+    int i, last, k = code->k ;
+    struct fec_scratch *s = NULL ;
+    gf *p ;
+
+    if (GF_BITS > 8)
+	sz /= 2 ;
+
+    if (index < k) {
+	if (crc != NULL)
+	    *crc = ~copy_crc(fec, src[index], sz, ~*crc);
+	else
+	    bcopy(src[index], fec, sz*sizeof(gf) ) ;
+    } else if (index < code->n) {
+	if (ALL_ROWS_CACHED(code))
+	    p = parity_row(code, index, NULL);
+	else {	/* the row may be evicted, use a private copy */
+	    if ( (s = get_scratch(code)) == NULL)
+		return FEC_ENOMEM ;
+	    p = parity_row(code, index, s->row);
+	}
+	bzero(fec, sz*sizeof(gf));
+	last = k ;
+	if (crc != NULL)
+	    for (last = k - 1 ; last > 0 && p[last] == 0 ; last--)
+		;
+	for (i = 0; i < last ; i++)
+	    addmul(fec, src[i], p[i], sz ) ;
+	if (last < k)
+	    *crc = ~addmul_crc(fec, src[last], p[last], sz, ~*crc);
+	if (s != NULL)
+	    put_scratch(code, s);
+    } else {
+	fprintf(stderr, "Invalid index %d (max %d)\n",
+	    index, code->n - 1 );
+	return FEC_EINVAL ;
+    }
+    return FEC_OK ;
+}
+
+/*
+ * fec_encode accepts as input pointers to n data packets of size sz,
+ * and produces as output a packet pointed to by fec, computed
+ * with index "index".
+ */
+int
+fec_encode(void *code, void *src[], void *fec, int index, int sz)
+{
+    return encode(code, (gf **)src, fec, index, sz, NULL);
+}
+
+/*
+ * same as fec_encode, also returning in *crc the CRC32C of the
+ * output packet (*crc is the initial value, normally 0).
+ */
+int
+fec_encode_crc(void *code, void *src[], void *fec, int index, int sz,
+	uint32_t *crc)
+{
+    return encode(code, (gf **)src, fec, index, sz, crc);
+}
+
+/*
+ * Produce the nout packets index[i] into dst[i] in one pass over the
+ * sources: chunk by chunk, each source is copied to its output (if
+ * one was asked for) and added to all the parity outputs while it is
+ * in cache, so sending a whole block reads the data only once. The
+ * chunks of the parity outputs stay in cache as well. At most k
+ * parity packets are done per pass.
+ */
+#define ENC_CHUNK	4096	/* bytes */
+
+int
+fec_encode_block(void *code1, void *src1[], void *dst1[], int index[],
+	int nout, int sz)
+{
+    struct fec_parms *code = code1 ;
+    gf **src = (gf **)src1, **dst = (gf **)dst1 ;
+    struct fec_scratch *s ;
+    int i, j, np, next, off, len, copy = 1, k = code->k ;
+    int chunk = ENC_CHUNK / sizeof(gf) ;
+
+    for (i = 0 ; i < nout ; i++)
+	if (index[i] < 0 || index[i] >= code->n)
+	    return FEC_EINVAL ;
+    if ( (s = get_scratch(code)) == NULL)
+	return FEC_ENOMEM ;
+    if (GF_BITS > 8)
+	sz /= 2 ;
+    for (j = 0 ; j < k ; j++)	/* the first output of each source */
+	s->ipiv[j] = -1 ;
+    for (i = nout ; i-- > 0 ; )
+	if (index[i] < k)
+	    s->ipiv[index[i]] = i ;
+    next = 0 ;
+    do {
+	for (np = 0 ; next < nout && np < k ; next++) {
+	    if (index[next] < k)
+		continue ;
+	    s->new_pkt[np] = dst[next] ;
+	    s->rows[np] = parity_row(code, index[next],
+		ALL_ROWS_CACHED(code) ? NULL : &s->matrix[np * k]) ;
+	    np++ ;
+	}
+	for (off = 0 ; off < sz ; off += len) {
+	    len = sz - off < chunk ? sz - off : chunk ;
+	    for (i = 0 ; i < np ; i++)
+		bzero(s->new_pkt[i] + off, len * sizeof(gf));
+	    for (j = 0 ; j < k ; j++) {
+		if (copy && s->ipiv[j] >= 0)
+		    bcopy(src[j] + off, dst[s->ipiv[j]] + off, len * sizeof(gf));
+		for (i = 0 ; i < np ; i++)
+		    addmul(s->new_pkt[i] + off, src[j] + off, s->rows[i][j], len);
+	    }
+	}
+	copy = 0 ;
+    } while (next < nout) ;
+    for (i = 0 ; i < nout ; i++)	/* sources asked for twice */
+	if (index[i] < k && s->ipiv[index[i]] != i)
+	    bcopy(dst[s->ipiv[index[i]]], dst[i], sz * sizeof(gf));
+    put_scratch(code, s);
+    return FEC_OK ;
+}
+
+/*
+ * fec_verify() computes the syndromes parity + sum row[j] * src[j]
+ * chunk by chunk in a buffer on the stack, each source chunk being
+ * added to all the parities while it is in cache, and checks that
+ * they are zero. A parity that does not match is marked and dropped,
+ * and when none is left the pass stops. Parities are taken in groups
+ * small enough that each gets at least VERIFY_MIN bytes of buffer.
+ */
+#define VERIFY_BUF	8192	/* bytes */
+#define VERIFY_MIN	64	/* bytes */
+
+static int
+nonzero(gf *p, int len)
+{
+    uint64_t x = 0 ;
+    int i ;
+
+    len *= sizeof(gf) ;
+    for (i = 0 ; i + 8 <= len ; i += 8)
+	x |= *(uint64_t *)((char *)p + i) ;
+    for ( ; i < len ; i++)
+	x |= ((u_char *)p)[i] ;
+    return x != 0 ;
+}
+
+int
+fec_verify(void *code1, void *src1[], void *par1[], int index[], int npar,
+	int sz, int bad[])
+{
+    struct fec_parms *code = code1 ;
+    gf **src = (gf **)src1, **par = (gf **)par1 ;
+    uint64_t acc64[VERIFY_BUF / 8] ;	/* aligned for nonzero() */
+    gf *acc = (gf *)acc64, *rows[VERIFY_BUF / VERIFY_MIN] ;
+    int act[VERIFY_BUF / VERIFY_MIN] ;	/* positions in par[] */
+    struct fec_scratch *s = NULL ;
+    int i, j, m, first, ng, na, off, len, chunk, gmax, nbad = 0, k = code->k ;
+
+    if (sz < 0 || (GF_BITS > 8 && (sz & 1)))
+	return FEC_EINVAL ;
+    for (i = 0 ; i < npar ; i++)
+	if (index[i] < k || index[i] >= code->n)
+	    return FEC_EINVAL ;
+    gmax = VERIFY_BUF / VERIFY_MIN ;
+    if (!ALL_ROWS_CACHED(code) && code->map == NULL) {
+	if ( (s = get_scratch(code)) == NULL)
+	    return FEC_ENOMEM ;
+	if (gmax > k)
+	    gmax = k ;
+    }
+    if (GF_BITS > 8)
+	sz /= 2 ;
+    if (bad != NULL)
+	bzero(bad, npar * sizeof(int));
+    for (first = 0 ; first < npar ; first += ng) {
+	ng = npar - first < gmax ? npar - first : gmax ;
+	for (i = 0 ; i < ng ; i++) {
+	    act[i] = first + i ;
+	    rows[i] = parity_row(code, index[first + i],
+		s != NULL ? &s->matrix[i * k] : NULL);
+	}
+	chunk = VERIFY_BUF / sizeof(gf) / ng ;
+	chunk &= ~7 ;
+	for (na = ng, off = 0 ; off < sz && na > 0 ; off += len) {
+	    len = sz - off < chunk ? sz - off : chunk ;
+	    for (i = 0 ; i < na ; i++)
+		bcopy(par[act[i]] + off, acc + i * chunk, len * sizeof(gf));
+	    for (j = 0 ; j < k ; j++)
+		for (i = 0 ; i < na ; i++)
+		    addmul(acc + i * chunk, src[j] + off, rows[i][j], len);
+	    for (m = na, na = 0, i = 0 ; i < m ; i++)
+		if (nonzero(acc + i * chunk, len)) {
+		    if (bad != NULL)
+			bad[act[i]] = 1 ;
+		    nbad++ ;
+		} else {
+		    act[na] = act[i] ;
+		    rows[na++] = rows[i] ;
+		}
+	}
+    }
+    if (s != NULL)
+	put_scratch(code, s);
+    return nbad ? FEC_EMISMATCH : FEC_OK ;
+}
+
+/*
+ * CRC32C of a buffer, for the receiver side. Can be chained passing
+ * the result of a previous call as crc (0 to start).
+ */
+uint32_t
+fec_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    if (fec_initialized == 0)
+	init_fec();
+    return ~crc32c_update(~crc, buf, len);
+}
+
+/*
+ * shuffle move src packets in their position. The pairs of positions
+ * exchanged are also stored in swap[] if not NULL (room for 2k), and
+ * pkt may be NULL to only compute them. Returns the number of swaps,
+ * or -1 if an index is negative or two packets have the same index.
+ */
+static int
+shuffle(gf *pkt[], int index[], int k, int swap[])
+{
+    int i, nswap = 0 ;
+
+    for ( i = 0 ; i < k ; ) {
+	if (index[i] >= k || index[i] == i)
+	    i++ ;
+	else {
+	    /*
+	     * put pkt in the right position (first check for conflicts).
 	     */
 	    int c = index[i] ;
 
-	    if (index[c] == c) {
+	    if (c < 0 || index[c] == c) {
 		DEB(fprintf(stderr, "\nshuffle, error at %d\n", i);)
-		return 1 ;
+		return -1 ;
 	    }
 	    SWAP(index[i], index[c], int) ;
-	    SWAP(pkt[i], pkt[c], gf *) ;
+	    if (pkt != NULL)
+		SWAP(pkt[i], pkt[c], gf *) ;
+	    if (swap != NULL) {
+		swap[2*nswap] = i ;
+		swap[2*nswap + 1] = c ;
+	    }
+	    nswap++ ;
 	}
     }
     DEB( /* just test that it works... */
@@ -773,23 +1763,23 @@ shuffle(gf *pkt[], int index[], int k)
 	    fprintf(stderr, "shuffle: after\n");
 	    for (i=0; i<k ; i++) fprintf(stderr, "%3d ", index[i]);
 	    fprintf(stderr, "\n");
-	    return 1 ;
+	    return -1 ;
 	}
     }
     )
-    return 0 ;
+    return nswap ;
 }
 
 /*
- * build_decode_matrix constructs the encoding matrix given the
- * indexes. The matrix must be already allocated as
- * a vector of k*k elements, in row-major order
+ * build_decode_matrix constructs the decoding matrix given the
+ * indexes, in the k*k matrix of the scratch area (row-major order),
+ * and inverts it.
  */
-static gf *
-build_decode_matrix(struct fec_parms *code, gf *pkt[], int index[])
+static int
+build_decode_matrix(struct fec_parms *code, struct fec_scratch *s, int index[])
 {
     int i , k = code->k ;
-    gf *p, *matrix = NEW_GF_MATRIX(k, k);
+    gf *p, *matrix = s->matrix ;
 
     TICK(ticks[9]);
     for (i = 0, p = matrix ; i < k ; i++, p += k ) {
@@ -800,21 +1790,147 @@ build_decode_matrix(struct fec_parms *code, gf *pkt[], int index[])
 	} else
 #endif
 	if (index[i] < code->n )
-	    bcopy( &(code->enc_matrix[index[i]*k]), p, k*sizeof(gf) ); 
+	    parity_row(code, index[i], p);
 	else {
 	    fprintf(stderr, "decode: invalid index %d (max %d)\n",
 		index[i], code->n - 1 );
-	    free(matrix) ;
-	    return NULL ;
+	    return FEC_EINVAL ;
 	}
     }
     TICK(ticks[9]);
-    if (invert_mat(matrix, k)) {
-	free(matrix);
-	matrix = NULL ;
-    }
+    if ( (i = invert_mat(matrix, k, s)) != 0)
+	return i == FEC_ENOMEM ? i : FEC_EINVAL ;
     TOCK(ticks[9]);
-    return matrix ;
+    return FEC_OK ;
+}
+
+/*
+ * build_sel_rows computes only the rows of the inverse that give the
+ * wanted missing sources, without inverting the whole k*k matrix.
+ * After shuffle(), let L be the l positions holding a parity packet
+ * p_a instead of their source, and S the received sources. Then
+ *	A x_L = y_P + E[P][S] x_S	with A[a][b] = E[p_a][L_b]
+ * so only the l*l matrix A is inverted, and the source at L_b is
+ *	x_{L_b} = sum_a Ainv[b][a] (y_{p_a} + sum_{j in S} E[p_a][j] x_j)
+ * One row is stored in s->rows[] for each wanted missing source,
+ * whose position goes in s->outpos[]. Returns their number,
+ * or -1 if an index is invalid or the matrix is singular.
+ */
+static int
+build_sel_rows(struct fec_parms *code, struct fec_scratch *s, int index[],
+	int want[], int nwant)
+{
+    int a, b, i, j, l, nout, k = code->k ;
+    gf *a_mat = s->sub, *row ;
+
+    for (l = 0, i = 0 ; i < k ; i++)
+	if (index[i] >= code->n)
+	    return -1 ;
+	else if (index[i] >= k)
+	    s->lost[l++] = i ;
+    for (a = 0 ; a < l ; a++) {
+	parity_row(code, index[s->lost[a]], s->row);
+	for (b = 0 ; b < l ; b++)
+	    a_mat[a*l + b] = s->row[s->lost[b]] ;
+    }
+    if (l > 0 && invert_mat(a_mat, l, s))
+	return -1 ;
+    for (nout = 0, j = 0 ; j < nwant ; j++) {
+	for (b = 0 ; b < l && s->lost[b] != want[j] ; b++)
+	    ;
+	for (i = 0 ; i < nout && s->outpos[i] != want[j] ; i++)
+	    ;
+	if (b == l || i < nout)	/* received, or wanted twice */
+	    continue ;
+	s->rows[nout] = &s->matrix[nout*k] ;
+	bzero(s->rows[nout], k*sizeof(gf));
+	s->ipiv[nout] = b ;	/* its column in a_mat */
+	s->outpos[nout++] = want[j] ;
+    }
+    /* one parity row at a time, added to all the wanted rows */
+    for (a = 0 ; a < l && nout > 0 ; a++) {
+	parity_row(code, index[s->lost[a]], s->row);
+	for (j = 0 ; j < nout ; j++)
+	    addmul(s->rows[j], s->row, a_mat[s->ipiv[j]*l + a], k);
+    }
+    for (j = 0 ; j < nout ; j++) {
+	row = s->rows[j] ;
+	for (a = 0 ; a < l ; a++)
+	    row[s->lost[a]] = a_mat[s->ipiv[j]*l + a] ;
+    }
+    return nout ;
+}
+
+/*
+ * decode() does the work for fec_decode() and friends. Only the
+ * sz bytes starting at off are read from the received packets and
+ * written to the reconstructed ones.
+ * If want is not NULL, only the nwant sources listed in it are
+ * reconstructed, otherwise all the missing ones.
+ * If crc is not NULL, the CRC32C of each reconstructed packet is
+ * computed while doing its last addmul and stored in crc[row].
+ */
+static int
+decode(struct fec_parms *code, gf *pkt[], int index[], int off, int sz,
+	int want[], int nwant, uint32_t crc[])
+{
+    struct fec_scratch *s ;
+    gf *m, **new_pkt ;
+    int row, col, j, nout, last, err, k = code->k ;
+
+    if (GF_BITS > 8) {
+	if (off & 1)
+	    return FEC_EINVAL ;
+	off /= 2 ;
+	sz /= 2 ;
+    }
+
+    if (shuffle(pkt, index, k, NULL) < 0)
+	return FEC_EINVAL ;
+    s = get_scratch(code);
+    if (s == NULL)
+	return FEC_ENOMEM ;
+    if (want == NULL) {
+	err = build_decode_matrix(code, s, index);
+	if (err != FEC_OK)
+	    goto done ;
+	for (nout = 0, row = 0 ; row < k ; row++ )
+	    if (index[row] >= k) {
+		s->outpos[nout] = row ;
+		s->rows[nout++] = &s->matrix[row*k] ;
+	    }
+    } else if ( (nout = build_sel_rows(code, s, index, want, nwant)) < 0) {
+	err = FEC_EINVAL ;
+	goto done ;
+    }
+    err = scratch_bufs(s, nout, sz);
+    if (err != FEC_OK)
+	goto done ;
+    /*
+     * do the actual decoding
+     */
+    new_pkt = s->new_pkt ;
+    for (j = 0 ; j < nout ; j++ ) {
+	m = s->rows[j] ;
+	bzero(new_pkt[j], sz * sizeof(gf) ) ;
+	last = k ;
+	if (crc != NULL)
+	    for (last = k - 1 ; last > 0 && m[last] == 0 ; last--)
+		;
+	for (col = 0 ; col < last ; col++ )
+	    addmul(new_pkt[j], pkt[col] + off, m[col], sz) ;
+	if (last < k)
+	    crc[s->outpos[j]] = ~addmul_crc(new_pkt[j], pkt[last] + off,
+		m[last], sz, ~0);
+    }
+    /*
+     * move pkts to their final destination
+     */
+    for (j = 0 ; j < nout ; j++ )
+	bcopy(new_pkt[j], pkt[s->outpos[j]] + off, sz*sizeof(gf));
+done:
+    put_scratch(code, s);
+    return err ;
 }
 
 /*
@@ -827,48 +1943,860 @@ build_decode_matrix(struct fec_parms *code, gf *pkt[], int index[])
  *	      to store the output packets (in place)
  *	index: pointer to packet indexes (modified)
  *	sz:    size of each packet
+ * Returns FEC_OK, or an error code.
+ */
+int
+fec_decode(void *code, void *pkt[], int index[], int sz)
+{
+    return decode(code, (gf **)pkt, index, 0, sz, NULL, 0, NULL);
+}
+
+/*
+ * fec_decode_range is the same as fec_decode, but only reconstructs
+ * the len bytes starting at offset off of the missing packets, and
+ * only reads the same range from the received ones. The rest of the
+ * buffers for reconstructed packets is left untouched.
  */
 int
-fec_decode(struct fec_parms *code, gf *pkt[], int index[], int sz)
+fec_decode_range(void *code, void *pkt[], int index[], int off, int len)
 {
-    gf *m_dec ; 
-    gf **new_pkt ;
-    int row, col , k = code->k ;
+    if (off < 0 || len < 0)
+	return FEC_EINVAL ;
+    return decode(code, (gf **)pkt, index, off, len, NULL, 0, NULL);
+}
 
+/*
+ * fec_decode_sel only reconstructs the nwant source packets listed
+ * in want[] (those already received, and repeated entries, are
+ * skipped, so nwant may exceed k), over the len bytes at offset
+ * off (use 0 and the packet size for whole packets).
+ * Packets are shuffled as in fec_decode, so on return source want[j]
+ * is in pkt[want[j]]; the other missing positions still hold the
+ * packets they had. Only a l*l matrix is inverted, l being the
+ * number of missing sources, and the data cost is one k-term pass
+ * per wanted packet.
+ */
+int
+fec_decode_sel(void *code, void *pkt[], int index[], int want[], int nwant,
+	int off, int len)
+{
+    int j, k = ((struct fec_parms *)code)->k ;
+
+    if (off < 0 || len < 0 || nwant < 0)
+	return FEC_EINVAL ;
+    for (j = 0 ; j < nwant ; j++)
+	if (want[j] < 0 || want[j] >= k)
+	    return FEC_EINVAL ;
+    return decode(code, (gf **)pkt, index, off, len, want, nwant, NULL);
+}
+
+/*
+ * same as fec_decode, also storing in crc[i] the CRC32C of each
+ * reconstructed packet i (that is, where index[i] >= k on return).
+ * The other entries of crc[] are not modified.
+ */
+int
+fec_decode_crc(void *code, void *pkt[], int index[], int sz, uint32_t crc[])
+{
+    return decode(code, (gf **)pkt, index, 0, sz, NULL, 0, crc);
+}
+
+/*
+ * Decode plans. fec_plan_decode() does, once, everything fec_decode()
+ * does before touching the data: check the indexes, work out the
+ * swaps of shuffle(), compute the rows of the missing sources (through
+ * the l*l matrix, as build_sel_rows()) and pick the kernel for sz.
+ * fec_plan_execute() then only swaps pointers and runs l*k addmuls
+ * on each block with that pattern. The plan also holds the buffers
+ * for the results, so an execute does no allocation, and a plan must
+ * not be executed by two threads at the same time.
+ */
+struct fec_plan {
+    int k, sz ;		/* sz in field elements */
+    int nswap, nout ;
+    int *swap ;		/* pairs of positions exchanged by shuffle() */
+    int *outpos ;	/* position of each rebuilt source */
+    gf *rows ;		/* and its k coefficients */
+    gf *buf ;		/* nout results, stride apart */
+    size_t stride ;
+    size_t len ;	/* of the whole allocation */
+    void (*kernel)(gf *, gf *, gf, int) ;
+} ;
+
+void *
+fec_plan_decode(void *code1, const int index[], int sz)
+{
+    struct fec_parms *code = code1 ;
+    struct fec_scratch *s = NULL ;
+    struct fec_plan *p = NULL ;
+    int k = code->k, i, l, nswap, *idx ;
+    size_t len ;
+    char *q ;
+
+    if (sz < 0 || (GF_BITS > 8 && (sz & 1)))
+	return NULL ;
     if (GF_BITS > 8)
 	sz /= 2 ;
+    for (l = 0, i = 0 ; i < k ; i++)
+	if (index[i] < 0 || index[i] >= code->n)
+	    return NULL ;
+	else if (index[i] >= k)
+	    l++ ;
+    idx = my_malloc(4 * k * sizeof(int));	/* index, want, swap */
+    if (idx == NULL)
+	return NULL ;
+    bcopy(index, idx, k * sizeof(int));
+    if ( (nswap = shuffle(NULL, idx, k, idx + 2*k)) < 0)
+	goto done ;
+    s = get_scratch(code);
+    if (s == NULL)
+	goto done ;
+    for (i = 0 ; i < k ; i++)
+	idx[k + i] = i ;
+    if (build_sel_rows(code, s, idx, idx + k, k) != l)
+	goto done ;
+    len = ALIGN_UP(sizeof(struct fec_plan)) + ALIGN_UP(2 * nswap * sizeof(int)) +
+	ALIGN_UP(l * sizeof(int)) + ALIGN_UP((size_t)l * k * sizeof(gf)) +
+	l * ALIGN_UP(sz * sizeof(gf)) ;
+    q = my_malloc(len);
+    if (q == NULL)
+	goto done ;
+    p = (struct fec_plan *)q ;
+    p->len = len ;
+    p->k = k ;
+    p->sz = sz ;
+    p->nswap = nswap ;
+    p->nout = l ;
+    p->stride = ALIGN_UP(sz * sizeof(gf)) ;
+    p->kernel = addmul_kernel[SIZE_CLASS(sz)] ;
+    q += ALIGN_UP(sizeof(struct fec_plan)) ;
+    p->swap = (int *)q ;	q += ALIGN_UP(2 * nswap * sizeof(int)) ;
+    p->outpos = (int *)q ;	q += ALIGN_UP(l * sizeof(int)) ;
+    p->rows = (gf *)q ;		q += ALIGN_UP((size_t)l * k * sizeof(gf)) ;
+    p->buf = (gf *)q ;
+    bcopy(idx + 2*k, p->swap, 2 * nswap * sizeof(int));
+    for (i = 0 ; i < l ; i++) {
+	p->outpos[i] = s->outpos[i] ;
+	bcopy(s->rows[i], p->rows + (size_t)i * k, k * sizeof(gf));
+    }
+done:
+    if (s != NULL)
+	put_scratch(code, s);
+    my_free(idx, 4 * k * sizeof(int));
+    return p ;
+}
 
-    if (shuffle(pkt, index, k))	/* error if true */
-	return 1 ;
-    m_dec = build_decode_matrix(code, pkt, index);
+/*
+ * pkt[i] holds the packet with the index[i] given to the plan; on
+ * return pkt[0..k-1] are the sources, as with fec_decode().
+ */
+int
+fec_plan_execute(void *plan, void *pkt[])
+{
+    return fec_plan_execute_range(plan, pkt, NULL, 0,
+	((struct fec_plan *)plan)->sz * sizeof(gf));
+}
 
-    if (m_dec == NULL)
-	return 1 ; /* error */
-    /*
-     * do the actual decoding
-     */
-    new_pkt = my_malloc (k * sizeof (gf * ), "new pkt pointers" );
-    for (row = 0 ; row < k ; row++ ) {
-	if (index[row] >= k) {
-	    new_pkt[row] = my_malloc (sz * sizeof (gf), "new pkt buffer" );
-	    bzero(new_pkt[row], sz * sizeof(gf) ) ;
-	    for (col = 0 ; col < k ; col++ )
-		addmul(new_pkt[row], pkt[col], m_dec[row*k + col], sz) ;
+/*
+ * the same over bytes off..off+len-1 of the packets only, also
+ * permuting index[] (if not NULL) as fec_decode() does. Each range
+ * uses its own part of the result buffers, so disjoint ranges of a
+ * plan can run at the same time, each with its own copy of pkt[].
+ */
+int
+fec_plan_execute_range(void *plan, void *pkt1[], int index[], int off,
+	int len)
+{
+    struct fec_plan *p = plan ;
+    gf **pkt = (gf **)pkt1, *m, *dst ;
+    void (*kernel)(gf *, gf *, gf, int) = p->kernel ;
+    int i, j, col ;
+
+    if (off < 0 || len < 0 || (GF_BITS > 8 && ((off | len) & 1)))
+	return FEC_EINVAL ;
+    off /= sizeof(gf) ;
+    len /= sizeof(gf) ;
+    if (len > p->sz - off)
+	return FEC_EINVAL ;
+    if (len != p->sz)
+	kernel = addmul_kernel[SIZE_CLASS(len)] ;
+    for (i = 0 ; i < p->nswap ; i++) {
+	SWAP(pkt[p->swap[2*i]], pkt[p->swap[2*i + 1]], gf *) ;
+	if (index != NULL)
+	    SWAP(index[p->swap[2*i]], index[p->swap[2*i + 1]], int) ;
+    }
+    for (j = 0 ; j < p->nout ; j++) {
+	m = p->rows + (size_t)j * p->k ;
+	dst = (gf *)((char *)p->buf + j * p->stride) + off ;
+	bzero(dst, len * sizeof(gf));
+	for (col = 0 ; col < p->k ; col++)
+	    if (m[col] != 0)
+		kernel(dst, pkt[col] + off, m[col], len);
+    }
+    for (j = 0 ; j < p->nout ; j++)
+	bcopy((gf *)((char *)p->buf + j * p->stride) + off,
+	    pkt[p->outpos[j]] + off, len * sizeof(gf));
+    return FEC_OK ;
+}
+
+void
+fec_plan_free(void *plan)
+{
+    struct fec_plan *p = plan ;
+
+    if (p != NULL)
+	my_free(p, p->len);
+}
+
+/*
+ * Choosing k packets out of more. Any k distinct packets decode, so
+ * the choice is only about cost: each parity used means one source
+ * to rebuild (k addmuls), so it is charged the caller's fetch cost
+ * plus rebuild, and the k cheapest are taken. On equal cost sources
+ * come first, then parities whose row is already in the cache.
+ */
+struct cand {
+    double cost ;
+    int rank ;		/* 0 source, 1 cached parity, 2 other parity */
+    int pos ;		/* in index[] */
+} ;
+
+static int
+cand_cmp(const void *a1, const void *b1)
+{
+    const struct cand *a = a1, *b = b1 ;
+
+    if (a->cost != b->cost)
+	return a->cost < b->cost ? -1 : 1 ;
+    if (a->rank != b->rank)
+	return a->rank - b->rank ;
+    return a->pos - b->pos ;
+}
+
+/*
+ * index[0..navail-1] are the packets available (or that could be
+ * fetched), cost[] their costs (NULL for all 0), rebuild the cost of
+ * rebuilding a source in the same units. On return pick[0..k-1] are
+ * positions in index[] of the packets to use, arranged as fec_decode()
+ * wants them: a chosen source j is at pick[j].
+ */
+int
+fec_choose(void *code1, const int index[], int navail, const double cost[],
+	double rebuild, int pick[])
+{
+    struct fec_parms *code = code1 ;
+    struct cand *c ;
+    char *seen ;
+    int i, j, k = code->k, err = FEC_OK ;
+
+    if (navail < k)
+	return FEC_EINVAL ;
+    c = my_malloc(navail * sizeof(struct cand));
+    seen = my_malloc(code->n);
+    if (c == NULL || seen == NULL) {
+	err = FEC_ENOMEM ;
+	goto done ;
+    }
+    bzero(seen, code->n);
+    for (i = 0 ; i < navail ; i++) {
+	j = index[i] ;
+	if (j < 0 || j >= code->n || seen[j]) {
+	    err = FEC_EINVAL ;
+	    goto done ;
+	}
+	seen[j] = 1 ;
+	c[i].pos = i ;
+	c[i].cost = cost != NULL ? cost[i] : 0 ;
+	if (j < k)
+	    c[i].rank = 0 ;
+	else {
+	    c[i].cost += rebuild ;
+	    c[i].rank = code->map != NULL ||
+		LOAD_ACQ(&code->tag[(j - k) % code->nslots]) == j ? 1 : 2 ;
 	}
     }
-    /*
-     * move pkts to their final destination
-     */
-    for (row = 0 ; row < k ; row++ ) {
-	if (index[row] >= k) {
-	    bcopy(new_pkt[row], pkt[row], sz*sizeof(gf));
-	    free(new_pkt[row]);
+    qsort(c, navail, sizeof(struct cand), cand_cmp);
+    for (j = 0 ; j < k ; j++)
+	pick[j] = -1 ;
+    for (i = 0 ; i < k ; i++)	/* the sources to their place */
+	if (index[c[i].pos] < k)
+	    pick[index[c[i].pos]] = c[i].pos ;
+    for (j = 0, i = 0 ; i < k ; i++)	/* parities in the holes */
+	if (index[c[i].pos] >= k) {
+	    while (pick[j] >= 0)
+		j++ ;
+	    pick[j] = c[i].pos ;
+	}
+done:
+    my_free(c, navail * sizeof(struct cand));
+    my_free(seen, code->n);
+    return err ;
+}
+
+/*
+ * fec_decode() from the navail > k packets in pkt[], using the k that
+ * cost least to decode. pkt[] and index[] are reordered so that the
+ * chosen ones come first; on return pkt[0..k-1] are the sources.
+ */
+int
+fec_decode_any(void *code, void *pkt[], int index[], int navail, int sz)
+{
+    int k = ((struct fec_parms *)code)->k, i, j, err ;
+    int *pick = my_malloc(navail * 2 * sizeof(int)) ;
+    void **p = my_malloc(navail * sizeof(void *)) ;
+    char *used = my_malloc(navail) ;
+
+    if (pick == NULL || p == NULL || used == NULL) {
+	err = FEC_ENOMEM ;
+	goto done ;
+    }
+    bzero(used, navail);
+    err = fec_choose(code, index, navail, NULL, 0, pick);
+    if (err != FEC_OK)
+	goto done ;
+    for (i = 0 ; i < k ; i++)
+	used[pick[i]] = 1 ;
+    for (j = k, i = 0 ; i < navail ; i++)	/* the others after them */
+	if (!used[i])
+	    pick[j++] = i ;
+    for (i = 0 ; i < navail ; i++) {
+	p[i] = pkt[pick[i]] ;
+	pick[navail + i] = index[pick[i]] ;
+    }
+    bcopy(p, pkt, navail * sizeof(void *));
+    bcopy(pick + navail, index, navail * sizeof(int));
+    err = fec_decode(code, pkt, index, sz);
+done:
+    my_free(pick, navail * 2 * sizeof(int));
+    my_free(p, navail * sizeof(void *));
+    my_free(used, navail);
+    return err ;
+}
+
+/*
+ * Batches of small blocks, interleaved: packet slot i of nb blocks is
+ * one buffer of nb*sz bytes, element e of block b at e*nb + b (an
+ * element is a byte, or two with GF_BITS > 8). All blocks use the
+ * same coefficients, so encoding is an ordinary encode of nb*sz
+ * bytes, and the kernels run across blocks with one call per source
+ * instead of one per source and block.
+ */
+int
+fec_encode_batch(void *code, void *src[], void *dst, int index, int sz,
+	int nb)
+{
+    if (nb < 1 || sz < 0 || sz % sizeof(gf) != 0)
+	return FEC_EINVAL ;
+    return fec_encode(code, src, dst, index, sz * nb);
+}
+
+/*
+ * Decoding: index[b*k + i] is the index of the packet in slot i of
+ * block b. Blocks that have their sources in order are left alone.
+ * The others are taken one erasure pattern at a time. When at least
+ * 1/BATCH_GROUP of the batch shares the pattern, the kernels run
+ * over the whole interleaved buffers, as for encoding, and the
+ * results are stored in the lanes of those blocks only. Each block
+ * of a rarer pattern is copied out, decoded with the plan of its
+ * pattern and copied back. On return slot i holds source i of every
+ * block and index[] is the identity. All the indexes are checked
+ * first: if a block has invalid ones, FEC_EINVAL is returned and
+ * nothing is decoded.
+ */
+#define BATCH_GROUP	8
+#define BATCH_OUT(p, j)	((gf *)((char *)(p)->buf + (j) * (p)->stride))
+
+/*
+ * in[] must be k distinct indexes below n. mark[] has n entries,
+ * none equal to stamp yet.
+ */
+static int
+batch_check(struct fec_parms *code, const int in[], int mark[], int stamp)
+{
+    int i ;
+
+    for (i = 0 ; i < code->k ; i++) {
+	if (in[i] < 0 || in[i] >= code->n || mark[in[i]] == stamp)
+	    return FEC_EINVAL ;
+	mark[in[i]] = stamp ;
+    }
+    return FEC_OK ;
+}
+
+/*
+ * decode the nl blocks lanes[] with pattern in[] at full width. The
+ * plan gives the rows of the missing sources over the slots as
+ * shuffle() arranges them; perm[] maps these positions back to the
+ * slots, and the sources received in the wrong slot (mv[]) are moved
+ * lane by lane along with the stores of the rebuilt ones.
+ */
+static int
+batch_wide(struct fec_parms *code, gf **pkt, const int in[], int ne, int nb,
+	const int lanes[], int nl)
+{
+    struct fec_plan *p ;
+    int k = code->k, i, j, g, e, col, nmv, *perm, *mv ;
+    size_t x, len = ALIGN_UP(2 * k * sizeof(int)) + k * sizeof(gf) ;
+    gf *m, *v ;
+    char *q ;
+
+    if ( (p = fec_plan_decode(code, in, ne * nb * sizeof(gf))) == NULL)
+	return FEC_ENOMEM ;	/* the indexes were checked */
+    if ( (q = my_malloc(len)) == NULL) {
+	fec_plan_free(p);
+	return FEC_ENOMEM ;
+    }
+    perm = (int *)q ;
+    mv = perm + k ;
+    v = (gf *)(q + ALIGN_UP(2 * k * sizeof(int))) ;
+    for (i = 0 ; i < k ; i++)
+	perm[i] = i ;
+    for (i = 0 ; i < p->nswap ; i++)
+	SWAP(perm[p->swap[2*i]], perm[p->swap[2*i + 1]], int) ;
+    for (nmv = 0, i = 0 ; i < k ; i++) {
+	for (j = 0 ; j < p->nout && p->outpos[j] != i ; j++)
+	    ;
+	if (j == p->nout && perm[i] != i)
+	    mv[nmv++] = i ;
+    }
+    for (j = 0 ; j < p->nout ; j++) {
+	m = p->rows + (size_t)j * k ;
+	bzero(BATCH_OUT(p, j), (size_t)p->sz * sizeof(gf));
+	for (col = 0 ; col < k ; col++)
+	    if (m[col] != 0)
+		p->kernel(BATCH_OUT(p, j), pkt[perm[col]], m[col], p->sz);
+    }
+    if (nl == nb && nmv == 0) {
+	for (j = 0 ; j < p->nout ; j++)
+	    bcopy(BATCH_OUT(p, j), pkt[p->outpos[j]],
+		(size_t)p->sz * sizeof(gf));
+    } else {
+	for (e = 0 ; e < ne ; e++)
+	    for (g = 0 ; g < nl ; g++) {
+		x = (size_t)e * nb + lanes[g] ;
+		for (i = 0 ; i < nmv ; i++)
+		    v[i] = pkt[perm[mv[i]]][x] ;
+		for (i = 0 ; i < nmv ; i++)
+		    pkt[mv[i]][x] = v[i] ;
+		for (j = 0 ; j < p->nout ; j++)
+		    pkt[p->outpos[j]][x] = BATCH_OUT(p, j)[x] ;
+	    }
+    }
+    my_free(q, len);
+    fec_plan_free(p);
+    return FEC_OK ;
+}
+
+/*
+ * decode the nl blocks lanes[] with pattern in[] one by one.
+ */
+static int
+batch_narrow(struct fec_parms *code, gf **pkt, const int in[], int ne,
+	int nb, const int lanes[], int nl)
+{
+    int k = code->k, i, g, e ;
+    size_t blen = (size_t)k * ne * sizeof(gf), len ;
+    void *plan ;
+    gf *blk, **p ;
+
+    len = ALIGN_UP(blen) + k * sizeof(gf *) ;
+    if ( (plan = fec_plan_decode(code, in, ne * sizeof(gf))) == NULL)
+	return FEC_ENOMEM ;	/* the indexes were checked */
+    if ( (blk = my_malloc(len)) == NULL) {
+	fec_plan_free(plan);
+	return FEC_ENOMEM ;
+    }
+    p = (gf **)((char *)blk + ALIGN_UP(blen)) ;
+    for (g = 0 ; g < nl ; g++) {
+	for (i = 0 ; i < k ; i++) {
+	    p[i] = blk + (size_t)i * ne ;
+	    for (e = 0 ; e < ne ; e++)
+		p[i][e] = pkt[i][(size_t)e * nb + lanes[g]] ;
+	}
+	fec_plan_execute(plan, (void **)p);
+	for (i = 0 ; i < k ; i++)
+	    for (e = 0 ; e < ne ; e++)
+		pkt[i][(size_t)e * nb + lanes[g]] = p[i][e] ;
+    }
+    my_free(blk, len);
+    fec_plan_free(plan);
+    return FEC_OK ;
+}
+
+int
+fec_decode_batch(void *code1, void *pkt1[], int index[], int sz, int nb)
+{
+    struct fec_parms *code = code1 ;
+    gf **pkt = (gf **)pkt1 ;
+    int k = code->k, ne = sz / sizeof(gf) ;
+    int b, c, i, nl, *in, *mark, *lanes, err = FEC_OK ;
+    size_t mlen = code->n * sizeof(int), llen ;
+
+    if (nb < 1 || sz < 0 || sz % sizeof(gf) != 0)
+	return FEC_EINVAL ;
+    llen = nb * sizeof(int) ;
+    mark = my_malloc(mlen);
+    lanes = my_malloc(llen);
+    if (mark == NULL || lanes == NULL) {
+	err = FEC_ENOMEM ;
+	goto done ;
+    }
+    bzero(mark, mlen);
+    for (b = 0 ; b < nb && err == FEC_OK ; b++)
+	err = batch_check(code, index + (size_t)b * k, mark, b + 1);
+    for (b = 0 ; b < nb && err == FEC_OK ; b++) {
+	in = index + (size_t)b * k ;
+	for (i = 0 ; i < k && in[i] == i ; i++)
+	    ;
+	if (i == k)
+	    continue ;
+	for (nl = 0, c = b ; c < nb ; c++)	/* the blocks with this pattern */
+	    if (!bcmp(index + (size_t)c * k, in, k * sizeof(int)))
+		lanes[nl++] = c ;
+	if (nl * BATCH_GROUP >= nb)
+	    err = batch_wide(code, pkt, in, ne, nb, lanes, nl);
+	else
+	    err = batch_narrow(code, pkt, in, ne, nb, lanes, nl);
+	for (c = 0 ; err == FEC_OK && c < nl ; c++)
+	    for (i = 0 ; i < k ; i++)
+		index[(size_t)lanes[c] * k + i] = i ;
+    }
+done:
+    my_free(mark, mlen);
+    my_free(lanes, llen);
+    return err ;
+}
+
+/*
+ * Variable length packets. Source i has len[i] bytes and counts as
+ * padded with zeros up to the parity size sz, but the padding is
+ * never touched: the addmul for each source stops at its end. After
+ * its sz bytes a parity carries a FEC_LEN_TRAILER byte trailer, the
+ * same combination of the source lengths (each as a 2-byte big
+ * endian packet), from which decoding recovers the lengths of the
+ * sources it rebuilds.
+ */
+static void
+addmul_len(gf *dst, const void *src, gf c, int len)
+{
+    int n = len / sizeof(gf) ;
+    gf t = 0 ;
+
+    addmul(dst, (gf *)src, c, n);
+    if (len % sizeof(gf)) {	/* last byte of an odd length */
+	bcopy((const char *)src + n * sizeof(gf), &t, len % sizeof(gf));
+	addmul(dst + n, &t, c, 1);
+    }
+}
+
+static void
+addmul_trailer(gf *dst, int len, gf c)
+{
+    gf t[FEC_LEN_TRAILER / sizeof(gf)] ;
+
+    ((u_char *)t)[0] = len >> 8 ;
+    ((u_char *)t)[1] = len ;
+    addmul(dst, t, c, FEC_LEN_TRAILER / sizeof(gf));
+}
+
+/*
+ * produce packet index from the k sources of len[] bytes. A source
+ * is copied as is (len[index] bytes); a parity has sz bytes, at
+ * least the longest source (and even with GF_BITS=16), followed by
+ * the trailer, so dst must have room for sz + FEC_LEN_TRAILER.
+ */
+int
+fec_encode_var(void *code1, void *src[], int len[], void *dst, int index,
+	int sz)
+{
+    struct fec_parms *code = code1 ;
+    struct fec_scratch *s = NULL ;
+    int j, k = code->k, w = sz / sizeof(gf) ;
+    gf *p, *out = dst ;
+
+    if (index < 0 || index >= code->n || sz < 0 || sz > 0xffff ||
+	    sz % sizeof(gf))
+	return FEC_EINVAL ;
+    for (j = 0 ; j < k ; j++)
+	if (len[j] < 0 || len[j] > sz)
+	    return FEC_EINVAL ;
+    if (index < k) {
+	bcopy(src[index], dst, len[index]);
+	return FEC_OK ;
+    }
+    if (ALL_ROWS_CACHED(code))
+	p = parity_row(code, index, NULL);
+    else {
+	if ( (s = get_scratch(code)) == NULL)
+	    return FEC_ENOMEM ;
+	p = parity_row(code, index, s->row);
+    }
+    bzero(out, sz + FEC_LEN_TRAILER);
+    for (j = 0 ; j < k ; j++) {
+	addmul_len(out, src[j], p[j], len[j]);
+	addmul_trailer(out + w, len[j], p[j]);
+    }
+    if (s != NULL)
+	put_scratch(code, s);
+    return FEC_OK ;
+}
+
+/*
+ * like fec_decode, for packets from fec_encode_var(). len[i] is the
+ * length of pkt[i] if it is a source, parities have sz bytes plus
+ * the trailer. On return pkt[], index[] are as after fec_decode and
+ * len[i] is the length of source i; a rebuilt source is in a parity
+ * buffer, zero padded to sz.
+ */
+int
+fec_decode_var(void *code1, void *pkt1[], int index[], int len[], int sz)
+{
+    struct fec_parms *code = code1 ;
+    struct fec_scratch *s ;
+    gf **pkt = (gf **)pkt1, *m, *t ;
+    int col, j, l, nout, err, k = code->k, w = sz / sizeof(gf) ;
+    int tw = FEC_LEN_TRAILER / sizeof(gf) ;
+
+    if (sz < 0 || sz > 0xffff || sz % sizeof(gf))
+	return FEC_EINVAL ;
+    for (j = 0 ; j < k ; j++)
+	if (index[j] < k && (len[j] < 0 || len[j] > sz))
+	    return FEC_EINVAL ;
+    if ( (s = get_scratch(code)) == NULL)
+	return FEC_ENOMEM ;
+    for (j = 0 ; j < k ; j++)	/* lengths by source, through shuffle() */
+	if (index[j] >= 0 && index[j] < k)
+	    s->lost[index[j]] = len[j] ;
+    if (shuffle(pkt, index, k, NULL) < 0) {
+	err = FEC_EINVAL ;
+	goto done ;
+    }
+    err = build_decode_matrix(code, s, index);
+    if (err != FEC_OK)
+	goto done ;
+    for (nout = 0, j = 0 ; j < k ; j++)
+	if (index[j] >= k) {
+	    s->outpos[nout] = j ;
+	    s->rows[nout++] = &s->matrix[j*k] ;
+	}
+    err = scratch_bufs(s, nout, w + tw);
+    if (err != FEC_OK)
+	goto done ;
+    for (j = 0 ; j < nout ; j++) {
+	m = s->rows[j] ;
+	t = s->new_pkt[j] ;
+	bzero(t, sz + FEC_LEN_TRAILER);
+	for (col = 0 ; col < k ; col++)
+	    if (index[col] < k) {
+		addmul_len(t, pkt[col], m[col], s->lost[col]);
+		addmul_trailer(t + w, s->lost[col], m[col]);
+	    } else	/* with its trailer */
+		addmul(t, pkt[col], m[col], w + tw);
+	l = ((u_char *)(t + w))[0] << 8 | ((u_char *)(t + w))[1] ;
+	if (l > sz) {	/* damaged trailer */
+	    err = FEC_EINVAL ;
+	    goto done ;
 	}
+	s->lost[s->outpos[j]] = l ;
     }
-    free(new_pkt);
-    free(m_dec);
+    for (j = 0 ; j < nout ; j++)
+	bcopy(s->new_pkt[j], pkt[s->outpos[j]], sz);
+    for (j = 0 ; j < k ; j++)
+	len[j] = s->lost[j] ;
+done:
+    put_scratch(code, s);
+    return err ;
+}
 
-    return 0;
+/*
+ * Codes on disk. fec_save() writes the weights and all the parity
+ * rows of a code, fec_open() maps such a file read only, so that
+ * opening is a few system calls and the pages of the rows are shared
+ * by all the processes using the same file. The format, in host byte
+ * order, is a struct fec_file, the k weights, and the n-k rows of k
+ * elements starting at the next page boundary (so they stay aligned
+ * for the kernels). Two CRC32Cs protect the header and the rest.
+ */
+#define FEC_FILE_MAGIC		0x31434546	/* "FEC1" little endian */
+#define FEC_FILE_VERSION	1
+#define FEC_FILE_ALIGN		4096
+
+struct fec_file {
+    uint32_t magic ;		/* also tells the byte order */
+    uint32_t version ;
+    uint32_t gf_bits ;
+    uint32_t poly ;		/* the field, bit i for x^i */
+    uint32_t k, n ;
+    uint64_t rows_off ;		/* offset of the parity rows */
+    uint64_t len ;		/* of the whole file */
+    uint32_t crc ;		/* of everything after the header */
+    uint32_t hcrc ;		/* of the header before this field */
+} ;
+
+#define ROWS_OFF(k) (((sizeof(struct fec_file) + (k) * sizeof(gf)) + \
+	FEC_FILE_ALIGN - 1) & ~(uint64_t)(FEC_FILE_ALIGN - 1))
+
+static uint32_t
+field_poly(void)
+{
+    uint32_t poly = 0 ;
+    int i ;
+
+    for (i = 0 ; i <= GF_BITS ; i++)
+	if (allPp[GF_BITS][i] == '1')
+	    poly |= 1u << i ;
+    return poly ;
+}
+
+static int
+write_all(int fd, const void *buf, size_t len, uint32_t *crc)
+{
+    const char *p = buf ;
+    ssize_t r ;
+
+    if (crc != NULL)
+	*crc = fec_crc32c(*crc, buf, len);
+    while (len > 0) {
+	r = write(fd, p, len) ;
+	if (r < 0 && errno == EINTR)
+	    continue ;
+	if (r <= 0)
+	    return FEC_ESYS ;
+	p += r ;
+	len -= r ;
+    }
+    return FEC_OK ;
+}
+
+/*
+ * write code to path: a temporary file in the same directory is
+ * renamed over path when complete, so readers never see part of it.
+ * Returns FEC_ESYS with errno set if a system call fails.
+ */
+int
+fec_save(void *code1, const char *path)
+{
+    struct fec_parms *code = code1 ;
+    int i, fd, err = FEC_ENOMEM, k = code->k ;
+    size_t plen = strlen(path) + 8, rlen = FEC_FILE_ALIGN + k * sizeof(gf) ;
+    char *tmp = my_malloc(plen) ;
+    gf *row = my_malloc(rlen) ;
+    struct fec_file h ;
+
+    if (tmp == NULL || row == NULL)
+	goto done ;
+    snprintf(tmp, plen, "%sXXXXXX", path);
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+	err = FEC_ESYS ;
+	goto done ;
+    }
+    bzero(&h, sizeof(h));
+    h.magic = FEC_FILE_MAGIC ;
+    h.version = FEC_FILE_VERSION ;
+    h.gf_bits = GF_BITS ;
+    h.poly = field_poly() ;
+    h.k = k ;
+    h.n = code->n ;
+    h.rows_off = ROWS_OFF(k) ;
+    h.len = h.rows_off + (uint64_t)(code->n - k) * k * sizeof(gf) ;
+    /* the header is written again at the end, with the CRCs */
+    err = write_all(fd, &h, sizeof(h), NULL);
+    if (err == FEC_OK)
+	err = write_all(fd, code->weights, k * sizeof(gf), &h.crc);
+    bzero(row, FEC_FILE_ALIGN);
+    if (err == FEC_OK)
+	err = write_all(fd, row, h.rows_off - sizeof(h) - k * sizeof(gf),
+	    &h.crc);
+    for (i = k ; err == FEC_OK && i < code->n ; i++)
+	err = write_all(fd, parity_row(code, i, row), k * sizeof(gf),
+	    &h.crc);
+    h.hcrc = fec_crc32c(0, &h, offsetof(struct fec_file, hcrc));
+    if (err == FEC_OK && (pwrite(fd, &h, sizeof(h), 0) != sizeof(h) ||
+	    fchmod(fd, 0644) < 0))
+	err = FEC_ESYS ;
+    if (close(fd) < 0 && err == FEC_OK)
+	err = FEC_ESYS ;
+    if (err == FEC_OK && rename(tmp, path) < 0)
+	err = FEC_ESYS ;
+    if (err != FEC_OK) {
+	i = errno ;
+	unlink(tmp);
+	errno = i ;
+    }
+done:
+    my_free(tmp, plen);
+    my_free(row, rlen);
+    return err ;
+}
+
+/*
+ * map a file written by fec_save(). The code can be used as one from
+ * fec_new(), and fec_free() unmaps it. Unless flags has
+ * FEC_OPEN_NOVERIFY the CRC of the whole file is checked, which
+ * reads all of it. Returns NULL with errno set on failure, EINVAL
+ * if the file is corrupt or was made for another field.
+ */
+void *
+fec_open(const char *path, int flags)
+{
+    struct fec_parms *code = NULL ;
+    struct fec_file *h ;
+    struct stat st ;
+    void *map ;
+    int fd ;
+
+    if (fec_initialized == 0)
+	init_fec();
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+	return NULL ;
+    if (fstat(fd, &st) < 0) {
+	close(fd);
+	return NULL ;
+    }
+    if (st.st_size < (off_t)sizeof(struct fec_file)) {
+	close(fd);
+	errno = EINVAL ;
+	return NULL ;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+	return NULL ;
+    h = map ;
+    if (h->magic != FEC_FILE_MAGIC || h->version != FEC_FILE_VERSION ||
+	    h->hcrc != fec_crc32c(0, h, offsetof(struct fec_file, hcrc)) ||
+	    h->gf_bits != GF_BITS || h->poly != field_poly() ||
+	    h->k < 1 || h->k > h->n || h->n > GF_SIZE + 1 ||
+	    h->rows_off != ROWS_OFF(h->k) || h->len != (uint64_t)st.st_size ||
+	    h->len != h->rows_off +
+		(uint64_t)(h->n - h->k) * h->k * sizeof(gf) ||
+	    (!(flags & FEC_OPEN_NOVERIFY) && h->crc != fec_crc32c(0,
+		(char *)map + sizeof(*h), h->len - sizeof(*h)))) {
+	errno = EINVAL ;
+	goto fail ;
+    }
+    code = my_malloc(sizeof(struct fec_parms));
+    if (code == NULL) {
+	errno = ENOMEM ;
+	goto fail ;
+    }
+    bzero(code, sizeof(struct fec_parms));
+    code->k = h->k ;
+    code->n = h->n ;
+    code->nslots = h->n - h->k ;
+    code->weights = (gf *)(h + 1) ;
+    code->rows = (gf *)((char *)map + h->rows_off) ;
+    code->map = map ;
+    code->map_len = h->len ;
+    code->magic = ( ( FEC_MAGIC ^ code->k) ^ code->n) ^
+	(u_long)(code->weights) ;
+    return code ;
+
+fail:
+    munmap(map, st.st_size);
+    return NULL ;
 }
 
 /*********** end of FEC code -- beginning of test code ************/
@@ -43,11 +43,187 @@
 #endif
 
 #define	GF_SIZE ((1 << GF_BITS) - 1)	/* powers of \alpha */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if (GF_BITS <= 8)
+typedef unsigned char fec_gf ;	/* a field element, as stored in packets */
+#else
+typedef unsigned short fec_gf ;
+#endif
+
+/*
+ * Error codes returned by the library. fec_new() returns NULL on
+ * failure, the other functions return one of these.
+ */
+#define FEC_OK		0
+#define FEC_EINVAL	1	/* bad index, duplicate packets, singular */
+#define FEC_ENOMEM	2	/* the allocator failed */
+#define FEC_ESYS	3	/* a system call failed, see errno */
+#define FEC_EMISMATCH	4	/* fec_verify(): a parity does not match */
+#define FEC_EMORE	5	/* rl_dec_decode(): not enough packets yet */
+#define FEC_EAGAIN	6	/* fec_shm_post(): too many requests in flight */
+
+/*
+ * All memory is obtained through a pluggable allocator. alloc() must
+ * return a block of at least sz bytes aligned to 'align' (a power of 2),
+ * or NULL; free() is called with the same size used to allocate.
+ * Passing NULL to fec_set_allocator() restores the default one.
+ * The allocator must be set before creating any code.
+ */
+struct fec_allocator {
+    void *(*alloc)(void *arg, size_t sz, size_t align) ;
+    void (*free)(void *arg, void *p, size_t sz) ;
+    void *arg ;
+} ;
+void fec_set_allocator(struct fec_allocator *a) ;
+
 void fec_free(void *p) ;
 void * fec_new(int k, int n) ;
+void fec_params(void *code, int *k, int *n) ;
 
 void init_fec() ;
-void fec_encode(void *code, void *src[], void *dst, int index, int sz) ;
+int fec_encode(void *code, void *src[], void *dst, int index, int sz) ;
 int fec_decode(void *code, void *pkt[], int index[], int sz) ;
+int fec_decode_range(void *code, void *pkt[], int index[], int off, int len) ;
+int fec_decode_sel(void *code, void *pkt[], int index[], int want[], int nwant,
+	int off, int len) ;
+
+/*
+ * variants that also return the CRC32C of the packets they produce,
+ * computed in the same pass. fec_crc32c() checksums a buffer.
+ */
+int fec_encode_crc(void *code, void *src[], void *dst, int index, int sz,
+	uint32_t *crc) ;
+int fec_decode_crc(void *code, void *pkt[], int index[], int sz,
+	uint32_t crc[]) ;
+uint32_t fec_crc32c(uint32_t crc, const void *buf, size_t len) ;
+
+/*
+ * Decode plans: fec_plan_decode() does the index checks and matrix
+ * work of fec_decode() for one pattern of index[] and packet size,
+ * fec_plan_execute() applies it to the packets of any number of
+ * blocks received with that pattern. NULL if index[] is invalid.
+ * fec_plan_execute_range() decodes bytes off..off+len-1 only, and
+ * permutes index[] too if not NULL; disjoint ranges of one plan may
+ * run concurrently.
+ */
+void * fec_plan_decode(void *code, const int index[], int sz) ;
+int fec_plan_execute(void *plan, void *pkt[]) ;
+int fec_plan_execute_range(void *plan, void *pkt[], int index[], int off,
+	int len) ;
+void fec_plan_free(void *plan) ;
+
+/*
+ * fec_verify() checks that the npar parities par[] (indexes index[])
+ * match the k sources, in one pass over the data with no allocation
+ * when all parity rows are cached. Returns FEC_EMISMATCH if some do
+ * not, and then bad[j] (if not NULL) is 1 for each such parity.
+ */
+int fec_verify(void *code, void *src[], void *par[], int index[], int npar,
+	int sz, int bad[]) ;
+
+/*
+ * With more than k packets, fec_choose() picks the k to decode from,
+ * preferring sources and cheap ones: cost[] is the cost of fetching
+ * each (NULL if none), rebuild that of rebuilding a source. pick[]
+ * gets positions in index[], a chosen source j at pick[j].
+ * fec_decode_any() chooses and decodes.
+ */
+int fec_choose(void *code, const int index[], int navail, const double cost[],
+	double rebuild, int pick[]) ;
+int fec_decode_any(void *code, void *pkt[], int index[], int navail, int sz) ;
+
+/*
+ * Batches of nb small blocks with the same k, n and sz, interleaved:
+ * the buffer of packet slot i holds element e (a byte, two with
+ * GF_BITS > 8) of block b at e*nb + b. For decoding, index[b*k + i]
+ * is the packet in slot i of block b.
+ */
+int fec_encode_batch(void *code, void *src[], void *dst, int index, int sz,
+	int nb) ;
+int fec_decode_batch(void *code, void *pkt[], int index[], int sz, int nb) ;
+
+/*
+ * fec_encode_block() produces packets index[0..nout-1] into dst[],
+ * sources and parities alike, reading each source packet once.
+ */
+int fec_encode_block(void *code, void *src[], void *dst[], int index[],
+	int nout, int sz) ;
+
+/*
+ * variable length sources: len[i] bytes each, parities of sz bytes
+ * (the longest source or more) followed by a trailer that lets
+ * fec_decode_var() restore the lengths of the rebuilt sources.
+ */
+#define FEC_LEN_TRAILER	2
+
+int fec_encode_var(void *code, void *src[], int len[], void *dst, int index,
+	int sz) ;
+int fec_decode_var(void *code, void *pkt[], int index[], int len[], int sz) ;
+
+/*
+ * field arithmetic and kernels, for codes built on top of this one.
+ * fec_addmul() computes dst[] += c * src[] over sz bytes.
+ */
+int fec_gf_mul(int a, int b) ;
+int fec_gf_inv(int a) ;
+void fec_addmul(void *dst, const void *src, int c, int sz) ;
+int fec_matrix_row(void *code, int index, fec_gf row[]) ;
+
+/*
+ * The addmul kernels: "table" (lookups) and "swar64" (portable 64-bit
+ * words, no tables). At init each is timed on a few packet sizes and
+ * the fastest is used for each size class, unless the FEC_KERNEL
+ * environment variable names one. fec_set_kernel() forces a kernel,
+ * or with NULL restores the measured choice.
+ */
+#define FEC_NCLASSES	3
+#define FEC_MAXKERNELS	8
+
+struct fec_kernel_info {
+    int max_sz ;		/* packets up to max_sz bytes, 0: no limit */
+    int bench_sz ;		/* the size that was timed */
+    int nkernels ;
+    const char *name[FEC_MAXKERNELS] ;
+    double mbps[FEC_MAXKERNELS] ;	/* 0 if not measured */
+    int chosen ;		/* index of the kernel in use */
+} ;
+
+int fec_set_kernel(const char *name) ;
+const char * fec_kernel_name(int sz) ;
+int fec_kernel_info(int cls, struct fec_kernel_info *info) ;
+
+/*
+ * Once a runner is set, decoding matrices of large codes (k >= 128)
+ * are inverted by panels, and the row updates of each panel are split
+ * in tasks handed to the runner: run(arg, fn, ctx, n) must call
+ * fn(ctx, i) for i = 0..n-1, in any order and possibly concurrently,
+ * and return when all have returned. fec_pool_runner() in fec_pool.h
+ * uses a pool. NULL goes back to the single-threaded inversion.
+ */
+typedef void fec_task_fn(void *ctx, int i) ;
+typedef void fec_runner_fn(void *arg, fec_task_fn *fn, void *ctx, int n) ;
+
+void fec_set_runner(fec_runner_fn *run, void *arg) ;
+
+/*
+ * fec_save() writes a code to a file that fec_open() maps read only,
+ * sharing the parity rows among processes. A file is only accepted
+ * by a library built with the same GF_BITS.
+ */
+#define FEC_OPEN_NOVERIFY	1	/* check the header only */
+
+int fec_save(void *code, const char *path) ;
+void * fec_open(const char *path, int flags) ;
+
+#ifdef __cplusplus
+}
+#endif
 
 /* end of file */
@@ -0,0 +1,321 @@
+/*
+ * fec.hpp -- header-only C++ interface for codes with (k, n) known
+ * at compile time.
+ *
+ * FecCodec<K, N> implements the same code as fec.c with GF_BITS=8
+ * (packets are interchangeable with those of fec_encode() and
+ * fec_decode() for the same k and n), but the field tables and the
+ * encoding matrix are computed by the compiler. Each parity packet
+ * is produced in a single pass, with the sum over the K coefficients
+ * unrolled: terms with coefficient 0 disappear, those with
+ * coefficient 1 become plain XORs. Decoding inverts the matrix for
+ * the actual erasure pattern at run time, on fixed size arrays.
+ * Nothing is allocated on the heap.
+ *
+ * Requires C++20. Codes whose (k, n) are only known at run time
+ * should use fec_new() and friends.
+ */
+
+#ifndef FEC_HPP
+#define FEC_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <utility>
+
+namespace fec {
+
+namespace detail {
+
+/*
+ * GF(2^8) with the same primitive polynomial as fec.c,
+ * 1+x^2+x^3+x^4+x^8.
+ */
+constexpr int gf_bits = 8 ;
+constexpr int gf_size = (1 << gf_bits) - 1 ;
+constexpr unsigned gf_poly = 0x1d ;	/* x^8 reduction term */
+
+struct gf_tables {
+    std::array<uint8_t, 2 * gf_size> exp {} ;
+    std::array<int, gf_size + 1> log {} ;
+    std::array<uint8_t, gf_size + 1> inverse {} ;
+} ;
+
+constexpr gf_tables
+make_gf()
+{
+    gf_tables t ;
+    unsigned x = 1 ;
+
+    for (int i = 0 ; i < gf_size ; i++) {
+	t.exp[i] = t.exp[i + gf_size] = x ;
+	t.log[x] = i ;
+	x <<= 1 ;
+	if (x & 0x100)
+	    x = (x ^ gf_poly) & 0xff ;
+    }
+    t.log[0] = gf_size ;
+    t.inverse[1] = 1 ;
+    for (int i = 2 ; i <= gf_size ; i++)
+	t.inverse[i] = t.exp[gf_size - t.log[i]] ;
+    return t ;
+}
+
+inline constexpr gf_tables gf = make_gf() ;
+
+constexpr uint8_t
+gf_mul(uint8_t a, uint8_t b)
+{
+    return (a == 0 || b == 0) ? 0 : gf.exp[gf.log[a] + gf.log[b]] ;
+}
+
+inline constexpr auto mul_table = [] {
+    std::array<std::array<uint8_t, gf_size + 1>, gf_size + 1> t {} ;
+    for (int i = 0 ; i <= gf_size ; i++)
+	for (int j = 0 ; j <= gf_size ; j++)
+	    t[i][j] = gf_mul(i, j) ;
+    return t ;
+}() ;
+
+/*
+ * fast inversion of a vandermonde matrix, as invert_vdm() in fec.c
+ */
+template <int K>
+constexpr void
+invert_vdm(std::array<uint8_t, K * K> &src)
+{
+    if constexpr (K > 1) {
+	std::array<uint8_t, K> b {}, c {}, p {} ;
+
+	for (int i = 0 ; i < K ; i++)
+	    p[i] = src[i * K + 1] ;
+	c[K - 1] = p[0] ;
+	for (int i = 1 ; i < K ; i++) {
+	    for (int j = K - 1 - (i - 1) ; j < K - 1 ; j++)
+		c[j] ^= gf_mul(p[i], c[j + 1]) ;
+	    c[K - 1] ^= p[i] ;
+	}
+	for (int row = 0 ; row < K ; row++) {
+	    uint8_t xx = p[row], t = 1 ;
+
+	    b[K - 1] = 1 ;
+	    for (int i = K - 2 ; i >= 0 ; i--) {
+		b[i] = c[i + 1] ^ gf_mul(xx, b[i + 1]) ;
+		t = gf_mul(xx, t) ^ b[i] ;
+	    }
+	    for (int col = 0 ; col < K ; col++)
+		src[col * K + row] = gf_mul(gf.inverse[t], b[col]) ;
+	}
+    }
+}
+
+/*
+ * the N-K parity rows of the systematic encoding matrix, built as in
+ * fec_new(): vandermonde rows times the inverse of the top K*K block.
+ */
+template <int K, int N>
+constexpr std::array<uint8_t, (N - K) * K>
+make_parity()
+{
+    std::array<uint8_t, K * K> top {} ;
+    std::array<uint8_t, (N - K) * K> par {} ;
+    auto vdm = [](int row, int col) -> uint8_t {
+	if (row == 0)
+	    return col == 0 ;
+	return gf.exp[((row - 1) * col) % gf_size] ;
+    } ;
+
+    for (int row = 0 ; row < K ; row++)
+	for (int col = 0 ; col < K ; col++)
+	    top[row * K + col] = vdm(row, col) ;
+    invert_vdm<K>(top) ;
+    for (int row = 0 ; row < N - K ; row++)
+	for (int col = 0 ; col < K ; col++) {
+	    uint8_t acc = 0 ;
+	    for (int i = 0 ; i < K ; i++)
+		acc ^= gf_mul(vdm(K + row, i), top[i * K + col]) ;
+	    par[row * K + col] = acc ;
+	}
+    return par ;
+}
+
+/*
+ * one term of a sum, with the coefficient known at compile time.
+ */
+template <uint8_t C>
+inline uint8_t
+term(uint8_t x)
+{
+    if constexpr (C == 0)
+	return 0 ;
+    else if constexpr (C == 1)
+	return x ;
+    else
+	return mul_table[C][x] ;
+}
+
+} /* namespace detail */
+
+template <int K, int N>
+class FecCodec {
+    static_assert(K >= 1 && K <= N && N <= detail::gf_size + 1,
+	"FecCodec: need 1 <= K <= N <= 256") ;
+
+  public:
+    static constexpr int k = K ;
+    static constexpr int n = N ;
+    using src_type = std::span<const std::span<const uint8_t>, K> ;
+    using out_type = std::span<const std::span<uint8_t>, K> ;
+
+    /* row i of the matrix is the parity packet with index K + i */
+    static constexpr std::array<uint8_t, (N - K) * K> parity =
+	detail::make_parity<K, N>() ;
+
+    /*
+     * produce the packet with compile-time index I into dst, whose
+     * size gives the packet size.
+     */
+    template <int I>
+    static void
+    encode(src_type src, std::span<uint8_t> dst)
+    {
+	static_assert(I >= 0 && I < N, "FecCodec: index out of range") ;
+	if constexpr (I < K)
+	    std::memcpy(dst.data(), src[I].data(), dst.size()) ;
+	else
+	    encode_parity<I>(src, dst, std::make_index_sequence<K>()) ;
+    }
+
+    /*
+     * same with the index known at run time, dispatched through a
+     * table of the unrolled encoders. Returns false if out of range.
+     */
+    static bool
+    encode(src_type src, std::span<uint8_t> dst, int index)
+    {
+	if (index < 0 || index >= N)
+	    return false ;
+	encoders[index](src, dst) ;
+	return true ;
+    }
+
+    /*
+     * reconstruct the K source packets from K received ones, pkt[i]
+     * having index index[i]. out[j] receives source packet j (it
+     * may be the same buffer as a received packet with index j).
+     * Returns false if the indexes are invalid or duplicated.
+     */
+    static bool
+    decode(src_type pkt, std::span<const int, K> index, out_type out)
+    {
+	std::array<uint8_t, K * K> m {} ;
+	std::array<int, K> row_of {} ;	/* received packet for source j */
+	size_t sz = out[0].size() ;
+
+	row_of.fill(-1) ;
+	for (int i = 0 ; i < K ; i++) {
+	    if (index[i] < 0 || index[i] >= N)
+		return false ;
+	    if (index[i] < K) {
+		if (row_of[index[i]] >= 0)
+		    return false ;
+		row_of[index[i]] = i ;
+		m[i * K + index[i]] = 1 ;
+	    } else
+		for (int c = 0 ; c < K ; c++)
+		    m[i * K + c] = parity[(index[i] - K) * K + c] ;
+	}
+	if (!invert(m))
+	    return false ;
+	for (int j = 0 ; j < K ; j++) {
+	    if (row_of[j] >= 0) {
+		if (out[j].data() != pkt[row_of[j]].data())
+		    std::memcpy(out[j].data(), pkt[row_of[j]].data(), sz) ;
+		continue ;
+	    }
+	    const uint8_t *coef = &m[j * K] ;
+	    for (size_t b = 0 ; b < sz ; b++) {
+		uint8_t acc = 0 ;
+		for (int i = 0 ; i < K ; i++)	/* K is a constant */
+		    acc ^= detail::mul_table[coef[i]][pkt[i][b]] ;
+		out[j][b] = acc ;
+	    }
+	}
+	return true ;
+    }
+
+  private:
+    template <int I, size_t... J>
+    static void
+    encode_parity(src_type src, std::span<uint8_t> dst,
+	std::index_sequence<J...>)
+    {
+	const uint8_t *s[K] = { src[J].data()... } ;
+	uint8_t *d = dst.data() ;
+	size_t sz = dst.size() ;
+
+	for (size_t b = 0 ; b < sz ; b++)
+	    d[b] = (0 ^ ... ^
+		detail::term<parity[(I - K) * K + J]>(s[J][b])) ;
+    }
+
+    template <size_t... I>
+    static constexpr auto
+    make_encoders(std::index_sequence<I...>)
+    {
+	using fn = void (*)(src_type, std::span<uint8_t>) ;
+	return std::array<fn, N> { &FecCodec::encode<I>... } ;
+    }
+
+    static constexpr auto encoders =
+	make_encoders(std::make_index_sequence<N>()) ;
+
+    /*
+     * Gauss-Jordan inversion in place, on an augmented copy.
+     */
+    static bool
+    invert(std::array<uint8_t, K * K> &m)
+    {
+	std::array<uint8_t, K * K> inv {} ;
+
+	for (int i = 0 ; i < K ; i++)
+	    inv[i * K + i] = 1 ;
+	for (int col = 0 ; col < K ; col++) {
+	    int piv = col ;
+	    while (piv < K && m[piv * K + col] == 0)
+		piv++ ;
+	    if (piv == K)
+		return false ;
+	    if (piv != col)
+		for (int c = 0 ; c < K ; c++) {
+		    std::swap(m[piv * K + c], m[col * K + c]) ;
+		    std::swap(inv[piv * K + c], inv[col * K + c]) ;
+		}
+	    const uint8_t *mul = detail::mul_table[
+		detail::gf.inverse[m[col * K + col]]].data() ;
+	    for (int c = 0 ; c < K ; c++) {
+		m[col * K + c] = mul[m[col * K + c]] ;
+		inv[col * K + c] = mul[inv[col * K + c]] ;
+	    }
+	    for (int r = 0 ; r < K ; r++) {
+		uint8_t f = m[r * K + col] ;
+		if (r == col || f == 0)
+		    continue ;
+		mul = detail::mul_table[f].data() ;
+		for (int c = 0 ; c < K ; c++) {
+		    m[r * K + c] ^= mul[m[col * K + c]] ;
+		    inv[r * K + c] ^= mul[inv[col * K + c]] ;
+		}
+	    }
+	}
+	m = inv ;
+	return true ;
+    }
+} ;
+
+} /* namespace fec */
+
+#endif /* FEC_HPP */
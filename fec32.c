@@ -0,0 +1,450 @@
+/*
+ * fec32.c -- erasure code over GF(2^32)
+ *
+ * The field is GF(2)[x] / (x^32 + x^7 + x^3 + x^2 + 1). A product of
+ * two elements is a 63 bit carry-less product p = hi * x^32 + lo,
+ * and since x^32 = g = x^7 + x^3 + x^2 + 1 the reduction is
+ * lo + hi * g, where hi * g has 39 bits, whose top 7 are folded once
+ * more. This is Barrett reduction for a modulus whose low part has
+ * such a small degree: both multiplications by the constants become
+ * four shifts and xors. The carry-less product is one PCLMULQDQ
+ * where the CPU has it; elsewhere addmul uses four tables of 256
+ * products of the constant, built at each call (4KB on the stack).
+ *
+ * The code is systematic, parity i (k <= i < n) being
+ *
+ *	sum_j src[j] / (i + j)		0 <= j < k
+ *
+ * that is, rows of a Cauchy matrix with the packet indexes as the
+ * points (i + j is never 0 as i != j). Every square submatrix of a
+ * Cauchy matrix is invertible, so any k packets do, and nothing
+ * needs to be kept per code: the k inversions of a row are done in
+ * chunks with one real inversion each (Montgomery's trick).
+ *
+ * When decoding, with l sources lost and l parities in their place,
+ * the parities are first cleared of the received sources (l passes
+ * over k-l packets), which leaves an l x l Cauchy system whose
+ * inverse has a closed form,
+ *
+ *	B[b][a] = A(y_b) B(x_a) / (A'(x_a) B'(y_b) (x_a + y_b))
+ *
+ * with x_a the parity indexes, y_b the lost ones, A(z) = prod (z+x_a)
+ * and B(z) = prod (z+y_b); so it costs O(l^2) multiplications and
+ * O(l) memory, and l can be large too.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fec.h"
+#include "fec32.h"
+
+#define POLY_LOW	0x8d	/* x^7 + x^3 + x^2 + 1 */
+#define CHUNK		256	/* coefficients inverted together */
+#define TABLE_MIN	32	/* words, below this addmul_sw() uses mul_sw() */
+
+struct fec32 {
+    int k, n ;
+} ;
+
+static uint32_t
+reduce(uint64_t p)
+{
+    uint64_t h = p >> 32, t = h ^ h << 2 ^ h << 3 ^ h << 7 ;
+
+    h = t >> 32 ;
+    return (uint32_t)(p ^ t ^ h ^ h << 2 ^ h << 3 ^ h << 7) ;
+}
+
+static uint32_t
+mul_sw(uint32_t a, uint32_t b)
+{
+    uint64_t p = 0, x = a ;
+
+    for ( ; b != 0 ; b >>= 1, x <<= 1)
+	if (b & 1)
+	    p ^= x ;
+    return reduce(p);
+}
+
+static void
+addmul_sw(uint32_t *dst, const uint32_t *src, uint32_t c, int nw)
+{
+    uint32_t t[4][256], x ;
+    int b, i, v ;
+
+    if (nw < TABLE_MIN) {
+	for (i = 0 ; i < nw ; i++)
+	    dst[i] ^= mul_sw(src[i], c);
+	return ;
+    }
+    for (x = c, b = 0 ; b < 4 ; b++) {
+	t[b][0] = 0 ;
+	for (i = 0 ; i < 8 ; i++) {	/* x = c * x^(8b+i) */
+	    for (v = 0 ; v < 1 << i ; v++)
+		t[b][(1 << i) + v] = t[b][v] ^ x ;
+	    x = x << 1 ^ (x >> 31 ? POLY_LOW : 0) ;
+	}
+    }
+    for (i = 0 ; i < nw ; i++) {
+	x = src[i] ;
+	dst[i] ^= t[0][x & 0xff] ^ t[1][(x >> 8) & 0xff] ^
+	    t[2][(x >> 16) & 0xff] ^ t[3][x >> 24] ;
+    }
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <wmmintrin.h>
+#define HAVE_PCLMUL
+
+/* reduce the 64 bit products in the two lanes of x */
+#define REDUCE128(x, h, t) do {						\
+	h = _mm_srli_epi64(x, 32) ;					\
+	t = _mm_xor_si128(_mm_xor_si128(h, _mm_slli_epi64(h, 2)),	\
+	    _mm_xor_si128(_mm_slli_epi64(h, 3), _mm_slli_epi64(h, 7))) ; \
+	x = _mm_xor_si128(x, t) ;					\
+	h = _mm_srli_epi64(t, 32) ;					\
+	t = _mm_xor_si128(_mm_xor_si128(h, _mm_slli_epi64(h, 2)),	\
+	    _mm_xor_si128(_mm_slli_epi64(h, 3), _mm_slli_epi64(h, 7))) ; \
+	x = _mm_xor_si128(x, t) ;					\
+    } while (0)
+
+__attribute__((target("pclmul")))
+static uint32_t
+mul_clmul(uint32_t a, uint32_t b)
+{
+    __m128i p = _mm_clmulepi64_si128(_mm_cvtsi32_si128(a),
+	_mm_cvtsi32_si128(b), 0x00) ;
+
+    return reduce((uint64_t)_mm_cvtsi128_si64(p));
+}
+
+/*
+ * four words at a time: the even and odd ones go in the low half of
+ * the 64 bit lanes of two registers, each lane is multiplied by c,
+ * and the reduced results are put back together.
+ */
+__attribute__((target("pclmul")))
+static void
+addmul_clmul(uint32_t *dst, const uint32_t *src, uint32_t c, int nw)
+{
+    __m128i cv = _mm_cvtsi32_si128(c), lo = _mm_set1_epi64x(0xffffffff) ;
+    __m128i s, e, o, h, t ;
+    int i ;
+
+    for (i = 0 ; i + 4 <= nw ; i += 4) {
+	s = _mm_loadu_si128((const __m128i *)(src + i)) ;
+	e = _mm_and_si128(s, lo) ;
+	o = _mm_srli_epi64(s, 32) ;
+	e = _mm_unpacklo_epi64(_mm_clmulepi64_si128(e, cv, 0x00),
+	    _mm_clmulepi64_si128(e, cv, 0x01)) ;
+	o = _mm_unpacklo_epi64(_mm_clmulepi64_si128(o, cv, 0x00),
+	    _mm_clmulepi64_si128(o, cv, 0x01)) ;
+	REDUCE128(e, h, t);
+	REDUCE128(o, h, t);
+	s = _mm_or_si128(_mm_and_si128(e, lo), _mm_slli_epi64(o, 32)) ;
+	_mm_storeu_si128((__m128i *)(dst + i),
+	    _mm_xor_si128(_mm_loadu_si128((__m128i *)(dst + i)), s));
+    }
+    for ( ; i < nw ; i++)
+	dst[i] ^= mul_clmul(src[i], c);
+}
+#endif
+
+static uint32_t (*mul32)(uint32_t, uint32_t) = mul_sw ;
+static void (*addmul32)(uint32_t *, const uint32_t *, uint32_t, int) =
+	addmul_sw ;
+static const char *kernel_name = "table" ;
+static int fec32_initialized = 0 ;
+
+/*
+ * FEC32_KERNEL=table in the environment forces the portable kernel.
+ */
+static void
+init_fec32(void)
+{
+#ifdef HAVE_PCLMUL
+    char *e = getenv("FEC32_KERNEL") ;
+
+    if (__builtin_cpu_supports("pclmul") &&
+	    (e == NULL || strcmp(e, "table") != 0)) {
+	mul32 = mul_clmul ;
+	addmul32 = addmul_clmul ;
+	kernel_name = "pclmul" ;
+    }
+#endif
+    fec32_initialized = 1 ;
+}
+
+uint32_t
+fec32_mul(uint32_t a, uint32_t b)
+{
+    if (fec32_initialized == 0)
+	init_fec32();
+    return mul32(a, b);
+}
+
+/*
+ * a^(2^32 - 2), by 31 squarings and 30 multiplications; 0 for 0.
+ */
+uint32_t
+fec32_inv(uint32_t a)
+{
+    uint32_t r = a ;
+    int i ;
+
+    if (fec32_initialized == 0)
+	init_fec32();
+    for (i = 0 ; i < 30 ; i++)		/* r = a^(2^(i+2) - 1) */
+	r = mul32(mul32(r, r), a);
+    return mul32(r, r);
+}
+
+/*
+ * dst ^= c * src, over sz bytes (a multiple of 4).
+ */
+void
+fec32_addmul(void *dst, const void *src, uint32_t c, int sz)
+{
+    if (fec32_initialized == 0)
+	init_fec32();
+    if (c != 0)
+	addmul32(dst, src, c, sz / 4);
+}
+
+const char *
+fec32_kernel(void)
+{
+    if (fec32_initialized == 0)
+	init_fec32();
+    return kernel_name ;
+}
+
+/*
+ * replace the n (nonzero) elements of v with their inverses, using
+ * one inversion and 3(n-1) multiplications; tmp has room for n.
+ */
+static void
+inv_batch(uint32_t *v, uint32_t *tmp, int n)
+{
+    uint32_t acc = 1, t ;
+    int i ;
+
+    for (i = 0 ; i < n ; i++) {
+	tmp[i] = acc ;
+	acc = mul32(acc, v[i]);
+    }
+    acc = fec32_inv(acc);
+    for (i = n - 1 ; i >= 0 ; i--) {
+	t = mul32(acc, tmp[i]);
+	acc = mul32(acc, v[i]);
+	v[i] = t ;
+    }
+}
+
+void *
+fec32_new(int k, int n)
+{
+    struct fec32 *c ;
+
+    if (k < 1 || n < k)
+	return NULL ;
+    if (fec32_initialized == 0)
+	init_fec32();
+    c = malloc(sizeof(struct fec32));
+    if (c == NULL)
+	return NULL ;
+    c->k = k ;
+    c->n = n ;
+    return c ;
+}
+
+void
+fec32_free(void *code)
+{
+    free(code);
+}
+
+/*
+ * produce packet index (0 <= index < n) from the k sources.
+ */
+int
+fec32_encode(void *code, void *src[], void *dst, int index, int sz)
+{
+    struct fec32 *c = code ;
+    uint32_t d[CHUNK], tmp[CHUNK] ;
+    int j0, j, m ;
+
+    if (index < 0 || index >= c->n || sz < 0 || sz % 4 != 0)
+	return FEC_EINVAL ;
+    if (index < c->k) {
+	bcopy(src[index], dst, sz);
+	return FEC_OK ;
+    }
+    bzero(dst, sz);
+    for (j0 = 0 ; j0 < c->k ; j0 += CHUNK) {
+	m = c->k - j0 < CHUNK ? c->k - j0 : CHUNK ;
+	for (j = 0 ; j < m ; j++)
+	    d[j] = index ^ (j0 + j) ;
+	inv_batch(d, tmp, m);
+	for (j = 0 ; j < m ; j++)
+	    addmul32(dst, src[j0 + j], d[j], sz / 4);
+    }
+    return FEC_OK ;
+}
+
+/*
+ * move sources to their position, as shuffle() in fec.c; 1 if two
+ * packets have the same index.
+ */
+static int
+shuffle(void *pkt[], int index[], int k)
+{
+    void *p ;
+    int i, c ;
+
+    for (i = 0 ; i < k ; ) {
+	if (index[i] >= k || index[i] == i)
+	    i++ ;
+	else {
+	    c = index[i] ;
+	    if (index[c] == c)
+		return 1 ;
+	    index[i] = index[c] ;
+	    index[c] = c ;
+	    p = pkt[i] ;
+	    pkt[i] = pkt[c] ;
+	    pkt[c] = p ;
+	}
+    }
+    return 0 ;
+}
+
+/*
+ * u[b] = A(y_b) / B'(y_b), v[a] = B(x_a) / A'(x_a) for the closed
+ * form inverse; FEC_EINVAL if two parities are the same.
+ */
+static int
+cauchy_weights(uint32_t *x, uint32_t *y, uint32_t *u, uint32_t *v,
+	uint32_t *tmp, int l)
+{
+    uint32_t num, den ;
+    int a, b ;
+
+    for (b = 0 ; b < l ; b++) {
+	for (num = den = 1, a = 0 ; a < l ; a++) {
+	    num = mul32(num, y[b] ^ x[a]);
+	    if (a != b)
+		den = mul32(den, y[b] ^ y[a]);
+	}
+	u[b] = den ;
+	tmp[b] = num ;
+    }
+    inv_batch(u, tmp + l, l);
+    for (b = 0 ; b < l ; b++)
+	u[b] = mul32(u[b], tmp[b]);
+    for (a = 0 ; a < l ; a++) {
+	for (num = den = 1, b = 0 ; b < l ; b++) {
+	    num = mul32(num, x[a] ^ y[b]);
+	    if (a != b)
+		den = mul32(den, x[a] ^ x[b]);
+	}
+	if (den == 0)
+	    return FEC_EINVAL ;
+	v[a] = den ;
+	tmp[a] = num ;
+    }
+    inv_batch(v, tmp + l, l);
+    for (a = 0 ; a < l ; a++)
+	v[a] = mul32(v[a], tmp[a]);
+    return FEC_OK ;
+}
+
+/*
+ * Same interface as fec_decode(): pkt[i] holds packet index[i], and
+ * on return pkt[0..k-1] are the sources, the rebuilt ones in the
+ * buffers of the parities they replace.
+ */
+int
+fec32_decode(void *code, void *pkt[], int index[], int sz)
+{
+    struct fec32 *c = code ;
+    int k = c->k, nw = sz / 4, l = 0, i, j, j0, m, a, b, nt, err = FEC_OK ;
+    int *lost = NULL, *col ;
+    uint32_t *w = NULL, *x, *y, *u, *v, *row, *tmp, *out = NULL ;
+
+    if (sz < 0 || sz % 4 != 0)
+	return FEC_EINVAL ;
+    for (i = 0 ; i < k ; i++)
+	if (index[i] < 0 || index[i] >= c->n)
+	    return FEC_EINVAL ;
+    if (shuffle(pkt, index, k))
+	return FEC_EINVAL ;
+    for (i = 0 ; i < k ; i++)
+	if (index[i] != i)
+	    l++ ;
+    if (l == 0 || sz == 0)
+	return FEC_OK ;
+    nt = l > CHUNK ? l : CHUNK ;
+    lost = malloc((l + CHUNK) * sizeof(int));
+    w = malloc((4 * l + 3 * nt) * sizeof(uint32_t));
+    out = malloc((size_t)l * sz);
+    if (lost == NULL || w == NULL || out == NULL) {
+	err = FEC_ENOMEM ;
+	goto done ;
+    }
+    col = lost + l ;
+    x = w ;
+    y = x + l ;
+    u = y + l ;
+    v = u + l ;
+    tmp = v + l ;
+    row = tmp + 2 * nt ;
+    for (l = 0, i = 0 ; i < k ; i++)
+	if (index[i] != i) {
+	    lost[l] = i ;
+	    x[l] = index[i] ;
+	    y[l++] = i ;
+	}
+    err = cauchy_weights(x, y, u, v, tmp, l);
+    if (err != FEC_OK)
+	goto done ;
+
+    /* take the received sources out of the parities */
+    for (a = 0 ; a < l ; a++)
+	for (b = 0, j0 = 0 ; j0 < k ; j0 = j) {
+	    for (m = 0, j = j0 ; j < k && m < CHUNK ; j++) {
+		if (b < l && lost[b] == j) {
+		    b++ ;
+		    continue ;
+		}
+		col[m] = j ;
+		row[m++] = x[a] ^ j ;
+	    }
+	    if (m == 0)
+		continue ;
+	    inv_batch(row, tmp, m);
+	    for (i = 0 ; i < m ; i++)
+		addmul32(pkt[lost[a]], pkt[col[i]], row[i], nw);
+	}
+
+    /* and solve the l x l system */
+    for (b = 0 ; b < l ; b++) {
+	for (a = 0 ; a < l ; a++)
+	    row[a] = x[a] ^ y[b] ;
+	inv_batch(row, tmp, l);
+	bzero(out + (size_t)b * nw, sz);
+	for (a = 0 ; a < l ; a++)
+	    addmul32(out + (size_t)b * nw, pkt[lost[a]],
+		mul32(mul32(row[a], u[b]), v[a]), nw);
+    }
+    for (b = 0 ; b < l ; b++)
+	bcopy(out + (size_t)b * nw, pkt[lost[b]], sz);
+done:
+    free(lost);
+    free(w);
+    free(out);
+    return err ;
+}
+
+/* end of file */
@@ -0,0 +1,22 @@
+/*
+ * fec32.h -- erasure code over GF(2^32), for very long codes
+ *
+ * Same model as fec.h: k source packets, n-k parities, any k of the n
+ * packets give back the sources, but with 32 bit field elements k and
+ * n can go up to 2^31 and there are no tables. Packets are arrays of
+ * 32 bit words in host order, so sz must be a multiple of 4.
+ */
+
+#include <stdint.h>
+
+void * fec32_new(int k, int n) ;
+void fec32_free(void *code) ;
+int fec32_encode(void *code, void *src[], void *dst, int index, int sz) ;
+int fec32_decode(void *code, void *pkt[], int index[], int sz) ;
+
+uint32_t fec32_mul(uint32_t a, uint32_t b) ;
+uint32_t fec32_inv(uint32_t a) ;
+void fec32_addmul(void *dst, const void *src, uint32_t c, int sz) ;
+const char * fec32_kernel(void) ;
+
+/* end of file */
@@ -0,0 +1,198 @@
+/*
+ * fec_bench.c -- loopback UDP benchmark for the session layer
+ *
+ * A sender thread pushes blocks through fec_tx_send() to a receiver
+ * on 127.0.0.1, dropping packets on the way according to a
+ * Gilbert-Elliott model: in the good state each packet is lost with
+ * probability -p, and a burst of mean length -B starts with
+ * probability -b; in the bad state every packet is lost. At the end
+ * reports goodput (decoded data delivered), decode latency (first
+ * packet of a block to delivery) and CPU time per GB delivered.
+ *
+ *	fec_bench [-k k] [-n n] [-s size] [-c blocks] [-d depth]
+ *		[-p loss] [-b burst_start] [-B burst_len]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "fec.h"
+#include "fec_session.h"
+
+struct loss {
+    double p ;		/* random loss in the good state */
+    double b ;		/* good -> bad */
+    double r ;		/* bad -> good, 1 / mean burst length */
+    int bad ;
+    unsigned long sent, dropped ;
+} ;
+
+static volatile int rx_done ;
+static volatile uint32_t rx_last ;	/* last block delivered */
+
+static int
+drop(void *arg, uint32_t block, int index)
+{
+    struct loss *l = arg ;
+    double x = drand48() ;
+
+    l->sent++ ;
+    if (l->bad)
+	l->bad = (x >= l->r) ;
+    else
+	l->bad = (x < l->b) ;
+    if (l->bad || (!l->bad && drand48() < l->p)) {
+	l->dropped++ ;
+	return 1 ;
+    }
+    return 0 ;
+}
+
+static void
+deliver(void *arg, uint32_t block, void *pkt[], int k, int sz)
+{
+    rx_last = block ;
+}
+
+static void *
+rx_main(void *rx)
+{
+    while (fec_rx_poll(rx, 50) > 0 || !rx_done)
+	;
+    return NULL ;
+}
+
+static double
+now(void)
+{
+    struct timespec ts ;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9 ;
+}
+
+static double
+cpu(void)
+{
+    struct rusage ru ;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * 1e-6 +
+	ru.ru_stime.tv_sec + ru.ru_stime.tv_usec * 1e-6 ;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int k = 32, n = 40, sz = 1024, count = 20000, depth = 4 ;
+    int fd[2], i, j, c, bufsz = 4 << 20 ;
+    struct loss loss = { 0.01, 0, 0.25, 0, 0, 0 } ;
+    struct sockaddr_in sa[2] ;
+    socklen_t len = sizeof(sa[0]) ;
+    struct fec_rx_stats st ;
+    pthread_t tid ;
+    void *tx, *rx, **src ;
+    double t0, t1, c0, c1, gb ;
+
+    while ( (c = getopt(argc, argv, "k:n:s:c:d:p:b:B:")) != -1)
+	switch (c) {
+	case 'k': k = atoi(optarg) ; break ;
+	case 'n': n = atoi(optarg) ; break ;
+	case 's': sz = atoi(optarg) ; break ;
+	case 'c': count = atoi(optarg) ; break ;
+	case 'd': depth = atoi(optarg) ; break ;
+	case 'p': loss.p = atof(optarg) ; break ;
+	case 'b': loss.b = atof(optarg) ; break ;
+	case 'B': loss.r = 1 / atof(optarg) ; break ;
+	default:
+	    fprintf(stderr, "usage: fec_bench [-k k] [-n n] [-s size] "
+		"[-c blocks] [-d depth] [-p loss] [-b burst_start] "
+		"[-B burst_len]\n");
+	    return 1 ;
+	}
+    for (i = 0 ; i < 2 ; i++) {
+	fd[i] = socket(AF_INET, SOCK_DGRAM, 0);
+	bzero(&sa[i], sizeof(sa[i]));
+	sa[i].sin_family = AF_INET ;
+	sa[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (fd[i] < 0 ||
+		bind(fd[i], (struct sockaddr *)&sa[i], sizeof(sa[i])) < 0 ||
+		getsockname(fd[i], (struct sockaddr *)&sa[i], &len) < 0) {
+	    perror("socket");
+	    return 1 ;
+	}
+	setsockopt(fd[i], SOL_SOCKET, i ? SO_RCVBUF : SO_SNDBUF,
+	    &bufsz, sizeof(bufsz));
+    }
+    connect(fd[0], (struct sockaddr *)&sa[1], sizeof(sa[1]));
+    tx = fec_tx_new(fd[0], k, n, sz, depth);
+    rx = fec_rx_new(fd[1], k, sz, 4 * depth, deliver, NULL);
+    src = malloc(k * sizeof(void *));
+    if (tx == NULL || rx == NULL || src == NULL) {
+	fprintf(stderr, "bad parameters\n");
+	return 1 ;
+    }
+    for (i = 0 ; i < k ; i++) {
+	src[i] = malloc(sz);
+	for (j = 0 ; j < sz ; j++)
+	    ((u_char *)src[i])[j] = random() ;
+    }
+    fec_tx_set_filter(tx, drop, &loss);
+    srand48(1);
+    rx_last = -1 ;
+    pthread_create(&tid, NULL, rx_main, rx);
+
+    t0 = now();
+    c0 = cpu();
+    for (i = 0 ; i < count ; i++) {
+	/*
+	 * do not run too far ahead of the receiver, or the socket
+	 * buffer overflows and we measure the kernel instead.
+	 */
+	while ((int32_t)(i - rx_last) > 8 * depth && (int32_t)rx_last >= 0 &&
+		now() - t0 < 60)
+	    sched_yield();
+	if (fec_tx_send(tx, src) != FEC_OK) {
+	    perror("fec_tx_send");
+	    break ;
+	}
+    }
+    fec_tx_flush(tx);
+    rx_done = 1 ;
+    pthread_join(tid, NULL);
+    t1 = now() - 0.05 ;	/* the receiver's final timeout */
+    c1 = cpu();
+
+    fec_rx_stats(rx, &st);
+    gb = (double)st.blocks * k * sz / 1e9 ;
+    printf("k %d n %d size %d depth %d: %d blocks, %lu/%lu packets dropped "
+	"(%.2f%%)\n", k, n, sz, depth, count, loss.dropped, loss.sent,
+	loss.sent ? 100.0 * loss.dropped / loss.sent : 0);
+    printf("delivered %llu blocks, lost %llu, %llu datagrams received "
+	"(%llu ignored)\n", (unsigned long long)st.blocks,
+	(unsigned long long)(count - st.blocks),
+	(unsigned long long)st.packets, (unsigned long long)st.dropped);
+    printf("goodput %.1f MB/s, latency avg %.1f us max %.1f us, "
+	"cpu %.2f s/GB\n", gb * 1e3 / (t1 - t0),
+	st.blocks ? st.lat_ns / 1e3 / st.blocks : 0,
+	st.lat_max_ns / 1e3, gb > 0 ? (c1 - c0) / gb : 0);
+
+    for (i = 0 ; i < k ; i++)
+	free(src[i]);
+    free(src);
+    fec_tx_free(tx);
+    fec_rx_free(rx);
+    close(fd[0]);
+    close(fd[1]);
+    return 0 ;
+}
+
+/* end of file */
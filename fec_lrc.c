@@ -0,0 +1,377 @@
+/*
+ * fec_lrc.c -- locally repairable codes on top of the vandermonde code
+ *
+ * Every block of the stripe is a linear combination of the k data
+ * blocks: data block i is e_i, a local parity is the indicator of
+ * its group, a global parity is a row of the systematic matrix of
+ * fec_new(k, k+m). These rows are kept in lrc->rows, and any repair
+ * is a matter of expressing the row of the lost block as a
+ * combination of the rows of blocks we can read.
+ *
+ * lrc_plan() chooses what to read: the rest of the group if that
+ * is all available (gsize blocks, and only XORs), otherwise it adds
+ * available blocks, data first, then global and local parities,
+ * keeping only those that are linearly independent, until the lost
+ * row is in their span.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fec.h"
+#include "fec_lrc.h"
+
+struct lrc {
+    int k, l, m ;	/* data blocks, local groups, global parities */
+    int n ;		/* k + l + m */
+    int *gstart ;	/* group g has data blocks gstart[g] .. gstart[g+1]-1 */
+    void *rs ;		/* fec_new(k, k + m), for the global parities */
+    fec_gf *rows ;	/* n*k, each block as a combination of the data */
+} ;
+
+#define ROW(c, i)	(&(c)->rows[(i) * (c)->k])
+
+static int
+group_of(struct lrc *c, int i)
+{
+    int g ;
+
+    if (i >= c->k)
+	return i - c->k ;
+    for (g = 0 ; c->gstart[g + 1] <= i ; g++)
+	;
+    return g ;
+}
+
+void *
+lrc_new(int k, int l, int m)
+{
+    struct lrc *c ;
+    int g, i ;
+
+    if (k < 1 || l < 1 || l > k || m < 0)
+	return NULL ;
+    c = calloc(1, sizeof(struct lrc));
+    if (c == NULL)
+	return NULL ;
+    c->k = k ;
+    c->l = l ;
+    c->m = m ;
+    c->n = k + l + m ;
+    c->gstart = malloc((l + 1) * sizeof(int));
+    c->rows = calloc(c->n * k, sizeof(fec_gf));
+    c->rs = fec_new(k, k + m);
+    if (c->gstart == NULL || c->rows == NULL || c->rs == NULL) {
+	lrc_free(c);
+	return NULL ;
+    }
+    for (g = 0 ; g <= l ; g++)
+	c->gstart[g] = g * k / l ;
+    for (i = 0 ; i < k ; i++) {
+	ROW(c, i)[i] = 1 ;
+	ROW(c, k + group_of(c, i))[i] = 1 ;
+    }
+    for (i = 0 ; i < m ; i++)
+	fec_matrix_row(c->rs, k + i, ROW(c, k + l + i));
+    return c ;
+}
+
+void
+lrc_free(void *lrc)
+{
+    struct lrc *c = lrc ;
+
+    if (c == NULL)
+	return ;
+    if (c->rs != NULL)
+	fec_free(c->rs);
+    free(c->gstart);
+    free(c->rows);
+    free(c);
+}
+
+/*
+ * produce block 'index' of the stripe from the k data blocks.
+ */
+int
+lrc_encode(void *lrc, void *src[], void *dst, int index, int sz)
+{
+    struct lrc *c = lrc ;
+    int i, g ;
+
+    if (index < 0 || index >= c->n)
+	return FEC_EINVAL ;
+    if (index < c->k)
+	return fec_encode(c->rs, src, dst, index, sz);
+    if (index >= c->k + c->l)
+	return fec_encode(c->rs, src, dst, index - c->l, sz);
+    g = index - c->k ;
+    memset(dst, 0, sz);
+    for (i = c->gstart[g] ; i < c->gstart[g + 1] ; i++)
+	fec_addmul(dst, src[i], 1, sz);
+    return FEC_OK ;
+}
+
+/*
+ * read the rest of the group of target, if all available.
+ */
+static int
+local_plan(struct lrc *c, char *avail, int target, int read[])
+{
+    int i, g, nread = 0 ;
+
+    if (target >= c->k + c->l)	/* global parities have no group */
+	return -1 ;
+    g = group_of(c, target);
+    for (i = c->gstart[g] ; i < c->gstart[g + 1] ; i++)
+	if (i != target) {
+	    if (!avail[i])
+		return -1 ;
+	    read[nread++] = i ;
+	}
+    if (target != c->k + g) {
+	if (!avail[c->k + g])
+	    return -1 ;
+	read[nread++] = c->k + g ;
+    }
+    return nread ;
+}
+
+/*
+ * Add available blocks to an echelon basis until the row of target is
+ * in its span. Basis rows are normalized and reduced against the
+ * previous ones, so a single pass in insertion order reduces a vector.
+ */
+static int
+global_plan(struct lrc *c, char *avail, int target, int read[])
+{
+    int k = c->k, rowsz = k * sizeof(fec_gf) ;
+    int i, j, p, cand, inv, rank = 0, nread = -1 ;
+    fec_gf *basis = malloc((k + 2) * rowsz) ;
+    fec_gf *v = basis + k * k, *t = v + k ;
+    int *piv = malloc(k * sizeof(int)) ;
+
+    if (basis == NULL || piv == NULL)
+	goto done ;
+    memcpy(t, ROW(c, target), rowsz);
+    for (i = 0 ; i < c->n && rank < k ; i++) {
+	/* data first, then global parities, then local ones */
+	cand = i < k ? i : (i < k + c->m ? i + c->l : i - c->m) ;
+	if (!avail[cand] || cand == target)
+	    continue ;
+	memcpy(v, ROW(c, cand), rowsz);
+	for (j = 0 ; j < rank ; j++)
+	    if (v[piv[j]] != 0)
+		fec_addmul(v, &basis[j * k], v[piv[j]], rowsz);
+	for (p = 0 ; p < k && v[p] == 0 ; p++)
+	    ;
+	if (p == k)	/* dependent on what we have */
+	    continue ;
+	inv = fec_gf_inv(v[p]) ;
+	for (j = 0 ; j < k ; j++)
+	    v[j] = fec_gf_mul(v[j], inv);
+	memcpy(&basis[rank * k], v, rowsz);
+	piv[rank++] = p ;
+	read[++nread] = cand ;
+	if (t[p] != 0)
+	    fec_addmul(t, v, t[p], rowsz);
+	for (j = 0 ; j < k && t[j] == 0 ; j++)
+	    ;
+	if (j == k) {
+	    nread++ ;
+	    goto done ;
+	}
+    }
+    nread = -1 ;
+done:
+    free(basis);
+    free(piv);
+    return nread ;
+}
+
+static int
+plan(struct lrc *c, char *avail, int target, int read[])
+{
+    int nread ;
+
+    if (avail[target]) {
+	read[0] = target ;
+	return 1 ;
+    }
+    nread = local_plan(c, avail, target, read);
+    if (nread < 0)
+	nread = global_plan(c, avail, target, read);
+    return nread ;
+}
+
+/*
+ * Choose the blocks to read to rebuild block target, given the nerased
+ * blocks that are not available. Fills read[] (which must have room
+ * for k+l+m entries) and returns their number, or -1 if target
+ * cannot be rebuilt.
+ */
+int
+lrc_plan(void *lrc, int erased[], int nerased, int target, int read[])
+{
+    struct lrc *c = lrc ;
+    char *avail ;
+    int i, nread ;
+
+    if (target < 0 || target >= c->n)
+	return -1 ;
+    avail = malloc(c->n);
+    if (avail == NULL)
+	return -1 ;
+    memset(avail, 1, c->n);
+    for (i = 0 ; i < nerased ; i++)
+	if (erased[i] >= 0 && erased[i] < c->n)
+	    avail[erased[i]] = 0 ;
+    nread = plan(c, avail, target, read);
+    free(avail);
+    return nread ;
+}
+
+/*
+ * find coef[] so that sum coef[i] * row(read[i]) = row(target), by
+ * Gauss-Jordan elimination on the k x (nread+1) system.
+ */
+static int
+solve(struct lrc *c, int read[], int nread, int target, fec_gf coef[])
+{
+    int k = c->k, cols = nread + 1, rowsz = cols * sizeof(fec_gf) ;
+    int r, i, col, prow, inv, err = FEC_OK ;
+    fec_gf *a = malloc(k * rowsz + rowsz), *tmp = a + k * cols ;
+    int *pr = malloc(nread * sizeof(int)) ;
+
+    if (a == NULL || pr == NULL) {
+	err = FEC_ENOMEM ;
+	goto done ;
+    }
+    for (r = 0 ; r < k ; r++) {
+	for (i = 0 ; i < nread ; i++)
+	    a[r * cols + i] = ROW(c, read[i])[r] ;
+	a[r * cols + nread] = ROW(c, target)[r] ;
+    }
+    for (prow = 0, col = 0 ; col < nread ; col++) {
+	pr[col] = -1 ;
+	for (r = prow ; r < k && a[r * cols + col] == 0 ; r++)
+	    ;
+	if (r == k)
+	    continue ;
+	if (r != prow) {
+	    memcpy(tmp, &a[r * cols], rowsz);
+	    memcpy(&a[r * cols], &a[prow * cols], rowsz);
+	    memcpy(&a[prow * cols], tmp, rowsz);
+	}
+	inv = fec_gf_inv(a[prow * cols + col]) ;
+	for (i = 0 ; i < cols ; i++)
+	    a[prow * cols + i] = fec_gf_mul(a[prow * cols + i], inv);
+	for (r = 0 ; r < k ; r++)
+	    if (r != prow && a[r * cols + col] != 0)
+		fec_addmul(&a[r * cols], &a[prow * cols], a[r * cols + col],
+		    rowsz);
+	pr[col] = prow++ ;
+    }
+    for (r = prow ; r < k ; r++)	/* target not in the span */
+	if (a[r * cols + nread] != 0)
+	    err = FEC_EINVAL ;
+    for (i = 0 ; i < nread ; i++)
+	coef[i] = pr[i] < 0 ? 0 : a[pr[i] * cols + nread] ;
+done:
+    free(a);
+    free(pr);
+    return err ;
+}
+
+/*
+ * Rebuild block target into dst, from the nread blocks blk[i] with
+ * indexes read[i], normally chosen by lrc_plan().
+ */
+int
+lrc_repair(void *lrc, void *blk[], int read[], int nread, void *dst,
+	int target, int sz)
+{
+    struct lrc *c = lrc ;
+    fec_gf *coef ;
+    int i, err ;
+
+    if (target < 0 || target >= c->n || nread < 1)
+	return FEC_EINVAL ;
+    for (i = 0 ; i < nread ; i++)
+	if (read[i] < 0 || read[i] >= c->n)
+	    return FEC_EINVAL ;
+    coef = malloc(nread * sizeof(fec_gf));
+    if (coef == NULL)
+	return FEC_ENOMEM ;
+    err = solve(c, read, nread, target, coef);
+    if (err == FEC_OK) {
+	memset(dst, 0, sz);
+	for (i = 0 ; i < nread ; i++)
+	    fec_addmul(dst, blk[i], coef[i], sz);
+    }
+    free(coef);
+    return err ;
+}
+
+/*
+ * Rebuild all the erased blocks of a stripe. blk[] has k+l+m entries,
+ * erased ones point to the buffers that receive them. Blocks that
+ * can be rebuilt within their group are done first (this may make
+ * others locally repairable), the rest through the global parities.
+ */
+int
+lrc_decode(void *lrc, void *blk[], int erased[], int nerased, int sz)
+{
+    struct lrc *c = lrc ;
+    char *avail = malloc(c->n) ;
+    int *read = malloc(c->n * sizeof(int)) ;
+    void **src = malloc(c->n * sizeof(void *)) ;
+    int i, j, t, nread, progress, local, left = nerased, err = FEC_OK ;
+
+    if (avail == NULL || read == NULL || src == NULL) {
+	err = FEC_ENOMEM ;
+	goto done ;
+    }
+    memset(avail, 1, c->n);
+    for (i = 0 ; i < nerased ; i++) {
+	if (erased[i] < 0 || erased[i] >= c->n) {
+	    err = FEC_EINVAL ;
+	    goto done ;
+	}
+	if (avail[erased[i]])
+	    avail[erased[i]] = 0 ;
+	else		/* listed twice, rebuilt once */
+	    left-- ;
+    }
+    for (local = 1 ; left > 0 ; local = progress) {
+	progress = 0 ;
+	for (i = 0 ; i < nerased && err == FEC_OK ; i++) {
+	    t = erased[i] ;
+	    if (avail[t])
+		continue ;
+	    nread = local ? local_plan(c, avail, t, read) :
+		global_plan(c, avail, t, read) ;
+	    if (nread < 0)
+		continue ;
+	    for (j = 0 ; j < nread ; j++)
+		src[j] = blk[read[j]] ;
+	    err = lrc_repair(c, src, read, nread, blk[t], t, sz);
+	    avail[t] = 1 ;
+	    left-- ;
+	    progress = 1 ;
+	}
+	if (err != FEC_OK)
+	    break ;
+	if (!progress && !local) {	/* not even globally */
+	    err = FEC_EINVAL ;
+	    break ;
+	}
+    }
+done:
+    free(avail);
+    free(read);
+    free(src);
+    return err ;
+}
+
+/* end of file */
@@ -0,0 +1,23 @@
+/*
+ * fec_lrc.h -- locally repairable codes on top of the vandermonde code
+ *
+ * The k data blocks are split into l groups of (about) k/l blocks.
+ * Each group has a local parity, the XOR of its members, and the
+ * stripe has m global parities from fec_new(k, k+m). Blocks are
+ * numbered
+ *	0 .. k-1		data
+ *	k .. k+l-1		local parity of group 0 .. l-1
+ *	k+l .. k+l+m-1		global parity 0 .. m-1
+ * A single lost block in a group is rebuilt from the other blocks of
+ * its group; the global parities are only used when that fails.
+ */
+
+void * lrc_new(int k, int l, int m) ;
+void lrc_free(void *lrc) ;
+int lrc_encode(void *lrc, void *src[], void *dst, int index, int sz) ;
+int lrc_plan(void *lrc, int erased[], int nerased, int target, int read[]) ;
+int lrc_repair(void *lrc, void *blk[], int read[], int nread, void *dst,
+	int target, int sz) ;
+int lrc_decode(void *lrc, void *blk[], int erased[], int nerased, int sz) ;
+
+/* end of file */
@@ -0,0 +1,512 @@
+/*
+ * fec_pool.c -- asynchronous encoding/decoding on a pool of threads
+ *
+ * Each worker owns a deque of tasks, a task being a byte range of a
+ * job. A worker looks for work in this order:
+ *   1. a newly submitted job: small ones are run whole, large ones
+ *	are split into SPLIT_SZ ranges that go into its own deque;
+ *   2. the bottom of its own deque;
+ *   3. the top of another worker's deque (stealing).
+ * Since every byte of an output packet depends only on the same
+ * byte of the inputs, the ranges of a job are independent and can
+ * run on different cores. A split decode job gets a plan, so the
+ * matrix is inverted once and its ranges only do the addmuls. The
+ * last task to complete a job reports it, either through the
+ * callback or on the completion queue.
+ *
+ * Deques are short critical sections under a per-worker mutex; idle
+ * workers sleep on a condition variable and a generation counter
+ * protects against lost wakeups.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "fec.h"
+#include "fec_pool.h"
+
+#define SPLIT_SZ	(32*1024)	/* bytes per task of a large job */
+#define DEQUE_SIZE	1024		/* tasks per worker, power of 2 */
+#define JOB_CALL	0		/* internal, see fec_pool_runner() */
+
+struct task {
+    struct fec_job *job ;
+    int off, len ;
+} ;
+
+struct worker {
+    struct pool *pool ;
+    pthread_t tid ;
+    pthread_mutex_t lock ;	/* protects the deque */
+    struct task dq[DEQUE_SIZE] ;
+    unsigned int top, bottom ;	/* thieves take at top, owner at bottom */
+    /*
+     * private copies of the packet pointers and indexes, used to
+     * work on a range of a job.
+     */
+    void **pkt ;
+    int *index ;
+    int max_k ;
+} ;
+
+struct pool {
+    pthread_mutex_t lock ;	/* protects what follows */
+    pthread_cond_t work ;	/* there is new work */
+    pthread_cond_t compl ;	/* a job completed */
+    struct fec_job *head, *tail ;	/* submitted jobs */
+    struct fec_job *c_head, *c_tail ;	/* completed jobs */
+    unsigned int gen ;		/* bumped when work is published */
+    int shutdown ;
+
+    int nworkers ;
+    int nstarted ;		/* threads actually created */
+    struct worker *w ;
+} ;
+
+/*
+ * a call fn(ctx, i) of fec_pool_runner(), queued as a job
+ */
+struct run {
+    fec_task_fn *fn ;
+    void *ctx ;
+    int left ;			/* calls not yet returned */
+    pthread_mutex_t lock ;
+    pthread_cond_t done ;
+} ;
+
+struct run_call {
+    struct fec_job job ;	/* must be first */
+    struct run *run ;
+    int i ;
+} ;
+
+static __thread struct worker *cur_worker ;	/* NULL if not a worker */
+
+static int
+push_bottom(struct worker *w, struct task *t)
+{
+    int ret = 0 ;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->bottom - w->top < DEQUE_SIZE) {
+	w->dq[w->bottom & (DEQUE_SIZE - 1)] = *t ;
+	w->bottom++ ;
+	ret = 1 ;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return ret ;
+}
+
+static int
+pop_bottom(struct worker *w, struct task *t)
+{
+    int ret = 0 ;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->bottom != w->top) {
+	w->bottom-- ;
+	*t = w->dq[w->bottom & (DEQUE_SIZE - 1)] ;
+	ret = 1 ;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return ret ;
+}
+
+static int
+steal_top(struct worker *w, struct task *t)
+{
+    int ret = 0 ;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->bottom != w->top) {
+	*t = w->dq[w->top & (DEQUE_SIZE - 1)] ;
+	w->top++ ;
+	ret = 1 ;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return ret ;
+}
+
+static int
+steal(struct worker *me, struct task *t)
+{
+    struct pool *p = me->pool ;
+    int i, self = me - p->w ;
+
+    for (i = 1 ; i < p->nworkers ; i++)
+	if (steal_top(&p->w[(self + i) % p->nworkers], t))
+	    return 1 ;
+    return 0 ;
+}
+
+/*
+ * make room in the worker for jobs with k source packets.
+ */
+static int
+worker_room(struct worker *w, int k)
+{
+    void **pkt ;
+    int *index ;
+
+    if (k <= w->max_k)
+	return FEC_OK ;
+    pkt = malloc(k * sizeof(void *));
+    index = malloc(k * sizeof(int));
+    if (pkt == NULL || index == NULL) {
+	free(pkt);
+	free(index);
+	return FEC_ENOMEM ;
+    }
+    free(w->pkt);
+    free(w->index);
+    w->pkt = pkt ;
+    w->index = index ;
+    w->max_k = k ;
+    return FEC_OK ;
+}
+
+static void
+complete_job(struct pool *p, struct fec_job *job)
+{
+    if (job->done != NULL) {
+	job->done(job);
+	return ;
+    }
+    pthread_mutex_lock(&p->lock);
+    job->next = NULL ;
+    if (p->c_tail == NULL)
+	p->c_head = job ;
+    else
+	p->c_tail->next = job ;
+    p->c_tail = job ;
+    pthread_cond_signal(&p->compl);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void
+run_task(struct worker *me, struct task *t)
+{
+    struct fec_job *job = t->job ;
+    int i, k, err, off = t->off ;
+
+    if (job->op == JOB_CALL) {
+	struct run *r = ((struct run_call *)job)->run ;
+
+	r->fn(r->ctx, ((struct run_call *)job)->i);
+	pthread_mutex_lock(&r->lock);
+	if (--r->left == 0)
+	    pthread_cond_signal(&r->done);
+	pthread_mutex_unlock(&r->lock);
+	return ;
+    }
+    fec_params(job->code, &k, NULL);
+    err = worker_room(me, k);
+    if (err == FEC_OK && job->plan != NULL) {
+	/* the plan works on ranges of the whole packets */
+	off = 0 ;
+	bcopy(job->pkt, me->pkt, k * sizeof(void *));
+	memcpy(me->index, job->index, k * sizeof(int));
+	err = fec_plan_execute_range(job->plan, me->pkt, me->index,
+	    t->off, t->len);
+    } else if (err == FEC_OK) {
+	for (i = 0 ; i < k ; i++)
+	    me->pkt[i] = (char *)job->pkt[i] + t->off ;
+	if (job->op == FEC_JOB_ENCODE) {
+	    for (i = 0 ; err == FEC_OK && i < job->nout ; i++)
+		err = fec_encode(job->code, me->pkt,
+		    (char *)job->out[i] + t->off, job->index[i], t->len);
+	} else {
+	    /*
+	     * fec_decode() shuffles our private copies; all ranges
+	     * end up with the same permutation.
+	     */
+	    memcpy(me->index, job->index, k * sizeof(int));
+	    err = fec_decode(job->code, me->pkt, me->index, t->len);
+	}
+    }
+    if (err != FEC_OK)
+	__sync_bool_compare_and_swap(&job->error, FEC_OK, err);
+    if (__sync_sub_and_fetch(&job->pending, 1) != 0)
+	return ;
+    /*
+     * last range of the job. For a decode, apply the permutation
+     * to the caller's arrays, as fec_decode() would have done.
+     */
+    if (job->op == FEC_JOB_DECODE && job->error == FEC_OK) {
+	for (i = 0 ; i < k ; i++) {
+	    job->pkt[i] = (char *)me->pkt[i] - off ;
+	    job->index[i] = me->index[i] ;
+	}
+    }
+    fec_plan_free(job->plan);
+    job->plan = NULL ;
+    complete_job(me->pool, job);
+}
+
+/*
+ * take a newly submitted job, split it in ranges if it is large
+ * enough, and run the first range.
+ */
+static void
+start_job(struct worker *me, struct fec_job *job)
+{
+    struct pool *p = me->pool ;
+    struct task t ;
+    int ntasks = 1, len = job->sz, pushed = 0 ;
+
+    if (job->sz > 2 * SPLIT_SZ) {
+	ntasks = (job->sz + SPLIT_SZ - 1) / SPLIT_SZ ;
+	if (ntasks > DEQUE_SIZE / 2)
+	    ntasks = DEQUE_SIZE / 2 ;
+	len = (job->sz + ntasks - 1) / ntasks ;
+	len = (len + 63) & ~63 ;	/* keep ranges aligned */
+	ntasks = (job->sz + len - 1) / len ;
+    }
+    job->error = FEC_OK ;
+    job->pending = ntasks ;
+    /*
+     * one inversion for all the ranges of a decode. Without a plan
+     * (bad indexes, no memory) each range calls fec_decode(), which
+     * reports the error.
+     */
+    job->plan = NULL ;
+    if (ntasks > 1 && job->op == FEC_JOB_DECODE)
+	job->plan = fec_plan_decode(job->code, job->index, job->sz);
+    t.job = job ;
+    /*
+     * push all ranges but the first one, and run the first one
+     * ourselves. If the deque is full, run the rest here as well.
+     */
+    for (t.off = len ; t.off < job->sz ; t.off += len) {
+	t.len = job->sz - t.off < len ? job->sz - t.off : len ;
+	if (push_bottom(me, &t))
+	    pushed++ ;
+	else
+	    run_task(me, &t);
+    }
+    if (pushed > 0) {
+	pthread_mutex_lock(&p->lock);
+	p->gen++ ;
+	pthread_cond_broadcast(&p->work);
+	pthread_mutex_unlock(&p->lock);
+    }
+    t.off = 0 ;
+    t.len = len < job->sz ? len : job->sz ;
+    run_task(me, &t);
+}
+
+static void *
+worker_main(void *arg)
+{
+    struct worker *me = arg ;
+    struct pool *p = me->pool ;
+    struct fec_job *job ;
+    struct task t ;
+    unsigned int gen ;
+
+    cur_worker = me ;
+    for (;;) {
+	pthread_mutex_lock(&p->lock);
+	gen = p->gen ;
+	job = p->head ;
+	if (job != NULL) {
+	    p->head = job->next ;
+	    if (p->head == NULL)
+		p->tail = NULL ;
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	if (job != NULL)
+	    start_job(me, job);
+	else if (pop_bottom(me, &t) || steal(me, &t))
+	    run_task(me, &t);
+	else {
+	    pthread_mutex_lock(&p->lock);
+	    if (p->gen == gen) {
+		if (p->shutdown) {
+		    pthread_mutex_unlock(&p->lock);
+		    break ;
+		}
+		pthread_cond_wait(&p->work, &p->lock);
+	    }
+	    pthread_mutex_unlock(&p->lock);
+	}
+    }
+    return NULL ;
+}
+
+/*
+ * create a pool with nthreads workers (0 means one per CPU).
+ */
+void *
+fec_pool_new(int nthreads)
+{
+    struct pool *p ;
+    int i ;
+
+    if (nthreads <= 0)
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads <= 0)
+	nthreads = 1 ;
+    p = calloc(1, sizeof(struct pool));
+    if (p == NULL)
+	return NULL ;
+    p->w = calloc(nthreads, sizeof(struct worker));
+    if (p->w == NULL) {
+	free(p);
+	return NULL ;
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work, NULL);
+    pthread_cond_init(&p->compl, NULL);
+    p->nworkers = nthreads ;
+    for (i = 0 ; i < nthreads ; i++) {
+	p->w[i].pool = p ;
+	pthread_mutex_init(&p->w[i].lock, NULL);
+    }
+    for (i = 0 ; i < nthreads ; i++) {
+	if (pthread_create(&p->w[i].tid, NULL, worker_main, &p->w[i]) != 0)
+	    break ;
+	p->nstarted++ ;
+    }
+    if (p->nstarted < nthreads) {
+	fec_pool_free(p);
+	return NULL ;
+    }
+    return p ;
+}
+
+/*
+ * destroy the pool, after all the submitted jobs have completed.
+ */
+void
+fec_pool_free(void *pool)
+{
+    struct pool *p = pool ;
+    int i ;
+
+    pthread_mutex_lock(&p->lock);
+    p->shutdown = 1 ;
+    p->gen++ ;
+    pthread_cond_broadcast(&p->work);
+    pthread_mutex_unlock(&p->lock);
+    for (i = 0 ; i < p->nstarted ; i++)
+	pthread_join(p->w[i].tid, NULL);
+    for (i = 0 ; i < p->nworkers ; i++) {
+	free(p->w[i].pkt);
+	free(p->w[i].index);
+	pthread_mutex_destroy(&p->w[i].lock);
+    }
+    pthread_cond_destroy(&p->compl);
+    pthread_cond_destroy(&p->work);
+    pthread_mutex_destroy(&p->lock);
+    free(p->w);
+    free(p);
+}
+
+/*
+ * queue a job. The job and the buffers it points to must stay valid
+ * until it completes: then job->done(job) is called from one of the
+ * workers or, if done is NULL, the job is put on the completion
+ * queue to be retrieved with fec_pool_wait().
+ */
+int
+fec_pool_submit(void *pool, struct fec_job *job)
+{
+    struct pool *p = pool ;
+
+    if (job == NULL || job->code == NULL || job->sz < 0 ||
+	    (job->op != FEC_JOB_ENCODE && job->op != FEC_JOB_DECODE))
+	return FEC_EINVAL ;
+    job->next = NULL ;
+    pthread_mutex_lock(&p->lock);
+    if (p->tail == NULL)
+	p->head = job ;
+    else
+	p->tail->next = job ;
+    p->tail = job ;
+    p->gen++ ;
+    pthread_cond_signal(&p->work);
+    pthread_mutex_unlock(&p->lock);
+    return FEC_OK ;
+}
+
+/*
+ * return the next completed job from the completion queue. If block
+ * is 0 returns NULL when there is none, otherwise waits for one (so
+ * the caller must have jobs outstanding).
+ */
+struct fec_job *
+fec_pool_wait(void *pool, int block)
+{
+    struct pool *p = pool ;
+    struct fec_job *job ;
+
+    pthread_mutex_lock(&p->lock);
+    while ( (job = p->c_head) == NULL && block)
+	pthread_cond_wait(&p->compl, &p->lock);
+    if (job != NULL) {
+	p->c_head = job->next ;
+	if (p->c_head == NULL)
+	    p->c_tail = NULL ;
+    }
+    pthread_mutex_unlock(&p->lock);
+    return job ;
+}
+
+/*
+ * a runner for fec_set_runner(): queues fn(ctx, 1..n-1) as jobs for
+ * the workers, runs fn(ctx, 0) and waits for the others. Called from
+ * a worker (say, a decode job inverting a large matrix) it runs
+ * everything in place, since waiting there could use up the pool.
+ */
+void
+fec_pool_runner(void *pool, fec_task_fn *fn, void *ctx, int n)
+{
+    struct pool *p = pool ;
+    struct run_call *c = NULL ;
+    struct run r ;
+    int i ;
+
+    if (n > 1 && cur_worker == NULL)
+	c = malloc(n * sizeof(struct run_call));
+    if (c == NULL) {
+	for (i = 0 ; i < n ; i++)
+	    fn(ctx, i);
+	return ;
+    }
+    r.fn = fn ;
+    r.ctx = ctx ;
+    r.left = n - 1 ;
+    pthread_mutex_init(&r.lock, NULL);
+    pthread_cond_init(&r.done, NULL);
+    for (i = 1 ; i < n ; i++) {
+	bzero(&c[i].job, sizeof(c[i].job));
+	c[i].job.op = JOB_CALL ;
+	c[i].run = &r ;
+	c[i].i = i ;
+	c[i].job.next = i + 1 < n ? &c[i + 1].job : NULL ;
+    }
+    pthread_mutex_lock(&p->lock);
+    if (p->tail == NULL)
+	p->head = &c[1].job ;
+    else
+	p->tail->next = &c[1].job ;
+    p->tail = &c[n - 1].job ;
+    p->gen++ ;
+    pthread_cond_broadcast(&p->work);
+    pthread_mutex_unlock(&p->lock);
+
+    fn(ctx, 0);
+    pthread_mutex_lock(&r.lock);
+    while (r.left > 0)
+	pthread_cond_wait(&r.done, &r.lock);
+    pthread_mutex_unlock(&r.lock);
+    pthread_cond_destroy(&r.done);
+    pthread_mutex_destroy(&r.lock);
+    free(c);
+}
+
+/* end of file */
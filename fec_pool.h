@@ -0,0 +1,51 @@
+/*
+ * fec_pool.h -- asynchronous encoding/decoding on a pool of threads
+ *
+ * Jobs are submitted against codes created with fec_new(), which
+ * can be shared by any number of jobs. Each worker thread has its
+ * own deque of tasks; large jobs are split by byte range into
+ * several tasks that idle workers steal, small jobs run whole.
+ * New jobs are picked up before remaining chunks of large ones, so
+ * small blocks do not wait behind huge ones.
+ */
+
+#define FEC_JOB_ENCODE	1
+#define FEC_JOB_DECODE	2
+
+struct fec_job {
+    /*
+     * set by the caller before fec_pool_submit()
+     */
+    int op ;		/* FEC_JOB_ENCODE or FEC_JOB_DECODE */
+    void *code ;	/* from fec_new() */
+    void **pkt ;	/* encode: the k source packets;
+			 * decode: the k received packets, as in fec_decode() */
+    int *index ;	/* encode: indexes of the nout packets to produce;
+			 * decode: indexes of pkt[], as in fec_decode() */
+    void **out ;	/* encode: nout output buffers */
+    int nout ;
+    int sz ;		/* packet size */
+    void (*done)(struct fec_job *job) ; /* completion callback, or NULL */
+    void *arg ;		/* for use by the caller */
+
+    int error ;		/* result: FEC_OK or an error code */
+
+    /* private to the pool */
+    struct fec_job *next ;
+    int pending ;	/* tasks not yet completed */
+    void *plan ;	/* decode plan shared by the ranges */
+} ;
+
+void * fec_pool_new(int nthreads) ;
+void fec_pool_free(void *pool) ;
+int fec_pool_submit(void *pool, struct fec_job *job) ;
+struct fec_job * fec_pool_wait(void *pool, int block) ;
+
+/*
+ * for fec_set_runner(fec_pool_runner, pool): spread the inversion of
+ * large decoding matrices over the workers. Reset the runner before
+ * freeing the pool.
+ */
+void fec_pool_runner(void *pool, fec_task_fn *fn, void *ctx, int n) ;
+
+/* end of file */
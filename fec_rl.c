@@ -0,0 +1,753 @@
+/*
+ * fec_rl.c -- rateless code
+ *
+ * A systematic raptor-like code. There are L = k + s + h intermediate
+ * packets C[], tied by a precode: s sparse rows, each source being in
+ * three of them (as in RFC 5053), C[k+i] the xor of the sources of row
+ * i; and h dense rows, C[k+s+r] = sum_j pre[r][j] C[j] over the
+ * sources, with the coefficients of the parities of the systematic
+ * vandermonde code fec_new(k, k+h) for small k, seeded random ones
+ * otherwise. h grows as sqrt(k)/8 from 12.
+ *
+ * Packet x is the xor of d of C[0 .. k+s-1] and two of the dense
+ * parities, d drawn from the degree distribution of RFC 5053 (average
+ * 4.6, at most 40) and the packets themselves b, b+a, b+2a ... modulo
+ * a prime, a and b being a hash of x. The intermediate packets are
+ * what makes packets 0 .. k-1 equal to the sources: the encoder gets
+ * them by decoding the sources. Packets x >= k then cost d + 2 xors
+ * each, whatever k is.
+ *
+ * The decoder has an equation for each packet received and one for
+ * each precode row, over the L unknowns. It peels: an equation left
+ * with one unknown gives it, and is xored into the others that have
+ * it. When none is left with one unknown, it takes an equation with
+ * the fewest and makes all of them but one inactive: they become
+ * symbols carried along in the equations (a vector of coefficients
+ * each), and peeling goes on. The dense parities are inactive from
+ * the start. At the end the unused equations and the dense rows, with
+ * the resolved unknowns substituted, are a small dense system over the
+ * inactive unknowns, solved by Gauss-Jordan, and the rest follows by
+ * back substitution in the order of peeling.
+ *
+ * Not every set of k packet numbers gives a solvable system, and
+ * 0 .. k-1 must: the hash of x is salted with the first salt that
+ * works for k, which both ends find the same way.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fec.h"
+#include "fec_rl.h"
+
+#define MAX_DEGREE	40
+#define MAX_NB		(MAX_DEGREE + 2)
+#define DENSE_ROWS	12
+#define MAX_SALT	64
+#define VDM_MAX		256	/* beyond, fec_new() costs more than it gives */
+
+struct rl_code {
+    int k, s, h, l ;	/* l = k + s + h intermediate packets */
+    uint32_t lp ;	/* smallest prime >= k + s */
+    uint32_t salt ;
+    fec_gf *pre ;	/* h * k dense precode coefficients */
+} ;
+
+static uint32_t
+mix(uint32_t x)
+{
+    x ^= x >> 16 ;
+    x *= 0x7feb352du ;
+    x ^= x >> 15 ;
+    x *= 0x846ca68bu ;
+    x ^= x >> 16 ;
+    return x ;
+}
+
+static int
+is_prime(uint32_t n)
+{
+    uint32_t i ;
+
+    if (n < 2)
+	return 0 ;
+    for (i = 2 ; i * i <= n ; i++)
+	if (n % i == 0)
+	    return 0 ;
+    return 1 ;
+}
+
+static void
+xor_into(char *dst, const char *src, int sz)
+{
+    int i ;
+
+    for (i = 0 ; i + 8 <= sz ; i += 8)
+	*(uint64_t *)(dst + i) ^= *(const uint64_t *)(src + i) ;
+    for ( ; i < sz ; i++)
+	dst[i] ^= src[i] ;
+}
+
+/*
+ * the sparse precode rows that have source j.
+ */
+static void
+ldpc_rows(struct rl_code *c, int j, int row[3])
+{
+    int a = 1 + (j / c->s) % (c->s - 1), b = j % c->s, i ;
+
+    for (i = 0 ; i < 3 ; i++, b = (b + a) % c->s)
+	row[i] = b ;
+}
+
+/*
+ * the intermediate packets xored into packet x; returns their number.
+ */
+static int
+neighbours(struct rl_code *c, uint32_t x, int nb[])
+{
+    static const struct {
+	uint32_t f ;
+	int d ;
+    } dist[] = {
+	{ 10241, 1 }, { 491582, 2 }, { 712794, 3 }, { 831695, 4 },
+	{ 948446, 10 }, { 1032189, 11 }, { 1048576, MAX_DEGREE },
+    } ;
+    uint32_t h = mix(x ^ c->salt), a, b, m = c->k + c->s ;
+    int d, n, i ;
+
+    for (i = 0 ; (h & 0xfffff) >= dist[i].f ; i++)
+	;
+    d = dist[i].d < (int)m ? dist[i].d : (int)m ;
+    h = mix(h) ;
+    a = 1 + h % (c->lp - 1) ;
+    b = mix(h) % c->lp ;
+    for (n = 0 ; n < d ; b = (b + a) % c->lp)
+	if (b < m)
+	    nb[n++] = b ;
+    h = mix(h ^ x) ;
+    a = h % c->h ;
+    b = (a + 1 + (h >> 16) % (c->h - 1)) % c->h ;
+    nb[n++] = m + a ;
+    nb[n++] = m + b ;
+    return n ;
+}
+
+/*
+ * dst = packet x, from the intermediate packets in inter[].
+ */
+static void
+lt_packet(struct rl_code *c, uint32_t x, const char *inter, char *dst,
+	int sz)
+{
+    int nb[MAX_NB], d, i ;
+
+    d = neighbours(c, x, nb);
+    memcpy(dst, inter + (size_t)nb[0] * sz, sz);
+    for (i = 1 ; i < d ; i++)
+	xor_into(dst, inter + (size_t)nb[i] * sz, sz);
+}
+
+/*
+ * --- the solver ---
+ *
+ * Equation e has unknowns ev[es[e] .. es[e+1]-1], deg[e] of them still
+ * active, payload w + e*sz and coefficients iv + e*cap over the ni
+ * inactive unknowns. Unknown v is in equations ce[cs[v] .. cs[v+1]-1];
+ * piv[v] is the equation that gives it, or col[v] its inactive column,
+ * or both -1. order[] has the unknowns given by an equation, in the
+ * order they were peeled.
+ */
+struct peel {
+    int neq, sz, l ;
+    int *es, *ev, *deg ;
+    int *cs, *ce ;
+    int *piv, *col, *order ;
+    char *used ;
+    int *queue, qt ;
+    char *w ;
+    fec_gf *iv ;
+    int cap, ni ;
+} ;
+
+#define IV(s, e)	((s)->iv + (size_t)(e) * (s)->cap)
+#define W(s, e)		((s)->w + (size_t)(e) * (s)->sz)
+
+static int
+inactivate(struct peel *s, int v)
+{
+    fec_gf *niv ;
+    int e, i ;
+
+    if (s->ni == s->cap) {
+	niv = calloc((size_t)s->neq * 2 * s->cap, sizeof(fec_gf));
+	if (niv == NULL)
+	    return FEC_ENOMEM ;
+	for (e = 0 ; e < s->neq ; e++)
+	    memcpy(niv + (size_t)e * 2 * s->cap, IV(s, e),
+		s->ni * sizeof(fec_gf));
+	free(s->iv);
+	s->iv = niv ;
+	s->cap *= 2 ;
+    }
+    s->col[v] = s->ni ;
+    for (i = s->cs[v] ; i < s->cs[v + 1] ; i++) {
+	e = s->ce[i] ;
+	if (s->used[e])
+	    continue ;
+	IV(s, e)[s->ni] ^= 1 ;
+	if (--s->deg[e] == 1)
+	    s->queue[s->qt++] = e ;
+    }
+    s->ni++ ;
+    return FEC_OK ;
+}
+
+/*
+ * resolve all unknowns, peeling and inactivating. Unknowns from first
+ * on (the dense parities) start inactive.
+ */
+static int
+peel(struct peel *s, int first)
+{
+    int qh = 0, nres = 0, e, f, v, i, j, best, err ;
+
+    for (v = first ; v < s->l ; v++)
+	if ( (err = inactivate(s, v)) != FEC_OK)
+	    return err ;
+    for (e = 0 ; e < s->neq ; e++)
+	if (s->deg[e] == 1)
+	    s->queue[s->qt++] = e ;
+    for (;;) {
+	while (qh < s->qt) {
+	    e = s->queue[qh++] ;
+	    if (s->used[e] || s->deg[e] != 1)
+		continue ;
+	    for (i = s->es[e] ; ; i++) {
+		v = s->ev[i] ;
+		if (s->piv[v] < 0 && s->col[v] < 0)
+		    break ;
+	    }
+	    s->used[e] = 1 ;
+	    s->piv[v] = e ;
+	    s->order[nres++] = v ;
+	    for (i = s->cs[v] ; i < s->cs[v + 1] ; i++) {
+		f = s->ce[i] ;
+		if (f == e || s->used[f])
+		    continue ;
+		xor_into(W(s, f), W(s, e), s->sz);
+		xor_into((char *)IV(s, f), (char *)IV(s, e),
+		    s->ni * sizeof(fec_gf));
+		if (--s->deg[f] == 1)
+		    s->queue[s->qt++] = f ;
+	    }
+	}
+	if (nres + s->ni == s->l)
+	    return FEC_OK ;
+	for (best = -1, e = 0 ; e < s->neq ; e++)
+	    if (!s->used[e] && s->deg[e] >= 2 &&
+		    (best < 0 || s->deg[e] < s->deg[best]))
+		best = e ;
+	if (best < 0) {		/* the rest is in no equation */
+	    for (v = 0 ; v < s->l ; v++)
+		if (s->piv[v] < 0 && s->col[v] < 0 &&
+			(err = inactivate(s, v)) != FEC_OK)
+		    return err ;
+	    return FEC_OK ;
+	}
+	for (j = 0, i = s->es[best] ; s->deg[best] > 1 ; i++) {
+	    v = s->ev[i] ;
+	    if (s->piv[v] >= 0 || s->col[v] >= 0)
+		continue ;
+	    if (j++ > 0 && (err = inactivate(s, v)) != FEC_OK)
+		return err ;
+	}
+    }
+}
+
+/*
+ * The dense system over the inactive unknowns: a row for each unused
+ * equation, and one for each dense precode row. Solved in place; on
+ * return row i of m/rd gives inactive unknown i.
+ */
+static int
+solve_inactive(struct rl_code *c, struct peel *s, fec_gf **m, char **rd,
+	char *tmp)
+{
+    int k = c->k, ni = s->ni, sz = s->sz, nr = 0 ;
+    int e, r, j, v, col, piv, rowsz = ni * sizeof(fec_gf) ;
+    fec_gf *t, co ;
+    char *td ;
+
+    for (e = 0 ; e < s->neq ; e++) {
+	if (s->used[e])
+	    continue ;
+	for (j = 0 ; j < ni && IV(s, e)[j] == 0 ; j++)
+	    ;
+	if (j == ni)		/* nothing new */
+	    continue ;
+	memcpy(m[nr], IV(s, e), rowsz);
+	memcpy(rd[nr++], W(s, e), sz);
+    }
+    for (r = 0 ; r < c->h ; r++, nr++) {
+	memset(m[nr], 0, rowsz);
+	memset(rd[nr], 0, sz);
+	for (j = 0 ; j <= k ; j++) {
+	    v = j < k ? j : k + c->s + r ;	/* and 1 * its parity */
+	    co = j < k ? c->pre[(size_t)r * k + j] : 1 ;
+	    if (co == 0)
+		continue ;
+	    if (s->col[v] >= 0) {
+		m[nr][s->col[v]] ^= co ;
+		continue ;
+	    }
+	    e = s->piv[v] ;
+	    fec_addmul(rd[nr], W(s, e), co, sz);
+	    fec_addmul(m[nr], IV(s, e), co, rowsz);
+	}
+    }
+    for (col = 0 ; col < ni ; col++) {
+	for (piv = col ; piv < nr && m[piv][col] == 0 ; piv++)
+	    ;
+	if (piv == nr)
+	    return FEC_EMORE ;
+	t = m[piv] ; m[piv] = m[col] ; m[col] = t ;
+	td = rd[piv] ; rd[piv] = rd[col] ; rd[col] = td ;
+	co = fec_gf_inv(m[col][col]) ;
+	if (co != 1) {
+	    for (j = 0 ; j < ni ; j++)
+		m[col][j] = fec_gf_mul(m[col][j], co);
+	    memset(tmp, 0, sz);
+	    fec_addmul(tmp, rd[col], co, sz);
+	    memcpy(rd[col], tmp, sz);
+	}
+	for (r = 0 ; r < nr ; r++)
+	    if (r != col && (co = m[r][col]) != 0) {
+		fec_addmul(m[r], m[col], co, rowsz);
+		fec_addmul(rd[r], rd[col], co, sz);
+	    }
+    }
+    return FEC_OK ;
+}
+
+/*
+ * Find the intermediate packets, into out[] (l * sz bytes), from the n
+ * packets with numbers x[] and payloads pay[] (all zero if NULL).
+ * With out == NULL only tells if the system is solvable. Returns
+ * FEC_EMORE if it is not.
+ */
+static int
+solve(struct rl_code *c, int n, const uint32_t x[], const char *pay[],
+	int sz, char *out)
+{
+    struct peel s ;
+    int k = c->k, neq = n + c->s, i, j, e, v, nr, err = FEC_ENOMEM ;
+    int nb[MAX_NB], row[3] ;
+    fec_gf **m = NULL ;
+    char **rd = NULL, *dense = NULL, *tmp = NULL, *dst ;
+
+    /*
+     * equations: the n packets, then the s sparse precode rows, which
+     * have a zero payload.
+     */
+    memset(&s, 0, sizeof(s));
+    s.neq = neq ;
+    s.sz = sz ;
+    s.l = c->l ;
+    s.cap = 32 ;
+    s.es = calloc(neq + 1, sizeof(int));
+    s.ev = malloc(((size_t)n * MAX_NB + 3 * k + c->s) * sizeof(int));
+    s.deg = calloc(neq, sizeof(int));
+    s.cs = calloc(c->l + 1, sizeof(int));
+    s.piv = malloc(c->l * sizeof(int));
+    s.col = malloc(c->l * sizeof(int));
+    s.used = calloc(neq, 1);
+    s.order = malloc(c->l * sizeof(int));
+    s.queue = malloc(2 * neq * sizeof(int));	/* twice at most each */
+    s.w = calloc(neq, sz);
+    s.iv = calloc((size_t)neq * s.cap, sizeof(fec_gf));
+    if (s.es == NULL || s.ev == NULL || s.deg == NULL || s.cs == NULL ||
+	    s.piv == NULL || s.col == NULL || s.used == NULL ||
+	    s.order == NULL || s.queue == NULL || s.w == NULL || s.iv == NULL)
+	goto done ;
+    for (e = 0 ; e < n ; e++) {
+	s.deg[e] = neighbours(c, x[e], nb);
+	memcpy(s.ev + s.es[e], nb, s.deg[e] * sizeof(int));
+	s.es[e + 1] = s.es[e] + s.deg[e] ;
+	if (pay != NULL)
+	    memcpy(W(&s, e), pay[e], sz);
+    }
+    for (j = 0 ; j < k ; j++) {	/* sizes of the sparse rows */
+	ldpc_rows(c, j, row);
+	for (i = 0 ; i < 3 ; i++)
+	    s.deg[n + row[i]]++ ;
+    }
+    for (e = n ; e < neq ; e++) {	/* with their parity last */
+	s.es[e + 1] = s.es[e] + ++s.deg[e] ;
+	s.ev[s.es[e + 1] - 1] = k + e - n ;
+    }
+    for (j = 0 ; j < k ; j++) {
+	ldpc_rows(c, j, row);
+	for (i = 0 ; i < 3 ; i++)
+	    s.ev[s.es[n + row[i]]++] = j ;
+    }
+    for (e = neq - 1 ; e >= n ; e--)	/* undo the cursors */
+	s.es[e] = s.es[e + 1] - s.deg[e] ;
+    for (i = 0 ; i < s.es[neq] ; i++)
+	s.cs[s.ev[i] + 1]++ ;
+    for (v = 0 ; v < c->l ; v++) {
+	s.cs[v + 1] += s.cs[v] ;
+	s.piv[v] = s.col[v] = -1 ;
+    }
+    s.ce = malloc(s.es[neq] * sizeof(int));
+    if (s.ce == NULL)
+	goto done ;
+    for (e = 0 ; e < neq ; e++)	/* fill, using piv[] as cursors */
+	for (i = s.es[e] ; i < s.es[e + 1] ; i++) {
+	    v = s.ev[i] ;
+	    s.ce[s.cs[v] + ++s.piv[v]] = e ;
+	}
+    for (v = 0 ; v < c->l ; v++)
+	s.piv[v] = -1 ;
+    if ( (err = peel(&s, k + c->s)) != FEC_OK)
+	goto done ;
+
+    for (nr = c->h, e = 0 ; e < neq ; e++)
+	nr += !s.used[e] ;
+    m = malloc(nr * sizeof(fec_gf *));
+    rd = malloc(nr * sizeof(char *));
+    dense = malloc((size_t)nr * (s.ni * sizeof(fec_gf) + sz));
+    tmp = malloc(sz);
+    err = FEC_ENOMEM ;
+    if (m == NULL || rd == NULL || dense == NULL || tmp == NULL)
+	goto done ;
+    for (i = 0 ; i < nr ; i++) {
+	rd[i] = dense + (size_t)i * (s.ni * sizeof(fec_gf) + sz) ;
+	m[i] = (fec_gf *)(rd[i] + sz) ;
+    }
+    err = solve_inactive(c, &s, m, rd, tmp);
+    if (err != FEC_OK || out == NULL)
+	goto done ;
+    /*
+     * Back substitution: the equation that gives v has no other
+     * unknowns than inactive ones and ones given before.
+     */
+    for (v = 0 ; v < c->l ; v++)
+	if (s.col[v] >= 0)
+	    memcpy(out + (size_t)v * sz, rd[s.col[v]], sz);
+    for (i = 0 ; i < c->l - s.ni ; i++) {
+	v = s.order[i] ;
+	e = s.piv[v] ;
+	dst = out + (size_t)v * sz ;
+	if (e < n && pay != NULL)
+	    memcpy(dst, pay[e], sz);
+	else
+	    memset(dst, 0, sz);
+	for (j = s.es[e] ; j < s.es[e + 1] ; j++)
+	    if (s.ev[j] != v)
+		xor_into(dst, out + (size_t)s.ev[j] * sz, sz);
+    }
+done:
+    free(s.es);
+    free(s.ev);
+    free(s.deg);
+    free(s.cs);
+    free(s.ce);
+    free(s.piv);
+    free(s.col);
+    free(s.order);
+    free(s.used);
+    free(s.queue);
+    free(s.w);
+    free(s.iv);
+    free(m);
+    free(rd);
+    free(dense);
+    free(tmp);
+    return err ;
+}
+
+/*
+ * --- the code ---
+ */
+
+static void
+rl_code_free(struct rl_code *c)
+{
+    free(c->pre);
+}
+
+static int
+rl_code_init(struct rl_code *c, int k)
+{
+    void *rs ;
+    uint32_t *x ;
+    int r, j, t, err ;
+
+    for (j = 2 ; j * (j - 1) < 2 * k ; j++)
+	;
+    for (c->s = (k + 99) / 100 + j ; !is_prime(c->s) ; c->s++)
+	;
+    c->k = k ;
+    for (c->h = DENSE_ROWS ; (c->h - DENSE_ROWS) * (c->h - DENSE_ROWS) * 64 < k ;
+	    c->h++)	/* plus sqrt(k)/8 */
+	;
+    c->l = k + c->s + c->h ;
+    for (c->lp = k + c->s ; !is_prime(c->lp) ; c->lp++)
+	;
+    c->pre = malloc((size_t)c->h * k * sizeof(fec_gf));
+    x = malloc(k * sizeof(uint32_t));
+    if (c->pre == NULL || x == NULL) {
+	free(x);
+	rl_code_free(c);
+	return FEC_ENOMEM ;
+    }
+    if (k + c->h <= VDM_MAX) {
+	if ( (rs = fec_new(k, k + c->h)) == NULL) {
+	    free(x);
+	    rl_code_free(c);
+	    return FEC_ENOMEM ;
+	}
+	for (r = 0 ; r < c->h ; r++)
+	    fec_matrix_row(rs, k + r, &c->pre[(size_t)r * k]);
+	fec_free(rs);
+    } else
+	for (r = 0 ; r < c->h ; r++)
+	    for (j = 0 ; j < k ; j++)
+		c->pre[(size_t)r * k + j] =
+		    mix(mix(r) ^ j * 0x9e3779b9u) % GF_SIZE + 1 ;
+    for (j = 0 ; j < k ; j++)
+	x[j] = j ;
+    for (err = FEC_EMORE, t = 0 ; err == FEC_EMORE && t < MAX_SALT ; t++) {
+	c->salt = t ? mix(t) : 0 ;
+	err = solve(c, k, x, NULL, 8, NULL);	/* structure only */
+    }
+    free(x);
+    if (err != FEC_OK) {
+	rl_code_free(c);
+	return err == FEC_EMORE ? FEC_EINVAL : err ;
+    }
+    return FEC_OK ;
+}
+
+/*
+ * --- encoder ---
+ */
+
+struct rl_enc {
+    struct rl_code c ;
+    int sz ;
+    void **src ;	/* k sources */
+    char *inter ;	/* l intermediate packets */
+} ;
+
+void *
+rl_enc_new(int k, int sz, void *src[])
+{
+    struct rl_enc *e ;
+    uint32_t *x ;
+    int j, err ;
+
+    if (k < 1 || sz < 1 || (GF_BITS > 8 && (sz & 1)))
+	return NULL ;
+    e = calloc(1, sizeof(struct rl_enc));
+    if (e == NULL)
+	return NULL ;
+    if (rl_code_init(&e->c, k) != FEC_OK) {
+	free(e);
+	return NULL ;
+    }
+    e->sz = sz ;
+    e->src = malloc(k * sizeof(void *));
+    e->inter = malloc((size_t)e->c.l * sz);
+    x = malloc(k * sizeof(uint32_t));
+    if (e->src == NULL || e->inter == NULL || x == NULL) {
+	free(x);
+	rl_enc_free(e);
+	return NULL ;
+    }
+    memcpy(e->src, src, k * sizeof(void *));
+    for (j = 0 ; j < k ; j++)
+	x[j] = j ;
+    err = solve(&e->c, k, x, (const char **)src, sz, e->inter);
+    free(x);
+    if (err != FEC_OK) {
+	rl_enc_free(e);
+	return NULL ;
+    }
+    return e ;
+}
+
+void
+rl_enc_free(void *enc)
+{
+    struct rl_enc *e = enc ;
+
+    if (e == NULL)
+	return ;
+    rl_code_free(&e->c);
+    free(e->src);
+    free(e->inter);
+    free(e);
+}
+
+/*
+ * produce packet x of the stream into dst.
+ */
+int
+rl_enc_packet(void *enc, uint32_t x, void *dst)
+{
+    struct rl_enc *e = enc ;
+
+    if (x < (uint32_t)e->c.k)
+	memcpy(dst, e->src[x], e->sz);
+    else
+	lt_packet(&e->c, x, e->inter, dst, e->sz);
+    return FEC_OK ;
+}
+
+/*
+ * --- decoder ---
+ */
+
+struct rl_dec {
+    struct rl_code c ;
+    int sz ;
+    int n, max ;	/* packets received, room */
+    uint32_t *x ;	/* their numbers */
+    char *data ;	/* and payloads, sz each */
+} ;
+
+void *
+rl_dec_new(int k, int sz)
+{
+    struct rl_dec *d ;
+
+    if (k < 1 || sz < 1 || (GF_BITS > 8 && (sz & 1)))
+	return NULL ;
+    d = calloc(1, sizeof(struct rl_dec));
+    if (d == NULL)
+	return NULL ;
+    if (rl_code_init(&d->c, k) != FEC_OK) {
+	free(d);
+	return NULL ;
+    }
+    d->sz = sz ;
+    return d ;
+}
+
+void
+rl_dec_free(void *dec)
+{
+    struct rl_dec *d = dec ;
+
+    if (d == NULL)
+	return ;
+    rl_code_free(&d->c);
+    free(d->x);
+    free(d->data);
+    free(d);
+}
+
+/*
+ * keep packet x; duplicates are harmless.
+ */
+int
+rl_dec_add(void *dec, uint32_t x, const void *data)
+{
+    struct rl_dec *d = dec ;
+    uint32_t *nx ;
+    char *nd ;
+    int max ;
+
+    if (d->n == d->max) {
+	max = d->max ? 2 * d->max : d->c.k + 16 ;
+	nx = realloc(d->x, max * sizeof(uint32_t));
+	if (nx == NULL)
+	    return FEC_ENOMEM ;
+	d->x = nx ;
+	nd = realloc(d->data, (size_t)max * d->sz);
+	if (nd == NULL)
+	    return FEC_ENOMEM ;
+	d->data = nd ;
+	d->max = max ;
+    }
+    d->x[d->n] = x ;
+    memcpy(d->data + (size_t)d->n * d->sz, data, d->sz);
+    d->n++ ;
+    return FEC_OK ;
+}
+
+static int
+cmp_x(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b ;
+
+    return x < y ? -1 : x > y ;
+}
+
+/*
+ * try to rebuild the k sources into src[]. FEC_EMORE if the packets
+ * received so far are not enough; more can be added and this called
+ * again.
+ */
+int
+rl_dec_decode(void *dec, void *src[])
+{
+    struct rl_dec *d = dec ;
+    struct rl_code *c = &d->c ;
+    int k = c->k, sz = d->sz, i, j, n, err = FEC_ENOMEM ;
+    uint32_t *ord, *x = NULL ;	/* ord: (x, position) pairs */
+    const char **pay = NULL ;
+    char *inter = NULL ;
+
+    if (d->n < k)
+	return FEC_EMORE ;
+    ord = malloc(d->n * 2 * sizeof(uint32_t));
+    if (ord == NULL)
+	return FEC_ENOMEM ;
+    for (i = 0 ; i < d->n ; i++) {
+	ord[2*i] = d->x[i] ;
+	ord[2*i + 1] = i ;
+    }
+    qsort(ord, d->n, 2 * sizeof(uint32_t), cmp_x);
+    for (n = 0, i = 0 ; i < d->n ; i++)	/* drop duplicates */
+	if (n == 0 || ord[2*i] != ord[2*(n-1)]) {
+	    ord[2*n] = ord[2*i] ;
+	    ord[2*n + 1] = ord[2*i + 1] ;
+	    n++ ;
+	}
+    x = malloc(n * sizeof(uint32_t));
+    pay = malloc(n * sizeof(char *));
+    if (x == NULL || pay == NULL)
+	goto done ;
+    for (i = 0 ; i < n ; i++) {
+	x[i] = ord[2*i] ;
+	pay[i] = d->data + (size_t)ord[2*i + 1] * sz ;
+    }
+    if (n < k) {
+	err = FEC_EMORE ;
+	goto done ;
+    }
+    if (x[k - 1] != (uint32_t)k - 1) {	/* some source is missing */
+	inter = malloc((size_t)c->l * sz);
+	if (inter == NULL)
+	    goto done ;
+	if ( (err = solve(c, n, x, pay, sz, inter)) != FEC_OK)
+	    goto done ;
+    }
+    for (i = j = 0 ; i < k ; i++)	/* x[] is sorted */
+	if (j < n && x[j] == (uint32_t)i)
+	    memcpy(src[i], pay[j++], sz);
+	else
+	    lt_packet(c, i, inter, src[i], sz);
+    err = FEC_OK ;
+done:
+    free(ord);
+    free(x);
+    free(pay);
+    free(inter);
+    return err ;
+}
+
+/* end of file */
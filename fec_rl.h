@@ -0,0 +1,25 @@
+/*
+ * fec_rl.h -- rateless code for bulk distribution
+ *
+ * Packet x of the stream is source x for x < k, and for x >= k the
+ * xor of a few packets of a precode (the sources and some parities of
+ * them) chosen by a hash of x: about 7 whatever k is, so the sender
+ * can produce as many as it likes at a constant cost each. The
+ * receiver collects packets with their number and calls
+ * rl_dec_decode() once it has k; with k it almost always succeeds, and
+ * otherwise wants one or two more. All packets have sz bytes.
+ */
+
+#include <stdint.h>
+
+/* src[] must stay valid while the encoder is in use */
+void * rl_enc_new(int k, int sz, void *src[]) ;
+int rl_enc_packet(void *enc, uint32_t x, void *dst) ;
+void rl_enc_free(void *enc) ;
+
+void * rl_dec_new(int k, int sz) ;
+int rl_dec_add(void *dec, uint32_t x, const void *data) ;
+int rl_dec_decode(void *dec, void *src[]) ;
+void rl_dec_free(void *dec) ;
+
+/* end of file */
@@ -0,0 +1,552 @@
+/*
+ * fec_session.c -- block framing, sending and reassembly over UDP
+ *
+ * Packet buffers are laid out so that the payload starts on a 64 byte
+ * boundary, with the header just before it, and datagrams are sent
+ * and received in place. On the receive side a datagram that is
+ * accepted for a block is not copied: its buffer is swapped with a
+ * free one of the reassembly slot, and fec_decode() works directly
+ * on the slot's buffers.
+ *
+ * Reassembly slots are indexed by block id modulo the window. A
+ * packet of a newer block that maps to a slot still in use abandons
+ * the old block; packets of blocks older than the one in the slot,
+ * or of blocks already delivered, are dropped. Blocks skipped by the
+ * newest one seen get a slot with no packet, so that they count as
+ * lost when the window moves past them without any arriving.
+ */
+
+#define _GNU_SOURCE	/* sendmmsg, recvmmsg */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "fec.h"
+#include "fec_session.h"
+
+#define BATCH		64	/* datagrams per sendmmsg/recvmmsg */
+#define PAYLOAD_OFF	64	/* payload offset in a buffer */
+#define HDR_OFF		(PAYLOAD_OFF - FEC_HDR_SIZE)
+
+#define SEQ_LT(a, b)	((int32_t)((a) - (b)) < 0)
+
+static int
+buf_size(int sz)
+{
+    return PAYLOAD_OFF + ((sz + 63) & ~63) ;
+}
+
+static char *
+new_buf(int sz)
+{
+    void *p ;
+
+    if (posix_memalign(&p, 64, buf_size(sz)) != 0)
+	return NULL ;
+    return p ;
+}
+
+static void
+put_hdr(char *buf, uint32_t block, int index, int k, int n, int sz)
+{
+    uint32_t b = htonl(block) ;
+    uint16_t h[4] ;
+
+    h[0] = htons(index);
+    h[1] = htons(k);
+    h[2] = htons(n);
+    h[3] = htons(sz);
+    memcpy(buf + HDR_OFF, &b, 4);
+    memcpy(buf + HDR_OFF + 4, h, 8);
+}
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts ;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec ;
+}
+
+/*
+ * --- sender ---
+ */
+
+struct fec_tx {
+    int fd, k, n, sz, depth ;
+    void *code ;
+    uint32_t block ;	/* id of the next block */
+    int queued ;	/* blocks in pkt[] waiting to be sent */
+    char **pkt ;	/* depth * n buffers, block q packet i at q*n+i */
+    void **dst ;	/* n payloads and */
+    int *index ;	/* their indexes, for fec_encode_block() */
+    struct mmsghdr msg[BATCH] ;
+    struct iovec iov[BATCH] ;
+    int (*drop)(void *arg, uint32_t block, int index) ;
+    void *arg ;
+} ;
+
+void *
+fec_tx_new(int fd, int k, int n, int sz, int depth)
+{
+    struct fec_tx *tx ;
+    int i ;
+
+    if (k < 1 || n <= k || n > GF_SIZE + 1 || sz < 1 || sz > 65535 ||
+	    depth < 1)
+	return NULL ;
+    if (GF_BITS > 8 && (sz & 1))
+	return NULL ;
+    tx = calloc(1, sizeof(struct fec_tx));
+    if (tx == NULL)
+	return NULL ;
+    tx->fd = fd ;
+    tx->k = k ;
+    tx->n = n ;
+    tx->sz = sz ;
+    tx->depth = depth ;
+    tx->code = fec_new(k, n);
+    tx->pkt = calloc(depth * n, sizeof(char *));
+    tx->dst = calloc(n, sizeof(void *));
+    tx->index = calloc(n, sizeof(int));
+    if (tx->code == NULL || tx->pkt == NULL || tx->dst == NULL ||
+	    tx->index == NULL) {
+	fec_tx_free(tx);
+	return NULL ;
+    }
+    for (i = 0 ; i < depth * n ; i++)
+	if ( (tx->pkt[i] = new_buf(sz)) == NULL) {
+	    fec_tx_free(tx);
+	    return NULL ;
+	}
+    for (i = 0 ; i < BATCH ; i++) {
+	tx->msg[i].msg_hdr.msg_iov = &tx->iov[i] ;
+	tx->msg[i].msg_hdr.msg_iovlen = 1 ;
+	tx->iov[i].iov_len = FEC_HDR_SIZE + sz ;
+    }
+    for (i = 0 ; i < n ; i++)
+	tx->index[i] = i ;
+    return tx ;
+}
+
+void
+fec_tx_free(void *tx1)
+{
+    struct fec_tx *tx = tx1 ;
+    int i ;
+
+    if (tx == NULL)
+	return ;
+    if (tx->pkt != NULL)
+	for (i = 0 ; i < tx->depth * tx->n ; i++)
+	    free(tx->pkt[i]);
+    free(tx->pkt);
+    free(tx->dst);
+    free(tx->index);
+    if (tx->code != NULL)
+	fec_free(tx->code);
+    free(tx);
+}
+
+void
+fec_tx_set_filter(void *tx1, int (*drop)(void *arg, uint32_t block, int index),
+	void *arg)
+{
+    struct fec_tx *tx = tx1 ;
+
+    tx->drop = drop ;
+    tx->arg = arg ;
+}
+
+static int
+tx_batch(struct fec_tx *tx, int cnt)
+{
+    int done = 0, r ;
+
+    while (done < cnt) {
+	r = sendmmsg(tx->fd, tx->msg + done, cnt - done, 0);
+	if (r < 0) {
+	    if (errno == EINTR)
+		continue ;
+	    return FEC_ESYS ;
+	}
+	done += r ;
+    }
+    return FEC_OK ;
+}
+
+/*
+ * send the queued blocks: packet 0 of each block, then packet 1, and
+ * so on, so that consecutive datagrams belong to different blocks.
+ */
+int
+fec_tx_flush(void *tx1)
+{
+    struct fec_tx *tx = tx1 ;
+    uint32_t first = tx->block - tx->queued ;
+    int i, q, cnt = 0, err = FEC_OK ;
+
+    for (i = 0 ; i < tx->n && err == FEC_OK ; i++)
+	for (q = 0 ; q < tx->queued && err == FEC_OK ; q++) {
+	    if (tx->drop != NULL && tx->drop(tx->arg, first + q, i))
+		continue ;
+	    tx->iov[cnt].iov_base = tx->pkt[q * tx->n + i] + HDR_OFF ;
+	    if (++cnt == BATCH) {
+		err = tx_batch(tx, cnt);
+		cnt = 0 ;
+	    }
+	}
+    if (err == FEC_OK && cnt > 0)
+	err = tx_batch(tx, cnt);
+    tx->queued = 0 ;
+    return err ;
+}
+
+/*
+ * queue a block of k packets of sz bytes; blocks go out every 'depth'
+ * calls, or on fec_tx_flush().
+ */
+int
+fec_tx_send(void *tx1, void *src[])
+{
+    struct fec_tx *tx = tx1 ;
+    char **pkt = tx->pkt + tx->queued * tx->n ;
+    int i, err ;
+
+    for (i = 0 ; i < tx->n ; i++) {
+	put_hdr(pkt[i], tx->block, i, tx->k, tx->n, tx->sz);
+	tx->dst[i] = pkt[i] + PAYLOAD_OFF ;
+    }
+    /* copy the sources and compute the parities in one pass */
+    err = fec_encode_block(tx->code, src, tx->dst, tx->index, tx->n,
+	tx->sz);
+    if (err != FEC_OK)
+	return err ;
+    tx->block++ ;
+    if (++tx->queued == tx->depth)
+	return fec_tx_flush(tx);
+    return FEC_OK ;
+}
+
+/*
+ * --- receiver ---
+ */
+
+#define SLOT_FREE	0
+#define SLOT_FILL	1	/* collecting packets */
+#define SLOT_DONE	2	/* delivered */
+#define SLOT_WAIT	3	/* skipped, no packet yet */
+
+struct rx_slot {
+    uint32_t block ;
+    int state ;
+    int k, n, sz, count ;
+    void *code ;
+    char **buf ;	/* max_k buffers, the first count hold packets */
+    void **pkt ;	/* their payloads, for fec_decode() */
+    int *index ;
+    uint64_t first ;	/* arrival time of the first packet */
+} ;
+
+struct rx_code {
+    int k, n ;
+    void *code ;
+} ;
+
+struct fec_rx {
+    int fd, max_k, max_sz, window ;
+    fec_deliver_t *deliver ;
+    void *arg ;
+    struct rx_slot *slot ;
+    struct rx_code *codes ;	/* codes seen so far */
+    int ncodes ;
+    char *buf[BATCH] ;		/* receive buffers */
+    struct mmsghdr msg[BATCH] ;
+    struct iovec iov[BATCH] ;
+    struct fec_rx_stats st ;
+    int started ;
+    uint32_t next ;		/* after the newest block seen */
+} ;
+
+void *
+fec_rx_new(int fd, int max_k, int max_sz, int window,
+	fec_deliver_t *deliver, void *arg)
+{
+    struct fec_rx *rx ;
+    struct rx_slot *s ;
+    int i, j ;
+
+    if (max_k < 1 || max_sz < 1 || max_sz > 65535 || window < 1)
+	return NULL ;
+    rx = calloc(1, sizeof(struct fec_rx));
+    if (rx == NULL)
+	return NULL ;
+    rx->fd = fd ;
+    rx->max_k = max_k ;
+    rx->max_sz = max_sz ;
+    rx->window = window ;
+    rx->deliver = deliver ;
+    rx->arg = arg ;
+    rx->slot = calloc(window, sizeof(struct rx_slot));
+    if (rx->slot == NULL)
+	goto fail ;
+    for (i = 0 ; i < window ; i++) {
+	s = &rx->slot[i] ;
+	s->buf = calloc(max_k, sizeof(char *));
+	s->pkt = calloc(max_k, sizeof(void *));
+	s->index = calloc(max_k, sizeof(int));
+	if (s->buf == NULL || s->pkt == NULL || s->index == NULL)
+	    goto fail ;
+	for (j = 0 ; j < max_k ; j++)
+	    if ( (s->buf[j] = new_buf(max_sz)) == NULL)
+		goto fail ;
+    }
+    for (i = 0 ; i < BATCH ; i++) {
+	if ( (rx->buf[i] = new_buf(max_sz)) == NULL)
+	    goto fail ;
+	rx->msg[i].msg_hdr.msg_iov = &rx->iov[i] ;
+	rx->msg[i].msg_hdr.msg_iovlen = 1 ;
+	rx->iov[i].iov_base = rx->buf[i] + HDR_OFF ;
+	rx->iov[i].iov_len = FEC_HDR_SIZE + max_sz ;
+    }
+    return rx ;
+fail:
+    fec_rx_free(rx);
+    return NULL ;
+}
+
+void
+fec_rx_free(void *rx1)
+{
+    struct fec_rx *rx = rx1 ;
+    struct rx_slot *s ;
+    int i, j ;
+
+    if (rx == NULL)
+	return ;
+    for (i = 0 ; rx->slot != NULL && i < rx->window ; i++) {
+	s = &rx->slot[i] ;
+	for (j = 0 ; s->buf != NULL && j < rx->max_k ; j++)
+	    free(s->buf[j]);
+	free(s->buf);
+	free(s->pkt);
+	free(s->index);
+    }
+    free(rx->slot);
+    for (i = 0 ; i < BATCH ; i++)
+	free(rx->buf[i]);
+    for (i = 0 ; i < rx->ncodes ; i++)
+	fec_free(rx->codes[i].code);
+    free(rx->codes);
+    free(rx);
+}
+
+void
+fec_rx_stats(void *rx1, struct fec_rx_stats *st)
+{
+    struct fec_rx *rx = rx1 ;
+
+    *st = rx->st ;
+}
+
+static void *
+get_code(struct fec_rx *rx, int k, int n)
+{
+    struct rx_code *c ;
+    int i ;
+
+    for (i = 0 ; i < rx->ncodes ; i++)
+	if (rx->codes[i].k == k && rx->codes[i].n == n)
+	    return rx->codes[i].code ;
+    c = realloc(rx->codes, (rx->ncodes + 1) * sizeof(struct rx_code));
+    if (c == NULL)
+	return NULL ;
+    rx->codes = c ;
+    c += rx->ncodes ;
+    c->code = fec_new(k, n);
+    if (c->code == NULL)
+	return NULL ;
+    c->k = k ;
+    c->n = n ;
+    rx->ncodes++ ;
+    return c->code ;
+}
+
+static void
+rx_complete(struct fec_rx *rx, struct rx_slot *s)
+{
+    uint64_t lat ;
+    int i ;
+
+    for (i = 0 ; i < s->k ; i++)
+	s->pkt[i] = s->buf[i] + PAYLOAD_OFF ;
+    s->state = SLOT_DONE ;
+    if (fec_decode(s->code, s->pkt, s->index, s->sz) != FEC_OK) {
+	rx->st.lost++ ;
+	return ;
+    }
+    rx->deliver(rx->arg, s->block, s->pkt, s->k, s->sz);
+    lat = now_ns() - s->first ;
+    rx->st.blocks++ ;
+    rx->st.lat_ns += lat ;
+    if (lat > rx->st.lat_max_ns)
+	rx->st.lat_max_ns = lat ;
+}
+
+/*
+ * give a slot to the block, abandoning the older one it held.
+ */
+static struct rx_slot *
+rx_slot(struct fec_rx *rx, uint32_t block)
+{
+    struct rx_slot *s = &rx->slot[block % rx->window] ;
+
+    if (s->state != SLOT_FREE && s->block != block) {
+	if (SEQ_LT(block, s->block))
+	    return NULL ;
+	if (s->state == SLOT_FILL || s->state == SLOT_WAIT)
+	    rx->st.lost++ ;
+	s->state = SLOT_FREE ;
+    }
+    return s ;
+}
+
+/*
+ * block is newer than all those seen so far: the ones in between
+ * wait for their first packet, or are lost already if they are out
+ * of the window.
+ */
+static void
+rx_skip(struct fec_rx *rx, uint32_t block)
+{
+    struct rx_slot *s ;
+    uint32_t b = rx->next ;
+
+    if (block - b > (uint32_t)rx->window) {
+	rx->st.lost += block - b - rx->window ;
+	b = block - rx->window ;
+    }
+    for (; b != block ; b++)
+	if ( (s = rx_slot(rx, b)) != NULL && s->state == SLOT_FREE) {
+	    s->block = b ;
+	    s->state = SLOT_WAIT ;
+	}
+}
+
+/*
+ * handle the datagram of len bytes in receive buffer b.
+ */
+static void
+rx_packet(struct fec_rx *rx, int b, int len)
+{
+    struct rx_slot *s ;
+    uint32_t block ;
+    uint16_t h[4] ;
+    int i, index, k, n, sz ;
+    char *tmp ;
+
+    memcpy(&block, rx->buf[b] + HDR_OFF, 4);
+    memcpy(h, rx->buf[b] + HDR_OFF + 4, 8);
+    block = ntohl(block);
+    index = ntohs(h[0]);
+    k = ntohs(h[1]);
+    n = ntohs(h[2]);
+    sz = ntohs(h[3]);
+    if (len != FEC_HDR_SIZE + sz || sz > rx->max_sz || k < 1 ||
+	    k > rx->max_k || n <= k || n > GF_SIZE + 1 || index >= n ||
+	    (GF_BITS > 8 && (sz & 1))) {
+	rx->st.dropped++ ;
+	return ;
+    }
+    if (!rx->started || !SEQ_LT(block, rx->next)) {
+	if (rx->started)
+	    rx_skip(rx, block);
+	rx->started = 1 ;
+	rx->next = block + 1 ;
+    }
+    if ( (s = rx_slot(rx, block)) == NULL || s->state == SLOT_DONE) {
+	rx->st.dropped++ ;
+	return ;
+    }
+    if (s->state == SLOT_FREE || s->state == SLOT_WAIT) {
+	s->code = get_code(rx, k, n);
+	if (s->code == NULL) {
+	    rx->st.dropped++ ;
+	    return ;
+	}
+	s->block = block ;
+	s->k = k ;
+	s->n = n ;
+	s->sz = sz ;
+	s->count = 0 ;
+	s->first = now_ns();
+	s->state = SLOT_FILL ;
+    } else if (k != s->k || n != s->n || sz != s->sz) {
+	rx->st.dropped++ ;
+	return ;
+    }
+    for (i = 0 ; i < s->count ; i++)
+	if (s->index[i] == index) {
+	    rx->st.dropped++ ;
+	    return ;
+	}
+    /* keep the datagram, give a free buffer to the receive batch */
+    tmp = s->buf[s->count] ;
+    s->buf[s->count] = rx->buf[b] ;
+    rx->buf[b] = tmp ;
+    rx->iov[b].iov_base = tmp + HDR_OFF ;
+    s->index[s->count++] = index ;
+    if (s->count == s->k)
+	rx_complete(rx, s);
+}
+
+/*
+ * wait up to timeout_ms (-1 forever) for datagrams, and process all
+ * those that are ready. Returns the number of datagrams received, 0
+ * on timeout, or -1 on error.
+ */
+int
+fec_rx_poll(void *rx1, int timeout_ms)
+{
+    struct fec_rx *rx = rx1 ;
+    struct pollfd pfd ;
+    int i, r, total = 0 ;
+
+    pfd.fd = rx->fd ;
+    pfd.events = POLLIN ;
+    r = poll(&pfd, 1, timeout_ms);
+    if (r <= 0)
+	return (r < 0 && errno != EINTR) ? -1 : 0 ;
+    for (;;) {
+	for (i = 0 ; i < BATCH ; i++)
+	    rx->msg[i].msg_hdr.msg_flags = 0 ;
+	r = recvmmsg(rx->fd, rx->msg, BATCH, MSG_DONTWAIT, NULL);
+	if (r < 0) {
+	    if (errno == EINTR)
+		continue ;
+	    if (errno == EAGAIN || errno == EWOULDBLOCK)
+		break ;
+	    return -1 ;
+	}
+	for (i = 0 ; i < r ; i++) {
+	    rx->st.packets++ ;
+	    if (rx->msg[i].msg_hdr.msg_flags & MSG_TRUNC)
+		rx->st.dropped++ ;
+	    else
+		rx_packet(rx, i, rx->msg[i].msg_len);
+	}
+	total += r ;
+	if (r < BATCH || total >= 16 * BATCH)	/* let the caller run */
+	    break ;
+    }
+    return total ;
+}
+
+/* end of file */
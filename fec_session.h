@@ -0,0 +1,59 @@
+/*
+ * fec_session.h -- block framing, sending and reassembly over UDP
+ *
+ * Every datagram carries a 12 byte header followed by one packet of
+ * a block, all fields in network byte order:
+ *	uint32_t block		block id, wraps around
+ *	uint16_t index		0..k-1 data, k..n-1 parity
+ *	uint16_t k, n		code parameters of the block
+ *	uint16_t sz		payload size, the same for all the block
+ * The sender transmits the n packets of each block, interleaving
+ * 'depth' consecutive blocks so that a burst of losses is spread
+ * over several of them. The receiver keeps reassembly state for a
+ * window of blocks, and decodes a block as soon as k of its packets
+ * have arrived. Datagrams are moved with sendmmsg()/recvmmsg().
+ */
+
+#include <stdint.h>
+
+#define FEC_HDR_SIZE	12
+
+/*
+ * sender. fd is a connected UDP socket, each block is made of k data
+ * packets of sz bytes, n - k parity packets are added.
+ */
+void * fec_tx_new(int fd, int k, int n, int sz, int depth) ;
+void fec_tx_free(void *tx) ;
+int fec_tx_send(void *tx, void *src[]) ;
+int fec_tx_flush(void *tx) ;
+/*
+ * for testing: drop() is called for every packet, the packet is not
+ * sent if it returns non zero.
+ */
+void fec_tx_set_filter(void *tx,
+	int (*drop)(void *arg, uint32_t block, int index), void *arg) ;
+
+/*
+ * receiver. deliver() is called with the k data packets of each
+ * decoded block, which are only valid during the call.
+ */
+typedef void fec_deliver_t(void *arg, uint32_t block, void *pkt[],
+	int k, int sz) ;
+
+struct fec_rx_stats {
+    uint64_t packets ;		/* datagrams received */
+    uint64_t blocks ;		/* blocks delivered */
+    uint64_t lost ;		/* blocks abandoned with fewer than k packets,
+				 * none included */
+    uint64_t dropped ;		/* duplicate, late or malformed datagrams */
+    uint64_t lat_ns ;		/* sum of first packet to delivery times */
+    uint64_t lat_max_ns ;
+} ;
+
+void * fec_rx_new(int fd, int max_k, int max_sz, int window,
+	fec_deliver_t *deliver, void *arg) ;
+void fec_rx_free(void *rx) ;
+int fec_rx_poll(void *rx, int timeout_ms) ;
+void fec_rx_stats(void *rx, struct fec_rx_stats *st) ;
+
+/* end of file */
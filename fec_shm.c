@@ -0,0 +1,575 @@
+/*
+ * fec_shm.c -- encoding/decoding offloaded to a local daemon
+ *
+ * Layout of the region: a header with the parameters and a doorbell
+ * for each worker, then nclients slots, each with its owner's pid, its
+ * request and completion rings, and its arena, all page aligned.
+ *
+ * A ring is a power of 2 array of requests with a head index written
+ * only by the consumer and a tail index written only by the producer,
+ * on separate cache lines; an entry is published by the release store
+ * of the tail. A client never has more requests in flight than a ring
+ * holds, so the completion ring cannot overflow.
+ *
+ * Sleeping uses the usual futex handshake: the sleeper sets its flag,
+ * then checks again for work; the waker publishes, then looks at the
+ * flag. Both sides go through a full barrier in between, so one of
+ * them sees the other.
+ *
+ * A worker serves slots id, id + nworkers ... The daemon keeps its own
+ * copy of the layout and never reads it back from the header, and each
+ * request is checked against the arena of its slot, so a client cannot
+ * make the daemon touch memory outside the region. The region itself is
+ * not protected: every client maps all of it and can read or write the
+ * rings and arenas of the others, so the clients must trust each other.
+ * Codes are kept in a small cache and shared by all workers.
+ */
+
+#define _GNU_SOURCE	/* pthread_setaffinity_np */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "fec.h"
+#include "fec_shm.h"
+
+#define SHM_MAGIC	0x66656373	/* "fecs" */
+#define SHM_VERSION	1
+#define RING_SIZE	256		/* requests per ring, power of 2 */
+#define MAX_WORKERS	64
+#define CODE_CACHE	64		/* (k, n) codes kept by the daemon */
+#define SPIN		20000		/* idle polls before sleeping */
+#define SLEEP_NS	100000000	/* recheck shutdown this often */
+#define PAGE		4096
+#define ALIGN_UP(x, a)	(((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+#define LOAD_ACQ(p)	__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE_REL(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define FENCE()		__atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+struct bell {
+    uint32_t seq ;		/* bumped to wake the worker */
+    uint32_t sleeping ;
+    char pad[56] ;
+} ;
+
+struct ring {
+    uint32_t head ;		/* consumer */
+    uint32_t waiting ;		/* consumer sleeps on tail */
+    char pad0[56] ;
+    uint32_t tail ;		/* producer */
+    char pad1[60] ;
+    struct fec_shm_req r[RING_SIZE] ;
+} ;
+
+struct slot {
+    uint32_t pid ;		/* owner, 0 if free */
+    char pad[60] ;
+    struct ring req ;		/* client -> daemon */
+    struct ring cpl ;		/* daemon -> client */
+} ;
+
+struct hdr {
+    uint32_t magic ;		/* set last, when the region is ready */
+    uint32_t version ;
+    int32_t gf_bits ;
+    int32_t nclients ;
+    int32_t nworkers ;
+    uint32_t shutdown ;
+    uint64_t arena ;		/* arena size */
+    uint64_t slot_size ;	/* slot header + arena */
+    struct bell bell[MAX_WORKERS] ;
+} ;
+
+#define HDR_SIZE	ALIGN_UP(sizeof(struct hdr), PAGE)
+#define SLOT_HDR	ALIGN_UP(sizeof(struct slot), PAGE)
+#define SLOT(h, ssz, i)	((struct slot *)((char *)(h) + HDR_SIZE + \
+			    (size_t)(i) * (ssz)))
+#define ARENA(s)	((char *)(s) + SLOT_HDR)
+
+static void
+futex_wait(uint32_t *p, uint32_t v)
+{
+    struct timespec ts = { 0, SLEEP_NS } ;
+
+    syscall(SYS_futex, p, FUTEX_WAIT, v, &ts, NULL, 0);
+}
+
+static void
+futex_wake(uint32_t *p)
+{
+    syscall(SYS_futex, p, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/*
+ * the consumer side of a ring. take() returns 0 if it is empty.
+ */
+static int
+take(struct ring *q, struct fec_shm_req *r)
+{
+    uint32_t h = q->head ;
+
+    if (h == LOAD_ACQ(&q->tail))
+	return 0 ;
+    *r = q->r[h & (RING_SIZE - 1)] ;
+    STORE_REL(&q->head, h + 1);
+    return 1 ;
+}
+
+/*
+ * the producer side; the caller knows there is room.
+ */
+static void
+put(struct ring *q, const struct fec_shm_req *r)
+{
+    uint32_t t = q->tail ;
+
+    q->r[t & (RING_SIZE - 1)] = *r ;
+    STORE_REL(&q->tail, t + 1);
+}
+
+/*
+ * --- daemon ---
+ */
+
+struct code_ent {
+    int k, n ;
+    void *code ;
+} ;
+
+struct server ;
+
+struct worker {
+    struct server *srv ;
+    pthread_t tid ;
+    int id ;
+    void **pkt, **dst ;		/* private copies for a request */
+    int *index ;
+    char *tmp ;			/* one packet, to reorder a block */
+    int tmp_sz ;
+} ;
+
+struct server {
+    char *name ;
+    struct hdr *h ;
+    size_t len ;
+    int nclients, nworkers ;	/* the layout, as created */
+    uint64_t arena, slot_size ;
+    int cpu0 ;
+    int nstarted ;
+    struct worker w[MAX_WORKERS] ;
+    pthread_mutex_t lock ;	/* protects the code cache */
+    struct code_ent codes[CODE_CACHE] ;
+    int ncodes ;
+} ;
+
+/*
+ * the shared code for (k, n), or a private one (*tmp set) when the
+ * cache is full.
+ */
+static void *
+get_code(struct server *srv, int k, int n, int *tmp)
+{
+    void *code = NULL ;
+    int i ;
+
+    *tmp = 0 ;
+    pthread_mutex_lock(&srv->lock);
+    for (i = 0 ; i < srv->ncodes ; i++)
+	if (srv->codes[i].k == k && srv->codes[i].n == n) {
+	    code = srv->codes[i].code ;
+	    break ;
+	}
+    if (code == NULL && (code = fec_new(k, n)) != NULL) {
+	if (srv->ncodes < CODE_CACHE) {
+	    srv->codes[srv->ncodes].k = k ;
+	    srv->codes[srv->ncodes].n = n ;
+	    srv->codes[srv->ncodes++].code = code ;
+	} else
+	    *tmp = 1 ;
+    }
+    pthread_mutex_unlock(&srv->lock);
+    return code ;
+}
+
+static int
+in_arena(uint64_t off, uint64_t len, uint64_t arena)
+{
+    return off <= arena && len <= arena - off ;
+}
+
+/*
+ * fec_decode() leaves source i in pkt[i], which may be the buffer of
+ * another packet of the block: move the data so that packet i of the
+ * block is source i, following the cycles of the permutation.
+ */
+static int
+reorder(struct worker *w, char *base, int k, int sz)
+{
+    int i, j, nxt ;
+
+    if (w->tmp_sz < sz) {
+	free(w->tmp);
+	w->tmp_sz = 0 ;
+	if ( (w->tmp = malloc(sz)) == NULL)
+	    return FEC_ENOMEM ;
+	w->tmp_sz = sz ;
+    }
+    for (i = 0 ; i < k ; i++)	/* where source i is, as a position */
+	w->index[i] = ((char *)w->pkt[i] - base) / sz ;
+    for (i = 0 ; i < k ; i++) {
+	if (w->index[i] == i)
+	    continue ;
+	memcpy(w->tmp, base + (size_t)i * sz, sz);
+	for (j = i ; (nxt = w->index[j]) != i ; j = nxt) {
+	    memcpy(base + (size_t)j * sz, base + (size_t)nxt * sz, sz);
+	    w->index[j] = j ;
+	}
+	memcpy(base + (size_t)j * sz, w->tmp, sz);
+	w->index[j] = j ;
+    }
+    return FEC_OK ;
+}
+
+static int
+run(struct worker *w, char *arena, uint64_t asz, struct fec_shm_req *r)
+{
+    int k = r->k, n = r->n, sz = r->sz, i, err, tmp, nidx ;
+    char *base ;
+    int *index ;
+    void *code ;
+
+    if ((r->op != FEC_SHM_ENCODE && r->op != FEC_SHM_DECODE) ||
+	    k < 1 || n < k || n > GF_SIZE + 1 || sz < 1 ||
+	    (GF_BITS > 8 && ((sz | r->pkt | r->out) & 1)))
+	return FEC_EINVAL ;
+    nidx = r->op == FEC_SHM_ENCODE ? r->nout : k ;
+    if (nidx < 0 || nidx > n || r->index % sizeof(int) != 0 ||
+	    !in_arena(r->pkt, (uint64_t)k * sz, asz) ||
+	    !in_arena(r->index, (uint64_t)nidx * sizeof(int), asz) ||
+	    (r->op == FEC_SHM_ENCODE &&
+		!in_arena(r->out, (uint64_t)nidx * sz, asz)))
+	return FEC_EINVAL ;
+    if ( (code = get_code(w->srv, k, n, &tmp)) == NULL)
+	return FEC_ENOMEM ;
+    /* indexes are copied: the client cannot change them under us */
+    base = arena + r->pkt ;
+    index = (int *)(arena + r->index) ;
+    for (i = 0 ; i < k ; i++)
+	w->pkt[i] = base + (size_t)i * sz ;
+    if (r->op == FEC_SHM_ENCODE) {
+	for (i = 0 ; i < nidx ; i++)
+	    w->dst[i] = arena + r->out + (size_t)i * sz ;
+	memcpy(w->index, index, nidx * sizeof(int));
+	err = fec_encode_block(code, w->pkt, w->dst, w->index, nidx, sz);
+    } else {
+	memcpy(w->index, index, k * sizeof(int));
+	for (i = 0 ; i < k ; i++)
+	    if (w->index[i] < 0 || w->index[i] >= n)
+		break ;
+	err = i < k ? FEC_EINVAL : fec_decode(code, w->pkt, w->index, sz);
+	if (err == FEC_OK && (err = reorder(w, base, k, sz)) == FEC_OK)
+	    for (i = 0 ; i < k ; i++)	/* packet i is now source i */
+		index[i] = i ;
+    }
+    if (tmp)
+	fec_free(code);
+    return err ;
+}
+
+static void *
+worker_main(void *arg)
+{
+    struct worker *w = arg ;
+    struct server *sv = w->srv ;
+    struct hdr *h = sv->h ;
+    struct bell *b = &h->bell[w->id] ;
+    struct fec_shm_req r ;
+    struct slot *s ;
+    uint32_t seq ;
+    int i, did, idle = 0 ;
+#ifdef CPU_SET
+    cpu_set_t set ;
+
+    if (sv->cpu0 >= 0) {
+	CPU_ZERO(&set);
+	CPU_SET((sv->cpu0 + w->id) % CPU_SETSIZE, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+#endif
+    while (!LOAD_ACQ(&h->shutdown)) {
+	for (did = 0, i = w->id ; i < sv->nclients ; i += sv->nworkers) {
+	    s = SLOT(h, sv->slot_size, i) ;
+	    if (LOAD_ACQ(&s->pid) == 0)
+		continue ;
+	    /* one request per slot and pass, a busy client cannot
+	     * hold up the others */
+	    if (take(&s->req, &r)) {
+		r.error = run(w, ARENA(s), sv->arena, &r);
+		put(&s->cpl, &r);
+		FENCE();
+		if (LOAD_ACQ(&s->cpl.waiting))
+		    futex_wake(&s->cpl.tail);
+		did++ ;
+	    }
+	}
+	if (did || ++idle < SPIN) {
+	    if (did)
+		idle = 0 ;
+	    continue ;
+	}
+	__atomic_store_n(&b->sleeping, 1, __ATOMIC_SEQ_CST);
+	FENCE();
+	seq = __atomic_load_n(&b->seq, __ATOMIC_SEQ_CST);
+	for (i = w->id ; i < sv->nclients ; i += sv->nworkers) {
+	    s = SLOT(h, sv->slot_size, i) ;
+	    if (LOAD_ACQ(&s->req.tail) != s->req.head)
+		break ;
+	}
+	if (i >= sv->nclients && !LOAD_ACQ(&h->shutdown))
+	    futex_wait(&b->seq, seq);
+	__atomic_store_n(&b->sleeping, 0, __ATOMIC_RELAXED);
+	idle = 0 ;
+    }
+    return NULL ;
+}
+
+void
+fec_shm_server_free(void *srv)
+{
+    struct server *sv = srv ;
+    int i ;
+
+    if (sv->h != NULL) {
+	STORE_REL(&sv->h->shutdown, 1);
+	for (i = 0 ; i < sv->nstarted ; i++) {
+	    __atomic_add_fetch(&sv->h->bell[i].seq, 1, __ATOMIC_SEQ_CST);
+	    futex_wake(&sv->h->bell[i].seq);
+	}
+	for (i = 0 ; i < sv->nstarted ; i++)
+	    pthread_join(sv->w[i].tid, NULL);
+	munmap(sv->h, sv->len);
+	shm_unlink(sv->name);
+    }
+    for (i = 0 ; i < MAX_WORKERS ; i++) {
+	free(sv->w[i].pkt);
+	free(sv->w[i].dst);
+	free(sv->w[i].index);
+	free(sv->w[i].tmp);
+    }
+    for (i = 0 ; i < sv->ncodes ; i++)
+	fec_free(sv->codes[i].code);
+    pthread_mutex_destroy(&sv->lock);
+    free(sv->name);
+    free(sv);
+}
+
+/*
+ * create the region (replacing a stale one of the same name) and
+ * start the workers. NULL on failure, with errno set.
+ */
+void *
+fec_shm_server_new(const char *name, int nclients, size_t arena,
+	int nworkers, int cpu0)
+{
+    struct server *sv ;
+    struct hdr *h ;
+    int fd, i ;
+
+    if (nclients < 1 || arena < 1 || nworkers < 1 ||
+	    nworkers > MAX_WORKERS) {
+	errno = EINVAL ;
+	return NULL ;
+    }
+    if ( (sv = calloc(1, sizeof(struct server))) == NULL)
+	return NULL ;
+    pthread_mutex_init(&sv->lock, NULL);
+    sv->cpu0 = cpu0 ;
+    sv->nclients = nclients ;
+    sv->nworkers = nworkers ;
+    sv->arena = arena = ALIGN_UP(arena, PAGE) ;
+    sv->slot_size = SLOT_HDR + arena ;
+    sv->len = HDR_SIZE + (size_t)nclients * sv->slot_size ;
+    if ( (sv->name = strdup(name)) == NULL)
+	goto fail ;
+    for (i = 0 ; i < nworkers ; i++) {
+	sv->w[i].srv = sv ;
+	sv->w[i].id = i ;
+	sv->w[i].pkt = malloc((GF_SIZE + 1) * sizeof(void *));
+	sv->w[i].dst = malloc((GF_SIZE + 1) * sizeof(void *));
+	sv->w[i].index = malloc((GF_SIZE + 1) * sizeof(int));
+	if (sv->w[i].pkt == NULL || sv->w[i].dst == NULL ||
+		sv->w[i].index == NULL)
+	    goto fail ;
+    }
+    shm_unlink(name);
+    if ( (fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0)
+	goto fail ;
+    if (ftruncate(fd, sv->len) < 0) {
+	close(fd);
+	shm_unlink(name);
+	goto fail ;
+    }
+    h = mmap(NULL, sv->len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED) {
+	shm_unlink(name);
+	goto fail ;
+    }
+    sv->h = h ;
+    h->version = SHM_VERSION ;
+    h->gf_bits = GF_BITS ;
+    h->nclients = nclients ;	/* for the clients only */
+    h->nworkers = nworkers ;
+    h->arena = arena ;
+    h->slot_size = sv->slot_size ;
+    STORE_REL(&h->magic, SHM_MAGIC);
+    for (i = 0 ; i < nworkers ; i++) {
+	if (pthread_create(&sv->w[i].tid, NULL, worker_main, &sv->w[i]) != 0)
+	    goto fail ;
+	sv->nstarted++ ;
+    }
+    return sv ;
+
+fail:
+    i = errno ;
+    fec_shm_server_free(sv);
+    errno = i ;
+    return NULL ;
+}
+
+/*
+ * --- client ---
+ */
+
+struct client {
+    struct hdr *h ;
+    size_t len ;
+    struct slot *s ;
+    struct bell *b ;		/* of the worker serving the slot */
+    uint32_t posted, done ;
+} ;
+
+/*
+ * map the region and take a free slot. NULL if the daemon is not
+ * there, was built with another GF_BITS, or has no free slot.
+ */
+void *
+fec_shm_attach(const char *name)
+{
+    struct client *cl ;
+    struct stat st ;
+    struct hdr *h ;
+    int fd, i ;
+
+    if ( (fd = shm_open(name, O_RDWR, 0)) < 0)
+	return NULL ;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)HDR_SIZE) {
+	close(fd);
+	return NULL ;
+    }
+    h = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED)
+	return NULL ;
+    if (LOAD_ACQ(&h->magic) != SHM_MAGIC || h->version != SHM_VERSION ||
+	    h->gf_bits != GF_BITS || LOAD_ACQ(&h->shutdown) ||
+	    (size_t)st.st_size < HDR_SIZE + h->nclients * h->slot_size ||
+	    (cl = calloc(1, sizeof(struct client))) == NULL) {
+	munmap(h, st.st_size);
+	return NULL ;
+    }
+    cl->h = h ;
+    cl->len = st.st_size ;
+    for (i = 0 ; i < h->nclients ; i++)
+	if (__sync_bool_compare_and_swap(&SLOT(h, h->slot_size, i)->pid, 0, getpid()))
+	    break ;
+    if (i == h->nclients) {
+	munmap(h, cl->len);
+	free(cl);
+	return NULL ;
+    }
+    cl->s = SLOT(h, h->slot_size, i) ;
+    cl->b = &h->bell[i % h->nworkers] ;
+    return cl ;
+}
+
+/*
+ * wait for the requests in flight, then give the slot back.
+ */
+void
+fec_shm_detach(void *cl)
+{
+    struct client *c = cl ;
+    struct fec_shm_req r ;
+
+    while (c->posted != c->done && fec_shm_poll(c, &r, 1))
+	;
+    STORE_REL(&c->s->pid, 0);
+    munmap(c->h, c->len);
+    free(c);
+}
+
+void *
+fec_shm_arena(void *cl, size_t *size)
+{
+    struct client *c = cl ;
+
+    if (size != NULL)
+	*size = c->h->arena ;
+    return ARENA(c->s) ;
+}
+
+int
+fec_shm_post(void *cl, const struct fec_shm_req *r)
+{
+    struct client *c = cl ;
+
+    if (c->posted - c->done >= RING_SIZE)
+	return FEC_EAGAIN ;
+    put(&c->s->req, r);
+    c->posted++ ;
+    FENCE();
+    if (LOAD_ACQ(&c->b->sleeping)) {
+	__atomic_add_fetch(&c->b->seq, 1, __ATOMIC_SEQ_CST);
+	futex_wake(&c->b->seq);
+    }
+    return FEC_OK ;
+}
+
+int
+fec_shm_poll(void *cl, struct fec_shm_req *r, int block)
+{
+    struct client *c = cl ;
+    struct ring *q = &c->s->cpl ;
+    uint32_t t ;
+    int i ;
+
+    for (;;) {
+	for (i = 0 ; i < (block ? SPIN : 1) ; i++)
+	    if (take(q, r)) {
+		c->done++ ;
+		return 1 ;
+	    }
+	if (!block || c->posted == c->done || LOAD_ACQ(&c->h->shutdown))
+	    return 0 ;
+	__atomic_store_n(&q->waiting, 1, __ATOMIC_SEQ_CST);
+	FENCE();
+	t = __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST);
+	if (t == q->head)
+	    futex_wait(&q->tail, t);
+	__atomic_store_n(&q->waiting, 0, __ATOMIC_RELAXED);
+    }
+}
+
+/* end of file */
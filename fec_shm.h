@@ -0,0 +1,56 @@
+/*
+ * fec_shm.h -- encoding/decoding offloaded to a local daemon
+ *
+ * The daemon (fec_shmd) creates a shared memory region with a slot for
+ * each client process: an arena for packets, a ring of requests and a
+ * ring of completions. A client attaches to a free slot, places blocks
+ * in its arena and posts requests that refer to them by offset. The
+ * daemon's workers, each pinned to a core and serving a fixed subset
+ * of the slots, run them with codes shared by all clients, and post
+ * the completions back. Each ring has one producer and one consumer
+ * and needs no locks; the request rings of a worker share a doorbell.
+ * A side with nothing to do spins for a while, then sleeps on a futex
+ * that the other side wakes.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FEC_SHM_ENCODE	1
+#define FEC_SHM_DECODE	2
+
+struct fec_shm_req {
+    int32_t op ;	/* FEC_SHM_ENCODE or FEC_SHM_DECODE */
+    int32_t k, n ;	/* the code, as in fec_new() */
+    int32_t sz ;	/* packet size */
+    uint64_t pkt ;	/* arena offset of the k packets, sz bytes apart;
+			 * decode: on return packet i is source i */
+    uint64_t index ;	/* arena offset of the indexes (int): encode: of the
+			 * nout parities to produce; decode: as in fec_decode(),
+			 * on return index[i] is i */
+    uint64_t out ;	/* encode: arena offset of the nout parities */
+    int32_t nout ;
+    int32_t error ;	/* result: FEC_OK or an error code */
+    uint64_t tag ;	/* for the caller */
+} ;
+
+/*
+ * daemon side. Worker i is pinned to cpu cpu0 + i, or not pinned if
+ * cpu0 < 0. The region is removed by fec_shm_server_free().
+ */
+void * fec_shm_server_new(const char *name, int nclients, size_t arena,
+	int nworkers, int cpu0) ;
+void fec_shm_server_free(void *srv) ;
+
+/*
+ * client side. fec_shm_post() returns FEC_EAGAIN when as many requests
+ * are in flight as the rings hold; fec_shm_poll() returns 1 and the
+ * completed request in *r, or 0 if there is none and block is 0.
+ */
+void * fec_shm_attach(const char *name) ;
+void fec_shm_detach(void *cl) ;
+void * fec_shm_arena(void *cl, size_t *size) ;
+int fec_shm_post(void *cl, const struct fec_shm_req *r) ;
+int fec_shm_poll(void *cl, struct fec_shm_req *r, int block) ;
+
+/* end of file */
@@ -0,0 +1,245 @@
+/*
+ * fec_shm_bench.c -- loopback benchmark of the shared memory service
+ *
+ * Forks -P client processes, then serves them from this process with
+ * -w workers, as fec_shmd would. Each client first encodes -c blocks
+ * with in-process calls on its own code, then the same blocks through
+ * the service with -d requests in flight. -D decodes instead, with the
+ * first min(k, n-k) sources of every block replaced by parities (the
+ * block is restored before each run, in both modes). Reports the
+ * throughput of all clients together and the latency of a block, from
+ * the call or post to its completion.
+ *
+ *	fec_shm_bench [-k k] [-n n] [-s size] [-c blocks] [-P clients]
+ *		[-w workers] [-p first_cpu] [-d depth] [-D]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "fec.h"
+#include "fec_shm.h"
+
+struct result {
+    double secs ;
+    double lat_sum, lat_max ;
+    long blocks ;
+} ;
+
+static int k = 32, n = 40, sz = 1024, count = 20000, depth = 8, dec ;
+static char name[64] ;
+
+static double
+now(void)
+{
+    struct timespec ts ;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9 ;
+}
+
+static void
+lat(struct result *res, double t)
+{
+    res->lat_sum += t ;
+    if (t > res->lat_max)
+	res->lat_max = t ;
+}
+
+/*
+ * Block b of the arena: k packets, then for encoding the n-k parities,
+ * then the indexes. For decoding the packets are restored from tmpl
+ * (the received ones, parities in place of the lost sources).
+ */
+static size_t
+block_size(void)
+{
+    return ((size_t)n * sz + n * sizeof(int) + 63) & ~(size_t)63 ;
+}
+
+static void
+setup(char *blk, int *index, const char *tmpl, const int *tindex)
+{
+    int i ;
+
+    if (dec) {
+	memcpy(blk, tmpl, (size_t)k * sz);
+	memcpy(index, tindex, k * sizeof(int));
+    } else
+	for (i = 0 ; i < n - k ; i++)
+	    index[i] = k + i ;
+}
+
+static void
+client(int fd)
+{
+    struct result res[2] ;
+    struct fec_shm_req r, c ;
+    void *code = fec_new(k, n), *cl = NULL, **pkt, **dst ;
+    char *arena, *tmpl, *src ;
+    int *tindex, i, j, b, lost = k < n - k ? k : n - k, nblk ;
+    double t0, *t_post ;
+
+    memset(res, 0, sizeof(res));
+    src = malloc((size_t)n * sz);
+    tmpl = malloc((size_t)k * sz);
+    tindex = malloc(k * sizeof(int));
+    pkt = malloc(n * sizeof(void *));
+    dst = malloc(n * sizeof(void *));
+    t_post = malloc(depth * sizeof(double));
+    for (i = 0 ; i < n * sz ; i++)
+	src[i] = random() ;
+    for (i = 0 ; i < k ; i++)
+	pkt[i] = src + (size_t)i * sz ;
+    for (i = 0 ; i < n - k ; i++)
+	fec_encode(code, pkt, src + (size_t)(k + i) * sz, k + i, sz);
+    for (i = 0 ; i < k ; i++) {	/* the first sources are lost */
+	j = i < lost ? k + i : i ;
+	tindex[i] = j ;
+	memcpy(tmpl + (size_t)i * sz, src + (size_t)j * sz, sz);
+    }
+
+    /* in process */
+    arena = malloc(block_size());
+    t0 = now();
+    for (b = 0 ; b < count ; b++) {
+	double t = now() ;
+	int *index = (int *)(arena + (size_t)n * sz) ;
+
+	setup(arena, index, tmpl, tindex);
+	for (i = 0 ; i < k ; i++)
+	    pkt[i] = arena + (size_t)i * sz ;
+	for (i = 0 ; i < n - k ; i++)
+	    dst[i] = arena + (size_t)(k + i) * sz ;
+	if (dec)
+	    fec_decode(code, pkt, index, sz);
+	else
+	    fec_encode_block(code, pkt, dst, index, n - k, sz);
+	lat(&res[0], now() - t);
+    }
+    res[0].secs = now() - t0 ;
+    res[0].blocks = count ;
+    free(arena);
+
+    /* through the service */
+    for (t0 = now() ; cl == NULL && now() - t0 < 5 ; usleep(1000))
+	cl = fec_shm_attach(name);
+    if (cl == NULL) {
+	fprintf(stderr, "fec_shm_attach failed\n");
+	exit(1);
+    }
+    arena = fec_shm_arena(cl, NULL);
+    nblk = depth ;
+    t0 = now();
+    for (b = 0 ; b < count + nblk ; b++) {
+	if (b >= nblk) {	/* wait for the oldest */
+	    fec_shm_poll(cl, &c, 1);
+	    if (c.error != FEC_OK) {
+		fprintf(stderr, "request failed: %d\n", c.error);
+		exit(1);
+	    }
+	    lat(&res[1], now() - t_post[c.tag]);
+	}
+	if (b >= count)
+	    continue ;
+	j = b % nblk ;
+	r.op = dec ? FEC_SHM_DECODE : FEC_SHM_ENCODE ;
+	r.k = k ;
+	r.n = n ;
+	r.sz = sz ;
+	r.pkt = j * block_size() ;
+	r.out = r.pkt + (size_t)k * sz ;
+	r.index = r.pkt + (size_t)n * sz ;
+	r.nout = n - k ;
+	r.tag = j ;
+	setup(arena + r.pkt, (int *)(arena + r.index), tmpl, tindex);
+	t_post[j] = now() ;
+	fec_shm_post(cl, &r);
+    }
+    res[1].secs = now() - t0 ;
+    res[1].blocks = count ;
+    fec_shm_detach(cl);
+    write(fd, res, sizeof(res));
+    exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int nclients = 2, nworkers = 2, cpu0 = -1, fd[2], i, c ;
+    struct result res[2], tot[2] ;
+    void *srv ;
+    double mb ;
+
+    while ( (c = getopt(argc, argv, "k:n:s:c:P:w:p:d:D")) != -1)
+	switch (c) {
+	case 'k': k = atoi(optarg) ; break ;
+	case 'n': n = atoi(optarg) ; break ;
+	case 's': sz = atoi(optarg) ; break ;
+	case 'c': count = atoi(optarg) ; break ;
+	case 'P': nclients = atoi(optarg) ; break ;
+	case 'w': nworkers = atoi(optarg) ; break ;
+	case 'p': cpu0 = atoi(optarg) ; break ;
+	case 'd': depth = atoi(optarg) ; break ;
+	case 'D': dec = 1 ; break ;
+	default:
+	    fprintf(stderr, "usage: fec_shm_bench [-k k] [-n n] [-s size] "
+		"[-c blocks] [-P clients] [-w workers] [-p first_cpu] "
+		"[-d depth] [-D]\n");
+	    return 1 ;
+	}
+    if (k < 1 || n <= k || n > GF_SIZE + 1 || depth < 1 || depth > 256) {
+	fprintf(stderr, "bad parameters\n");
+	return 1 ;
+    }
+    snprintf(name, sizeof(name), "/fec_shm_bench.%d", (int)getpid());
+    if (pipe(fd) < 0) {
+	perror("pipe");
+	return 1 ;
+    }
+    /* fork first, the children must not inherit the workers */
+    for (i = 0 ; i < nclients ; i++)
+	if (fork() == 0) {
+	    srandom(i + 1);
+	    client(fd[1]);
+	}
+    srv = fec_shm_server_new(name, nclients, depth * block_size(),
+	nworkers, cpu0);
+    if (srv == NULL) {
+	perror("fec_shm_server_new");
+	return 1 ;
+    }
+    memset(tot, 0, sizeof(tot));
+    for (i = 0 ; i < nclients ; i++) {
+	if (read(fd[0], res, sizeof(res)) != sizeof(res))
+	    break ;
+	for (c = 0 ; c < 2 ; c++) {
+	    /* the clients run side by side: add up their rates */
+	    tot[c].secs += res[c].blocks / res[c].secs ;
+	    tot[c].blocks += res[c].blocks ;
+	    tot[c].lat_sum += res[c].lat_sum ;
+	    if (res[c].lat_max > tot[c].lat_max)
+		tot[c].lat_max = res[c].lat_max ;
+	}
+    }
+    while (wait(NULL) > 0)
+	;
+    fec_shm_server_free(srv);
+
+    printf("%s k %d n %d size %d, %d clients x %d blocks, %d workers, "
+	"depth %d\n", dec ? "decode" : "encode", k, n, sz, nclients,
+	count, nworkers, depth);
+    mb = (double)k * sz / 1e6 ;
+    for (c = 0 ; c < 2 ; c++)
+	printf("%-10s %8.1f MB/s  latency avg %7.1f us max %8.1f us\n",
+	    c ? "shm" : "in-process", tot[c].secs * mb,
+	    tot[c].blocks ? tot[c].lat_sum * 1e6 / tot[c].blocks : 0,
+	    tot[c].lat_max * 1e6);
+    return 0 ;
+}
+
+/* end of file */
@@ -0,0 +1,53 @@
+/*
+ * fec_shmd.c -- the daemon of fec_shm.h
+ *
+ * Creates the shared region and serves it until SIGINT or SIGTERM.
+ *
+ *	fec_shmd [-n name] [-c clients] [-a arena_kb] [-w workers]
+ *		[-p first_cpu]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include "fec.h"
+#include "fec_shm.h"
+
+int
+main(int argc, char *argv[])
+{
+    const char *name = "/fec_shm" ;
+    int nclients = 16, nworkers = 2, cpu0 = -1, c, sig ;
+    size_t arena = 16 << 20 ;
+    sigset_t set ;
+    void *srv ;
+
+    while ( (c = getopt(argc, argv, "n:c:a:w:p:")) != -1)
+	switch (c) {
+	case 'n': name = optarg ; break ;
+	case 'c': nclients = atoi(optarg) ; break ;
+	case 'a': arena = (size_t)atoi(optarg) << 10 ; break ;
+	case 'w': nworkers = atoi(optarg) ; break ;
+	case 'p': cpu0 = atoi(optarg) ; break ;
+	default:
+	    fprintf(stderr, "usage: fec_shmd [-n name] [-c clients] "
+		"[-a arena_kb] [-w workers] [-p first_cpu]\n");
+	    return 1 ;
+	}
+    /* block the signals before the workers inherit the mask */
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigprocmask(SIG_BLOCK, &set, NULL);
+    if ( (srv = fec_shm_server_new(name, nclients, arena, nworkers,
+	    cpu0)) == NULL) {
+	perror("fec_shm_server_new");
+	return 1 ;
+    }
+    sigwait(&set, &sig);
+    fec_shm_server_free(srv);
+    return 0 ;
+}
+
+/* end of file */
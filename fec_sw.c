@@ -0,0 +1,437 @@
+/*
+ * fec_sw.c -- sliding window random linear code
+ *
+ * A repair packet is sum c(seed, s) * src[s] over the sources it
+ * covers, c() being a hash of the seed and the sequence number that
+ * both sides compute, so only first, count and seed travel with it.
+ *
+ * The decoder keeps the last win >= 2w sources in a ring indexed by
+ * seq % win (a power of 2, so the mapping survives the wrap of seq),
+ * and a set of equations over the missing ones in reduced row
+ * echelon form: each equation has a pivot, a missing source whose
+ * coefficient is 1 there and 0 in all the other equations. Known
+ * sources are always substituted out, so an equation left with only
+ * its pivot gives that source. A source that arrives late is
+ * substituted too; if it was the pivot of an equation, that equation
+ * is taken out and inserted again. When the window slides past a
+ * missing source, the equations that involve it are dropped.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fec.h"
+#include "fec_sw.h"
+
+#define BEFORE(a, b)	((int32_t)((a) - (b)) < 0)
+
+/*
+ * the coefficient of source seq in the repair with this seed, not 0
+ */
+static int
+coef(uint32_t seed, uint32_t seq)
+{
+    uint32_t x = seed * 0x9e3779b9u ^ seq * 0x85ebca6bu ;
+
+    x ^= x >> 16 ;
+    x *= 0x7feb352du ;
+    x ^= x >> 15 ;
+    x *= 0x846ca68bu ;
+    x ^= x >> 16 ;
+    return x % GF_SIZE + 1 ;
+}
+
+/*
+ * --- encoder ---
+ */
+
+struct sw_enc {
+    int w, sz ;
+    int nring ;		/* power of 2, >= w */
+    uint32_t next ;	/* seq of the next source */
+    uint32_t seed ;	/* of the next repair */
+    char **ring ;	/* the last sources, at seq % nring */
+} ;
+
+void *
+sw_enc_new(int w, int sz)
+{
+    struct sw_enc *e ;
+    int i ;
+
+    if (w < 1 || w > SW_MAX_W || sz < 1 || (GF_BITS > 8 && (sz & 1)))
+	return NULL ;
+    e = calloc(1, sizeof(struct sw_enc));
+    if (e == NULL)
+	return NULL ;
+    e->w = w ;
+    e->sz = sz ;
+    for (e->nring = 1 ; e->nring < w ; e->nring <<= 1)
+	;
+    e->ring = calloc(e->nring, sizeof(char *));
+    if (e->ring == NULL) {
+	sw_enc_free(e);
+	return NULL ;
+    }
+    for (i = 0 ; i < e->nring ; i++)
+	if ( (e->ring[i] = malloc(sz)) == NULL) {
+	    sw_enc_free(e);
+	    return NULL ;
+	}
+    return e ;
+}
+
+void
+sw_enc_free(void *enc)
+{
+    struct sw_enc *e = enc ;
+    int i ;
+
+    if (e == NULL)
+	return ;
+    if (e->ring != NULL)
+	for (i = 0 ; i < e->nring ; i++)
+	    free(e->ring[i]);
+    free(e->ring);
+    free(e);
+}
+
+/*
+ * take a source packet, to be sent as is; returns its number.
+ */
+uint32_t
+sw_enc_add(void *enc, const void *src)
+{
+    struct sw_enc *e = enc ;
+
+    memcpy(e->ring[e->next % e->nring], src, e->sz);
+    return e->next++ ;
+}
+
+/*
+ * build a repair packet over the last w sources into dst, and fill
+ * in the header that must be sent with it.
+ */
+int
+sw_enc_repair(void *enc, void *dst, struct sw_repair *h)
+{
+    struct sw_enc *e = enc ;
+    uint32_t s ;
+
+    if (e->next == 0)
+	return FEC_EINVAL ;
+    h->count = e->next < (uint32_t)e->w ? (int)e->next : e->w ;
+    h->first = e->next - h->count ;
+    h->seed = e->seed++ ;
+    memset(dst, 0, e->sz);
+    for (s = h->first ; s != e->next ; s++)
+	fec_addmul(dst, e->ring[s % e->nring], coef(h->seed, s), e->sz);
+    return FEC_OK ;
+}
+
+/*
+ * --- decoder ---
+ */
+
+struct eq {
+    fec_gf *c ;		/* win coefficients, by slot */
+    char *d ;		/* sz bytes of payload */
+    int pivot ;		/* slot */
+} ;
+
+struct sw_dec {
+    int w, sz, win ;
+    sw_deliver_t *deliver ;
+    void *arg ;
+    uint32_t base ;	/* oldest source in the window */
+    uint32_t next ;	/* next to deliver */
+    uint32_t top ;	/* one past the newest source seen */
+    char **data ;	/* win buffers, source s at s % win */
+    char *known ;	/* the slot holds its source */
+    struct eq *eq ;	/* neq equations, and a spare one */
+    int neq ;
+    char *tmp ;		/* sz bytes */
+    struct sw_stats st ;
+} ;
+
+void *
+sw_dec_new(int w, int sz, sw_deliver_t *deliver, void *arg)
+{
+    struct sw_dec *d ;
+    int i, win ;
+
+    if (w < 1 || w > SW_MAX_W || sz < 1 || (GF_BITS > 8 && (sz & 1)) ||
+	    deliver == NULL)
+	return NULL ;
+    for (win = 2 ; win < 2 * w ; win <<= 1)
+	;
+    d = calloc(1, sizeof(struct sw_dec));
+    if (d == NULL)
+	return NULL ;
+    d->w = w ;
+    d->sz = sz ;
+    d->win = win ;
+    d->deliver = deliver ;
+    d->arg = arg ;
+    d->data = calloc(win, sizeof(char *));
+    d->known = calloc(win, 1);
+    d->eq = calloc(win + 1, sizeof(struct eq));
+    d->tmp = malloc(sz);
+    if (d->data == NULL || d->known == NULL || d->eq == NULL ||
+	    d->tmp == NULL) {
+	sw_dec_free(d);
+	return NULL ;
+    }
+    for (i = 0 ; i < win ; i++)
+	if ( (d->data[i] = malloc(sz)) == NULL) {
+	    sw_dec_free(d);
+	    return NULL ;
+	}
+    for (i = 0 ; i <= win ; i++) {
+	d->eq[i].c = calloc(win, sizeof(fec_gf));
+	d->eq[i].d = malloc(sz);
+	if (d->eq[i].c == NULL || d->eq[i].d == NULL) {
+	    sw_dec_free(d);
+	    return NULL ;
+	}
+    }
+    return d ;
+}
+
+void
+sw_dec_free(void *dec)
+{
+    struct sw_dec *d = dec ;
+    int i ;
+
+    if (d == NULL)
+	return ;
+    if (d->data != NULL)
+	for (i = 0 ; i < d->win ; i++)
+	    free(d->data[i]);
+    if (d->eq != NULL)
+	for (i = 0 ; i <= d->win ; i++) {
+	    free(d->eq[i].c);
+	    free(d->eq[i].d);
+	}
+    free(d->data);
+    free(d->known);
+    free(d->eq);
+    free(d->tmp);
+    free(d);
+}
+
+static void
+deliver(struct sw_dec *d, uint32_t s)
+{
+    int slot = s % d->win ;
+
+    if (d->known[slot]) {
+	d->st.delivered++ ;
+	d->deliver(d->arg, s, d->data[slot], d->sz);
+    } else {
+	d->st.lost++ ;
+	d->deliver(d->arg, s, NULL, d->sz);
+    }
+}
+
+/*
+ * remove equation i, keeping its buffers in the spare slots
+ */
+static void
+drop_eq(struct sw_dec *d, int i)
+{
+    struct eq t = d->eq[i] ;
+
+    d->eq[i] = d->eq[--d->neq] ;
+    d->eq[d->neq] = t ;
+}
+
+/*
+ * make room in the window for source s: older sources are delivered
+ * (or given up), and equations over those still missing dropped.
+ */
+static void
+slide(struct sw_dec *d, uint32_t s)
+{
+    uint32_t nb = s - d->win + 1 ;
+    int i, slot ;
+
+    if (!BEFORE(s, d->top))
+	d->top = s + 1 ;
+    for (; BEFORE(d->base, nb) ; d->base++) {
+	slot = d->base % d->win ;
+	if (!BEFORE(d->base, d->next)) {
+	    deliver(d, d->base);
+	    d->next = d->base + 1 ;
+	}
+	if (!d->known[slot])
+	    for (i = 0 ; i < d->neq ; i++)
+		if (d->eq[i].c[slot] != 0)
+		    drop_eq(d, i--);
+	d->known[slot] = 0 ;
+    }
+}
+
+/*
+ * reduce the spare equation eq[neq] against the others and add it,
+ * unless it has nothing new. Returns 1 if added.
+ */
+static int
+insert(struct sw_dec *d)
+{
+    struct eq *n = &d->eq[d->neq], *e ;
+    int i, t, p = -1, csz = d->win * sizeof(fec_gf) ;
+    uint32_t s ;
+    char *x ;
+
+    for (i = 0 ; i < d->neq ; i++) {
+	e = &d->eq[i] ;
+	if ( (t = n->c[e->pivot]) != 0) {
+	    fec_addmul(n->c, e->c, t, csz);
+	    fec_addmul(n->d, e->d, t, d->sz);
+	}
+    }
+    for (s = d->base ; BEFORE(s, d->base + d->win) && p < 0 ; s++)
+	if (n->c[s % d->win] != 0)	/* the oldest one */
+	    p = s % d->win ;
+    if (p < 0) {
+	d->st.useless++ ;
+	return 0 ;
+    }
+    if ( (t = fec_gf_inv(n->c[p])) != 1) {
+	for (i = 0 ; i < d->win ; i++)
+	    n->c[i] = fec_gf_mul(n->c[i], t);
+	memset(d->tmp, 0, d->sz);
+	fec_addmul(d->tmp, n->d, t, d->sz);
+	x = n->d ;
+	n->d = d->tmp ;
+	d->tmp = x ;
+    }
+    n->pivot = p ;
+    for (i = 0 ; i < d->neq ; i++) {
+	e = &d->eq[i] ;
+	if ( (t = e->c[p]) != 0) {
+	    fec_addmul(e->c, n->c, t, csz);
+	    fec_addmul(e->d, n->d, t, d->sz);
+	}
+    }
+    d->neq++ ;
+    return 1 ;
+}
+
+/*
+ * collect the equations left with their pivot only, then deliver
+ * what is ready.
+ */
+static void
+progress(struct sw_dec *d)
+{
+    struct eq *e ;
+    int i, j, slot ;
+    char *x ;
+
+    for (i = 0 ; i < d->neq ; i++) {
+	e = &d->eq[i] ;
+	for (j = 0 ; j < d->win && (j == e->pivot || e->c[j] == 0) ; j++)
+	    ;
+	if (j < d->win)
+	    continue ;
+	slot = e->pivot ;
+	x = d->data[slot] ;	/* the payload is the source */
+	d->data[slot] = e->d ;
+	e->d = x ;
+	e->c[slot] = 0 ;
+	d->known[slot] = 1 ;
+	d->st.recovered++ ;
+	drop_eq(d, i--);
+    }
+    while (BEFORE(d->next, d->top) && d->known[d->next % d->win])
+	deliver(d, d->next++);
+}
+
+/*
+ * a source packet was received
+ */
+int
+sw_dec_source(void *dec, uint32_t seq, const void *data)
+{
+    struct sw_dec *d = dec ;
+    int i, t, slot = seq % d->win, re = -1 ;
+    char *src ;
+
+    if (BEFORE(seq, d->base))	/* too late */
+	return FEC_OK ;
+    slide(d, seq);
+    if (d->known[slot])
+	return FEC_OK ;
+    src = d->data[slot] ;
+    memcpy(src, data, d->sz);
+    d->known[slot] = 1 ;
+    for (i = 0 ; i < d->neq ; i++)
+	if ( (t = d->eq[i].c[slot]) != 0) {
+	    fec_addmul(d->eq[i].d, src, t, d->sz);
+	    d->eq[i].c[slot] = 0 ;
+	    if (d->eq[i].pivot == slot)
+		re = i ;
+	}
+    if (re >= 0) {	/* lost its pivot, put it in again */
+	drop_eq(d, re);
+	insert(d);
+    }
+    progress(d);
+    return FEC_OK ;
+}
+
+/*
+ * a repair packet was received, with its header
+ */
+int
+sw_dec_repair(void *dec, const struct sw_repair *h, const void *data)
+{
+    struct sw_dec *d = dec ;
+    struct eq *n ;
+    uint32_t s, end = h->first + h->count ;
+    int slot ;
+
+    if (h->count < 1 || h->count > d->w)
+	return FEC_EINVAL ;
+    if (BEFORE(h->first, d->base)) {	/* too late */
+	d->st.useless++ ;
+	return FEC_OK ;
+    }
+    slide(d, end - 1);
+    n = &d->eq[d->neq] ;
+    memset(n->c, 0, d->win * sizeof(fec_gf));
+    memcpy(n->d, data, d->sz);
+    for (s = h->first ; s != end ; s++) {
+	slot = s % d->win ;
+	if (d->known[slot])
+	    fec_addmul(n->d, d->data[slot], coef(h->seed, s), d->sz);
+	else
+	    n->c[slot] = coef(h->seed, s) ;
+    }
+    if (insert(d))
+	progress(d);
+    return FEC_OK ;
+}
+
+/*
+ * deliver, or give up on, all the sources up to the newest one seen.
+ */
+void
+sw_dec_flush(void *dec)
+{
+    struct sw_dec *d = dec ;
+
+    while (BEFORE(d->next, d->top))
+	deliver(d, d->next++);
+}
+
+void
+sw_dec_stats(void *dec, struct sw_stats *st)
+{
+    *st = ((struct sw_dec *)dec)->st ;
+}
+
+/* end of file */
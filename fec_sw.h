@@ -0,0 +1,52 @@
+/*
+ * fec_sw.h -- sliding window random linear code for low latency streams
+ *
+ * Source packets are numbered 0, 1, 2, ... and sent as they are.
+ * Every now and then the sender adds a repair packet, a combination
+ * of the last w sources (or fewer, at the start) with coefficients
+ * drawn from a generator seeded with the seed in its header. The
+ * receiver eliminates incrementally as packets arrive, so a lost
+ * source is rebuilt as soon as enough repairs covering it are in,
+ * and sources are delivered in order. All packets have sz bytes.
+ *
+ * The decoder's window has win sources, 2w rounded up to a power of
+ * 2, and keeps win buffers of sz bytes and (win + 1) * win field
+ * elements of coefficients: 4MB (8MB with GF_BITS > 8) at SW_MAX_W.
+ */
+
+#include <stdint.h>
+
+#define SW_MAX_W	1024
+
+struct sw_repair {
+    uint32_t first ;	/* first source covered */
+    int count ;		/* number of sources covered, 1 .. w */
+    uint32_t seed ;	/* of the coefficients */
+} ;
+
+void * sw_enc_new(int w, int sz) ;
+uint32_t sw_enc_add(void *enc, const void *src) ;
+int sw_enc_repair(void *enc, void *dst, struct sw_repair *h) ;
+void sw_enc_free(void *enc) ;
+
+/*
+ * called for each source in order; data is NULL if the source could
+ * not be rebuilt before leaving the window.
+ */
+typedef void sw_deliver_t(void *arg, uint32_t seq, void *data, int sz) ;
+
+struct sw_stats {
+    uint64_t delivered ;	/* including rebuilt ones */
+    uint64_t recovered ;	/* rebuilt from repairs */
+    uint64_t lost ;
+    uint64_t useless ;		/* repairs that brought nothing new */
+} ;
+
+void * sw_dec_new(int w, int sz, sw_deliver_t *deliver, void *arg) ;
+int sw_dec_source(void *dec, uint32_t seq, const void *data) ;
+int sw_dec_repair(void *dec, const struct sw_repair *h, const void *data) ;
+void sw_dec_flush(void *dec) ;
+void sw_dec_stats(void *dec, struct sw_stats *st) ;
+void sw_dec_free(void *dec) ;
+
+/* end of file */
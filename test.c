@@ -7,7 +7,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include "fec.h"
+#include "fec_pool.h"
+#include "fec_lrc.h"
+#include "fec_session.h"
+#include "fec_sw.h"
+#include "fec32.h"
+#include "fec_rl.h"
+#include "fec_shm.h"
 
 /*
  * compatibility stuff
@@ -179,6 +190,1598 @@ test_decode(void *code, int k, int index[], int sz, char *s)
     return errors ;
 }
 
+/*
+ * allocator that can be told to fail, to check that errors are
+ * reported to the caller and that blocks come out aligned.
+ */
+static int alloc_fail, alloc_count, alloc_misaligned ;
+
+static void *
+test_alloc(void *arg, size_t sz, size_t align)
+{
+    void *p ;
+
+    if (alloc_fail || posix_memalign(&p, align, sz) != 0)
+	return NULL ;
+    alloc_count++ ;
+    if ((u_long)p & 63)
+	alloc_misaligned++ ;
+    return p ;
+}
+
+static void
+test_free(void *arg, void *p, size_t sz)
+{
+    alloc_count-- ;
+    free(p);
+}
+
+int
+test_alloc_errors(void)
+{
+    struct fec_allocator a = { test_alloc, test_free, NULL };
+    void *code, *pkt[4] ;
+    u_char buf[4][64] ;
+    int i, ix[4], errors = 0 ;
+
+    fec_set_allocator(&a);
+    alloc_fail = 1 ;
+    if (fec_new(4, 8) != NULL) {
+	fprintf(stderr, "fec_new did not fail with no memory\n");
+	errors++ ;
+    }
+    alloc_fail = 0 ;
+    code = fec_new(4, 8);
+    for (i = 0 ; i < 4 ; i++) {
+	pkt[i] = buf[i] ;
+	ix[i] = i + 4 ;
+    }
+    alloc_fail = 1 ;	/* no cached scratch yet */
+    if (fec_decode(code, pkt, ix, 64) != FEC_ENOMEM) {
+	fprintf(stderr, "fec_decode did not report FEC_ENOMEM\n");
+	errors++ ;
+    }
+    alloc_fail = 0 ;
+    if (fec_decode(code, pkt, ix, 64) != FEC_OK)
+	errors++ ;
+    alloc_fail = 1 ;	/* now the scratch area is reused */
+    if (fec_decode(code, pkt, ix, 64) != FEC_OK) {
+	fprintf(stderr, "fec_decode did not reuse scratch memory\n");
+	errors++ ;
+    }
+    alloc_fail = 0 ;
+    fec_free(code);
+    if (alloc_count != 0 || alloc_misaligned != 0) {
+	fprintf(stderr, "allocator: %d blocks leaked, %d misaligned\n",
+	    alloc_count, alloc_misaligned);
+	errors++ ;
+    }
+    fec_set_allocator(NULL);
+    return errors ;
+}
+
+/*
+ * run a mix of large (split) and small jobs through a pool, half of
+ * them reported by callback and half through the completion queue.
+ */
+#define POOL_JOBS	8
+
+static int pool_callbacks ;
+
+static void
+pool_done(struct fec_job *job)
+{
+    __sync_fetch_and_add(&pool_callbacks, 1);
+}
+
+int
+test_pool(void)
+{
+    int k = 10, n = 14, nout = n - k ;
+    void *code = fec_new(k, n), *pool = fec_pool_new(4);
+    struct fec_job jobs[POOL_JOBS], *job ;
+    u_char *data[POOL_JOBS][14] ;
+    void *pkt[POOL_JOBS][10], *out[POOL_JOBS][4] ;
+    int ix[POOL_JOBS][10], oix[4] ;
+    int i, j, b, sz, queued = 0, errors = 0 ;
+
+    for (i = 0 ; i < nout ; i++)
+	oix[i] = k + i ;
+    for (j = 0 ; j < POOL_JOBS ; j++) {
+	sz = (j & 1) ? 200 + 2 * j : 300000 + 64 * j ;
+	for (i = 0 ; i < n ; i++) {
+	    data[j][i] = my_malloc(sz, "pool data");
+	    for (b = 0 ; b < sz ; b++)
+		data[j][i][b] = i < k ? ((b * 7) ^ (i + j)) & GF_SIZE : 0 ;
+	}
+	for (i = 0 ; i < k ; i++)
+	    pkt[j][i] = data[j][i] ;
+	for (i = 0 ; i < nout ; i++)
+	    out[j][i] = data[j][k + i] ;
+	bzero(&jobs[j], sizeof(jobs[j]));
+	jobs[j].op = FEC_JOB_ENCODE ;
+	jobs[j].code = code ;
+	jobs[j].pkt = pkt[j] ;
+	jobs[j].index = oix ;
+	jobs[j].out = out[j] ;
+	jobs[j].nout = nout ;
+	jobs[j].sz = sz ;
+	jobs[j].done = (j & 2) ? pool_done : NULL ;
+	queued += jobs[j].done == NULL ;
+	fec_pool_submit(pool, &jobs[j]);
+    }
+    for (i = 0 ; i < queued ; i++)
+	fec_pool_wait(pool, 1);
+    while (__sync_fetch_and_add(&pool_callbacks, 0) != POOL_JOBS - queued)
+	usleep(1000);
+    /*
+     * now lose the first 4 packets of each block and decode them.
+     */
+    pool_callbacks = queued = 0 ;
+    for (j = 0 ; j < POOL_JOBS ; j++) {
+	for (i = 0 ; i < k ; i++) {
+	    ix[j][i] = i < nout ? k + i : i ;
+	    pkt[j][i] = my_malloc(jobs[j].sz, "pool pkt");
+	    bcopy(data[j][ix[j][i]], pkt[j][i], jobs[j].sz);
+	}
+	jobs[j].op = FEC_JOB_DECODE ;
+	jobs[j].index = ix[j] ;
+	queued += jobs[j].done == NULL ;
+	fec_pool_submit(pool, &jobs[j]);
+    }
+    for (i = 0 ; i < queued ; i++)
+	if ( (job = fec_pool_wait(pool, 1)) == NULL || job->error)
+	    errors++ ;
+    fec_pool_free(pool);	/* waits for the callbacks */
+    for (j = 0 ; j < POOL_JOBS ; j++) {
+	if (jobs[j].error)
+	    errors++ ;
+	for (i = 0 ; i < k ; i++) {
+	    if (bcmp(pkt[j][i], data[j][i], jobs[j].sz)) {
+		fprintf(stderr, "pool: job %d bad packet %d\n", j, i);
+		errors++ ;
+	    }
+	    free(pkt[j][i]);
+	}
+	for (i = 0 ; i < n ; i++)
+	    free(data[j][i]);
+    }
+    fec_free(code);
+    return errors ;
+}
+
+/*
+ * check the fused checksums against a separate pass.
+ */
+int
+test_crc(void)
+{
+    int k = 8, n = 12, sz = 3000, i, j, ix[8], errors = 0 ;
+    void *code = fec_new(k, n) ;
+    u_char *data[12], *pkt[8] ;
+    uint32_t crc[12], dcrc[8] ;
+
+    if (fec_crc32c(0, "123456789", 9) != 0xE3069283) {
+	fprintf(stderr, "crc32c: bad check value\n");
+	errors++ ;
+    }
+    for (i = 0 ; i < n ; i++) {
+	data[i] = my_malloc(sz, "crc data");
+	if (i < k)
+	    for (j = 0 ; j < sz ; j++)
+		data[i][j] = (j * 13 + i * 7) & GF_SIZE ;
+	crc[i] = 0 ;
+	fec_encode_crc(code, (void **)data, data[i], i, sz, &crc[i]);
+	if (crc[i] != fec_crc32c(0, data[i], sz)) {
+	    fprintf(stderr, "fec_encode_crc: bad crc for packet %d\n", i);
+	    errors++ ;
+	}
+    }
+    for (i = 0 ; i < k ; i++) {	/* lose the first 4 */
+	ix[i] = i < n - k ? k + i : i ;
+	pkt[i] = my_malloc(sz, "crc pkt");
+	bcopy(data[ix[i]], pkt[i], sz);
+	dcrc[i] = 0 ;
+    }
+    if (fec_decode_crc(code, (void **)pkt, ix, sz, dcrc) != FEC_OK)
+	errors++ ;
+    for (i = 0 ; i < k ; i++) {
+	if (dcrc[i] != (i < n - k ? crc[i] : 0)) {
+	    fprintf(stderr, "fec_decode_crc: bad crc for packet %d\n", i);
+	    errors++ ;
+	}
+	free(pkt[i]);
+    }
+    for (i = 0 ; i < n ; i++)
+	free(data[i]);
+    fec_free(code);
+    return errors ;
+}
+
+/*
+ * reconstruct a window of lost packets, check the window and that
+ * nothing outside it was written.
+ */
+int
+test_range(void)
+{
+    int k = 6, n = 9, sz = 65536, off = 12288, len = 4096 ;
+    int i, ix[6], errors = 0 ;
+    void *code = fec_new(k, n) ;
+    u_char *data[9], *pkt[6] ;
+
+    for (i = 0 ; i < n ; i++) {
+	data[i] = my_malloc(sz, "range data");
+	if (i < k)
+	    memset(data[i], (i * 37 + 1) & GF_SIZE, sz);
+	fec_encode(code, (void **)data, data[i], i, sz);
+    }
+    for (i = 0 ; i < k ; i++) {	/* lose packets 1 and 4 */
+	ix[i] = (i == 1 || i == 4) ? k + i / 2 : i ;
+	pkt[i] = my_malloc(sz, "range pkt");
+	bcopy(data[ix[i]], pkt[i], sz);
+    }
+    if (fec_decode_range(code, (void **)pkt, ix, off, len) != FEC_OK)
+	errors++ ;
+    for (i = 0 ; i < k ; i++) {
+	u_char *orig = data[ix[i]] ;	/* what was received */
+
+	if (bcmp(pkt[i] + off, data[i] + off, len) ||
+		bcmp(pkt[i], orig, off) ||
+		bcmp(pkt[i] + off + len, orig + off + len, sz - off - len)) {
+	    fprintf(stderr, "fec_decode_range: bad packet %d\n", i);
+	    errors++ ;
+	}
+	free(pkt[i]);
+    }
+    for (i = 0 ; i < n ; i++)
+	free(data[i]);
+    fec_free(code);
+    return errors ;
+}
+
+/*
+ * selective decoding with random erasure patterns: reconstruct a
+ * few of the missing sources and check that the others are left
+ * alone. The last pattern wants every source twice.
+ */
+int
+test_sel(void)
+{
+    int k = 20, n = 30, sz = 512, i, j, t, l, nw, errors = 0 ;
+    int ix[20], want[40], lost[20] ;
+    void *code = fec_new(k, n) ;
+    u_char *data[30], *pkt[20], *rx[20] ;
+
+    for (i = 0 ; i < n ; i++) {
+	data[i] = my_malloc(sz, "sel data");
+	if (i < k)
+	    for (j = 0 ; j < sz ; j++)
+		data[i][j] = (j * 3 + i * 11) & GF_SIZE ;
+	fec_encode(code, (void **)data, data[i], i, sz);
+    }
+    for (i = 0 ; i < k ; i++)
+	pkt[i] = my_malloc(sz, "sel pkt");
+    for (t = 0 ; t < 50 ; t++) {
+	/* lose up to n - k random sources, replaced by parities */
+	for (i = 0 ; i < k ; i++)
+	    ix[i] = i ;
+	for (l = 0, i = k ; i < n ; i++)
+	    if (random() & 1)
+		ix[random() % k] = i ;
+	for (i = 0 ; i < k ; i++) {
+	    if (ix[i] >= k)
+		lost[l++] = i ;
+	    rx[i] = pkt[i] ;
+	    bcopy(data[ix[i]], pkt[i], sz);
+	}
+	want[0] = l > 0 ? lost[random() % l] : 0 ;
+	want[1] = random() % k ;
+	want[2] = want[0] ;
+	nw = 3 ;
+	if (t == 49)
+	    for (nw = 0 ; nw < 2 * k ; nw++)
+		want[nw] = nw % k ;
+	if (fec_decode_sel(code, (void **)rx, ix, want, nw, 0, sz) != FEC_OK) {
+	    fprintf(stderr, "fec_decode_sel failed\n");
+	    errors++ ;
+	    continue ;
+	}
+	for (i = 0 ; i < k ; i++) {
+	    int wanted = (nw > 3 || i == want[0] || i == want[1]) ;
+
+	    if (bcmp(rx[i], data[wanted ? i : ix[i]], sz)) {
+		fprintf(stderr, "fec_decode_sel: bad packet %d\n", i);
+		errors++ ;
+	    }
+	}
+    }
+    for (i = 0 ; i < k ; i++)
+	free(pkt[i]);
+    for (i = 0 ; i < n ; i++)
+	free(data[i]);
+    fec_free(code);
+    return errors ;
+}
+
+/*
+ * locally repairable code: a single loss is rebuilt from its group,
+ * more losses go through the global parities.
+ */
+int
+test_lrc(void)
+{
+    int k = 12, l = 3, m = 2, n = 17, sz = 256, i, j, nread, errors = 0 ;
+    int read[17], erased[4] ;
+    void *lrc = lrc_new(k, l, m) ;
+    u_char *data[17], *blk[17], *out ;
+    void *src[17] ;
+
+    if (lrc == NULL) {
+	fprintf(stderr, "lrc_new failed\n");
+	return 1 ;
+    }
+    out = my_malloc(sz, "lrc out");
+    for (i = 0 ; i < n ; i++) {
+	data[i] = my_malloc(sz, "lrc data");
+	blk[i] = my_malloc(sz, "lrc blk");
+	if (i < k)
+	    for (j = 0 ; j < sz ; j++)
+		data[i][j] = (j * 7 + i * 13) & GF_SIZE ;
+	lrc_encode(lrc, (void **)data, data[i], i, sz);
+    }
+    /* one lost data block: read only the rest of its group */
+    erased[0] = 5 ;
+    nread = lrc_plan(lrc, erased, 1, 5, read);
+    for (i = 0 ; i < nread ; i++) {
+	if (read[i] == 5 || (read[i] >= k && read[i] != k + 1))
+	    nread = -1 ;
+	else
+	    src[i] = data[read[i]] ;
+    }
+    if (nread != k / l ||
+	    lrc_repair(lrc, src, read, nread, out, 5, sz) != FEC_OK ||
+	    bcmp(out, data[5], sz)) {
+	fprintf(stderr, "lrc: local repair failed (%d reads)\n", nread);
+	errors++ ;
+    }
+    /* two losses in a group: the global parities are needed */
+    erased[1] = 6 ;
+    nread = lrc_plan(lrc, erased, 2, 6, read);
+    for (i = 0 ; i < nread ; i++)
+	src[i] = data[read[i]] ;
+    if (nread < 0 || nread > k ||
+	    lrc_repair(lrc, src, read, nread, out, 6, sz) != FEC_OK ||
+	    bcmp(out, data[6], sz)) {
+	fprintf(stderr, "lrc: global repair failed (%d reads)\n", nread);
+	errors++ ;
+    }
+    /* several groups at once, and a global parity */
+    erased[0] = 0 ; erased[1] = 5 ; erased[2] = 6 ; erased[3] = k + l ;
+    for (i = 0 ; i < n ; i++)
+	bcopy(data[i], blk[i], sz);
+    for (i = 0 ; i < 4 ; i++)
+	bzero(blk[erased[i]], sz);
+    if (lrc_decode(lrc, (void **)blk, erased, 4, sz) != FEC_OK) {
+	fprintf(stderr, "lrc_decode failed\n");
+	errors++ ;
+    } else
+	for (i = 0 ; i < n ; i++)
+	    if (bcmp(blk[i], data[i], sz)) {
+		fprintf(stderr, "lrc_decode: bad block %d\n", i);
+		errors++ ;
+	    }
+    /* a block listed twice is rebuilt once */
+    erased[0] = 5 ; erased[1] = 0 ; erased[2] = 5 ;
+    bzero(blk[0], sz);
+    bzero(blk[5], sz);
+    if (lrc_decode(lrc, (void **)blk, erased, 3, sz) != FEC_OK ||
+	    bcmp(blk[0], data[0], sz) || bcmp(blk[5], data[5], sz)) {
+	fprintf(stderr, "lrc_decode: duplicate erasure failed\n");
+	errors++ ;
+    }
+    /* three losses in a group and a global parity: too many */
+    erased[0] = 4 ; erased[1] = 5 ; erased[2] = 6 ; erased[3] = k + l ;
+    if (lrc_plan(lrc, erased, 4, 4, read) != -1 ||
+	    lrc_decode(lrc, (void **)blk, erased, 4, sz) == FEC_OK) {
+	fprintf(stderr, "lrc: unrecoverable pattern accepted\n");
+	errors++ ;
+    }
+    for (i = 0 ; i < n ; i++) {
+	free(data[i]);
+	free(blk[i]);
+    }
+    free(out);
+    lrc_free(lrc);
+    return errors ;
+}
+
+/*
+ * session layer over loopback UDP. Each block loses three of its
+ * packets, except the last one which loses four and cannot be
+ * decoded, and block S_GONE which loses all of them and must be
+ * counted as lost once the window has moved past it.
+ */
+#define S_K	4
+#define S_N	7
+#define S_SZ	256
+#define S_BLOCKS 8
+#define S_GONE	2
+
+struct sess_state {
+    u_char *data[S_BLOCKS][S_K] ;
+    int delivered, errors ;
+} ;
+
+static int
+sess_drop(void *arg, uint32_t block, int index)
+{
+    return index == block % S_K || index == (block + 1) % S_K ||
+	index == S_N - 1 || (block == S_BLOCKS - 1 && index == S_K) ||
+	block == S_GONE ;
+}
+
+static void
+sess_deliver(void *arg, uint32_t block, void *pkt[], int k, int sz)
+{
+    struct sess_state *st = arg ;
+    int i ;
+
+    st->delivered++ ;
+    if (block >= S_BLOCKS - 1 || block == S_GONE || k != S_K ||
+	    sz != S_SZ) {
+	st->errors++ ;
+	return ;
+    }
+    for (i = 0 ; i < k ; i++)
+	if (bcmp(pkt[i], st->data[block][i], sz))
+	    st->errors++ ;
+}
+
+int
+test_session(void)
+{
+    struct sess_state st ;
+    struct fec_rx_stats rs ;
+    struct sockaddr_in sa[2] ;
+    socklen_t len = sizeof(sa[0]) ;
+    int fd[2], i, j, errors = 0 ;
+    void *tx = NULL, *rx = NULL ;
+
+    bzero(&st, sizeof(st));
+    for (i = 0 ; i < 2 ; i++) {
+	fd[i] = socket(AF_INET, SOCK_DGRAM, 0);
+	bzero(&sa[i], sizeof(sa[i]));
+	sa[i].sin_family = AF_INET ;
+	sa[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (fd[i] < 0 ||
+		bind(fd[i], (struct sockaddr *)&sa[i], sizeof(sa[i])) < 0 ||
+		getsockname(fd[i], (struct sockaddr *)&sa[i], &len) < 0) {
+	    fprintf(stderr, "test_session: no loopback UDP, skipped\n");
+	    return 0 ;
+	}
+    }
+    connect(fd[0], (struct sockaddr *)&sa[1], sizeof(sa[1]));
+    tx = fec_tx_new(fd[0], S_K, S_N, S_SZ, 3);
+    rx = fec_rx_new(fd[1], S_K, S_SZ, 4, sess_deliver, &st);
+    if (tx == NULL || rx == NULL) {
+	fprintf(stderr, "test_session: cannot create sender/receiver\n");
+	errors++ ;
+	goto done ;
+    }
+    fec_tx_set_filter(tx, sess_drop, NULL);
+    for (i = 0 ; i < S_BLOCKS ; i++) {
+	for (j = 0 ; j < S_K ; j++) {
+	    st.data[i][j] = my_malloc(S_SZ, "session data");
+	    memset(st.data[i][j], i * 16 + j, S_SZ);
+	}
+	if (fec_tx_send(tx, (void **)st.data[i]) != FEC_OK)
+	    errors++ ;
+    }
+    if (fec_tx_flush(tx) != FEC_OK)
+	errors++ ;
+    while (fec_rx_poll(rx, 100) > 0)
+	;
+    fec_rx_stats(rx, &rs);
+    if (st.delivered != S_BLOCKS - 2 || st.errors ||
+	    rs.packets != (S_BLOCKS - 1) * (S_N - 3) - 1 ||
+	    rs.blocks != S_BLOCKS - 2 || rs.lost != 1) {
+	fprintf(stderr, "test_session: delivered %d blocks, %d errors, "
+	    "%d packets, %d lost\n", st.delivered, st.errors,
+	    (int)rs.packets, (int)rs.lost);
+	errors++ ;
+    }
+    for (i = 0 ; i < S_BLOCKS ; i++)
+	for (j = 0 ; j < S_K ; j++)
+	    free(st.data[i][j]);
+done:
+    fec_tx_free(tx);
+    fec_rx_free(rx);
+    close(fd[0]);
+    close(fd[1]);
+    return errors ;
+}
+
+/*
+ * the SWAR kernel must give the same bytes as the table one, for
+ * every constant, length and alignment; the kernel chosen at init
+ * must be the fastest measured.
+ */
+int
+test_kernel(void)
+{
+    int c, sz, off, i, errors = 0, max = 200 ;
+    u_char *src = my_malloc(max + 8, "kernel src") ;
+    u_char *d1 = my_malloc(max + 8, "kernel d1") ;
+    u_char *d2 = my_malloc(max + 8, "kernel d2") ;
+
+    for (i = 0 ; i < max + 8 ; i++)
+	src[i] = random() ;
+    for (c = 0 ; c <= GF_SIZE && !errors ; c += (GF_BITS > 8 ? 251 : 1))
+	for (sz = 0 ; sz <= max ; sz += 2 + (sz > 64 ? 30 : 0))
+	    for (off = 0 ; off < 8 ; off += 2) {
+		for (i = 0 ; i < max + 8 ; i++)
+		    d1[i] = d2[i] = i * 7 ;
+		fec_set_kernel("table");
+		fec_addmul(d1 + off, src + 8 - off, c, sz);
+		fec_set_kernel("swar64");
+		fec_addmul(d2 + off, src + 8 - off, c, sz);
+		if (bcmp(d1, d2, max + 8)) {
+		    fprintf(stderr, "swar64 kernel: c %d sz %d off %d differs\n",
+			c, sz, off);
+		    errors++ ;
+		}
+	    }
+    if (fec_set_kernel("nosuch") != FEC_EINVAL ||
+	    strcmp(fec_kernel_name(64), "swar64") != 0)
+	errors++ ;
+    /* back to the kernels chosen at init, the fastest for each size */
+    fec_set_kernel(NULL);
+    for (c = 0 ; c < FEC_NCLASSES ; c++) {
+	struct fec_kernel_info ki ;
+
+	if (fec_kernel_info(c, &ki) != FEC_OK || ki.chosen >= ki.nkernels ||
+		strcmp(fec_kernel_name(ki.bench_sz), ki.name[ki.chosen]) ||
+		(ki.max_sz > 0 && strcmp(fec_kernel_name(ki.max_sz),
+		    ki.name[ki.chosen]))) {
+	    fprintf(stderr, "fec_kernel_info: bad class %d\n", c);
+	    errors++ ;
+	    continue ;
+	}
+	for (i = 0 ; i < ki.nkernels ; i++)
+	    if (ki.mbps[i] > ki.mbps[ki.chosen]) {
+		fprintf(stderr, "class %d: %s is faster than %s\n",
+		    c, ki.name[i], ki.name[ki.chosen]);
+		errors++ ;
+	    }
+    }
+    free(src);
+    free(d1);
+    free(d2);
+    return errors ;
+}
+
+/*
+ * parity rows are built on demand. Check that each row times the
+ * powers of the Vandermonde nodes (0, 1, alpha, alpha^2 ...) gives the
+ * powers of its own node, as a row of V * Vtop^-1 must, and decode
+ * from parities spread over the whole range of indexes.
+ */
+static int
+gf_pow(int x, int e)
+{
+    int r = 1 ;
+
+    while (e-- > 0)
+	r = fec_gf_mul(r, x);
+    return r ;
+}
+
+int
+test_lazy(void)
+{
+    int k = 20, n = GF_SIZE + 1, sz = 64, i, j, p, t, acc, errors = 0 ;
+    int ix[20], node[20] ;
+    fec_gf row[20] ;
+    void *code = fec_new(k, n) ;
+    u_char *data[20], *pkt[20] ;
+
+    for (j = 0 ; j < k ; j++)
+	node[j] = j == 0 ? 0 : gf_pow(2, j - 1) ;
+    for (i = k ; i < n ; i += (n - k) / 7 + 1) {
+	fec_matrix_row(code, i, row);
+	for (p = 0 ; p < k ; p++) {
+	    for (acc = 0, j = 0 ; j < k ; j++)
+		acc ^= fec_gf_mul(row[j], gf_pow(node[j], p));
+	    if (acc != gf_pow(gf_pow(2, i - 1), p)) {
+		fprintf(stderr, "parity row %d is wrong\n", i);
+		errors++ ;
+		break ;
+	    }
+	}
+    }
+    for (i = 0 ; i < k ; i++) {
+	data[i] = my_malloc(sz, "lazy data");
+	pkt[i] = my_malloc(sz, "lazy pkt");
+	for (j = 0 ; j < sz ; j++)
+	    data[i][j] = random() ;
+    }
+    for (t = 0 ; t < 2 ; t++) {	/* the second time rows are cached */
+	u_char *rx[20] ;
+
+	for (i = 0 ; i < k ; i++) {
+	    ix[i] = n - 1 - 3 * i - t ;
+	    rx[i] = pkt[i] ;
+	    fec_encode(code, (void **)data, pkt[i], ix[i], sz);
+	}
+	if (fec_decode(code, (void **)rx, ix, sz) != FEC_OK) {
+	    fprintf(stderr, "test_lazy: decode failed\n");
+	    errors++ ;
+	    continue ;
+	}
+	for (i = 0 ; i < k ; i++)
+	    if (bcmp(rx[i], data[i], sz)) {
+		fprintf(stderr, "test_lazy: bad packet %d\n", i);
+		errors++ ;
+	    }
+    }
+    for (i = 0 ; i < k ; i++) {
+	free(data[i]);
+	free(pkt[i]);
+    }
+    fec_free(code);
+    return errors ;
+}
+
+/*
+ * with a runner set, large decoding matrices go through the blocked
+ * inversion; check it against the default, with a runner that counts
+ * its calls and with a pool.
+ */
+static int runs ;
+
+static void
+count_runner(void *arg, fec_task_fn *fn, void *ctx, int n)
+{
+    int i ;
+
+    runs++ ;
+    for (i = 0 ; i < n ; i++)
+	fn(ctx, i);
+}
+
+int
+test_invert(void)
+{
+    int k = GF_BITS == 8 ? 200 : 300, n = GF_BITS == 8 ? 256 : 700 ;
+    int sz = 32, i, j, t, errors = 0, *ix = malloc(k * sizeof(int)) ;
+    u_char **data = malloc(k * sizeof(void *)) ;
+    u_char **pkt = malloc(k * sizeof(void *)) ;
+    u_char **rx = malloc(k * sizeof(void *)) ;
+    void *code = fec_new(k, n), *pool = fec_pool_new(4) ;
+
+    for (i = 0 ; i < k ; i++) {
+	data[i] = my_malloc(sz, "invert data");
+	pkt[i] = my_malloc(sz, "invert pkt");
+	for (j = 0 ; j < sz ; j++)
+	    data[i][j] = random() ;
+    }
+    for (t = 0 ; t < 3 ; t++) {
+	if (t == 1)
+	    fec_set_runner(count_runner, NULL);
+	else if (t == 2)
+	    fec_set_runner(fec_pool_runner, pool);
+	/* a quarter of the sources lost, different parities each time */
+	for (i = 0, j = k + t ; i < k ; i++) {
+	    ix[i] = i % 4 == 0 ? j++ : i ;
+	    fec_encode(code, (void **)data, pkt[i], ix[i], sz);
+	    rx[i] = pkt[i] ;
+	}
+	if (fec_decode(code, (void **)rx, ix, sz) != FEC_OK) {
+	    fprintf(stderr, "test_invert: decode %d failed\n", t);
+	    errors++ ;
+	    continue ;
+	}
+	for (i = 0 ; i < k ; i++)
+	    if (bcmp(rx[i], data[i], sz)) {
+		fprintf(stderr, "test_invert: bad packet %d run %d\n", i, t);
+		errors++ ;
+		break ;
+	    }
+    }
+    fec_set_runner(NULL, NULL);
+    if (runs != (k + 31) / 32) {	/* once per panel */
+	fprintf(stderr, "test_invert: runner called %d times\n", runs);
+	errors++ ;
+    }
+    for (i = 0 ; i < k ; i++) {
+	free(data[i]);
+	free(pkt[i]);
+    }
+    free(data);
+    free(pkt);
+    free(rx);
+    free(ix);
+    fec_pool_free(pool);
+    fec_free(code);
+    return errors ;
+}
+
+/*
+ * save a code, map it back and compare, then check that damaged
+ * files are refused.
+ */
+static int
+damage(const char *from, const char *to, long off, int trunc)
+{
+    FILE *in = fopen(from, "rb"), *out = fopen(to, "wb") ;
+    long pos ;
+    int c ;
+
+    if (in == NULL || out == NULL)
+	return -1 ;
+    for (pos = 0 ; (c = getc(in)) != EOF ; pos++) {
+	if (trunc && pos == off)
+	    break ;
+	putc(pos == off ? c ^ 0x10 : c, out);
+    }
+    fclose(in);
+    fclose(out);
+    return 0 ;
+}
+
+int
+test_file(void)
+{
+    int k = 20, n = GF_SIZE + 1, sz = 64, i, j, errors = 0, ix[20] ;
+    fec_gf r1[20], r2[20] ;
+    u_char *data[20], *pkt[20], *out = my_malloc(sz, "file out") ;
+    char path[64], bad[80] ;
+    void *code = fec_new(k, n), *mapped ;
+
+    snprintf(path, sizeof(path), "/tmp/fec_test.%d", (int)getpid());
+    snprintf(bad, sizeof(bad), "%s.bad", path);
+    if (fec_save(code, path) != FEC_OK ||
+	    (mapped = fec_open(path, 0)) == NULL) {
+	fprintf(stderr, "test_file: cannot save or open %s\n", path);
+	fec_free(code);
+	return 1 ;
+    }
+    for (i = 0 ; i < k ; i++) {
+	data[i] = my_malloc(sz, "file data");
+	pkt[i] = my_malloc(sz, "file pkt");
+	for (j = 0 ; j < sz ; j++)
+	    data[i][j] = random() ;
+    }
+    for (i = k ; i < n ; i++) {
+	fec_matrix_row(code, i, r1);
+	fec_matrix_row(mapped, i, r2);
+	if (bcmp(r1, r2, sizeof(r1))) {
+	    fprintf(stderr, "test_file: row %d differs\n", i);
+	    errors++ ;
+	    break ;
+	}
+    }
+    for (i = 0 ; i < k ; i++) {
+	ix[i] = i % 2 ? i : n - 1 - i ;
+	fec_encode(mapped, (void **)data, pkt[i], ix[i], sz);
+	fec_encode(code, (void **)data, out, ix[i], sz);
+	if (bcmp(pkt[i], out, sz)) {
+	    fprintf(stderr, "test_file: packet %d differs\n", ix[i]);
+	    errors++ ;
+	}
+    }
+    if (fec_decode(mapped, (void **)pkt, ix, sz) != FEC_OK) {
+	fprintf(stderr, "test_file: decode failed\n");
+	errors++ ;
+    } else
+	for (i = 0 ; i < k ; i++)
+	    if (bcmp(pkt[i], data[i], sz)) {
+		fprintf(stderr, "test_file: bad packet %d\n", i);
+		errors++ ;
+	    }
+    fec_free(mapped);
+
+    /* a flipped bit in a row, in the header, and a short file */
+    if (damage(path, bad, 5000, 0) == 0) {
+	if ( (mapped = fec_open(bad, 0)) != NULL) {
+	    fprintf(stderr, "test_file: corrupt row accepted\n");
+	    fec_free(mapped);
+	    errors++ ;
+	}
+	if ( (mapped = fec_open(bad, FEC_OPEN_NOVERIFY)) == NULL) {
+	    fprintf(stderr, "test_file: NOVERIFY refused the file\n");
+	    errors++ ;
+	} else
+	    fec_free(mapped);
+    }
+    if (damage(path, bad, 16, 0) == 0 &&
+	    (mapped = fec_open(bad, FEC_OPEN_NOVERIFY)) != NULL) {
+	fprintf(stderr, "test_file: corrupt header accepted\n");
+	fec_free(mapped);
+	errors++ ;
+    }
+    if (damage(path, bad, 6000, 1) == 0 &&
+	    (mapped = fec_open(bad, FEC_OPEN_NOVERIFY)) != NULL) {
+	fprintf(stderr, "test_file: short file accepted\n");
+	fec_free(mapped);
+	errors++ ;
+    }
+    unlink(bad);
+    unlink(path);
+    for (i = 0 ; i < k ; i++) {
+	free(data[i]);
+	free(pkt[i]);
+    }
+    free(out);
+    fec_free(code);
+    return errors ;
+}
+
+/*
+ * fec_encode_block() against fec_encode(), with sources asked for
+ * twice, more than k parities (so several passes) and a size that
+ * is not a multiple of the chunk.
+ */
+int
+test_encode_block(void)
+{
+    int k = 4, sz = 10002, nout = 14, i, j, errors = 0 ;
+    int index[14] = { 5, 0, 19, 3, 3, 6, 7, 8, 9, 10, 11, 1, 12, 13 } ;
+    u_char *src[4], *dst[14], *ref = my_malloc(sz, "block ref") ;
+    void *code = fec_new(k, 20) ;
+
+    for (i = 0 ; i < k ; i++) {
+	src[i] = my_malloc(sz, "block src");
+	for (j = 0 ; j < sz ; j++)
+	    src[i][j] = random() ;
+    }
+    for (i = 0 ; i < nout ; i++)
+	dst[i] = my_malloc(sz, "block dst");
+    if (fec_encode_block(code, (void **)src, (void **)dst, index, nout,
+	    sz) != FEC_OK) {
+	fprintf(stderr, "test_encode_block: failed\n");
+	errors++ ;
+    } else
+	for (i = 0 ; i < nout ; i++) {
+	    fec_encode(code, (void **)src, ref, index[i], sz);
+	    if (bcmp(ref, dst[i], sz)) {
+		fprintf(stderr, "test_encode_block: packet %d differs\n",
+		    index[i]);
+		errors++ ;
+	    }
+	}
+    index[0] = 20 ;
+    if (fec_encode_block(code, (void **)src, (void **)dst, index, nout,
+	    sz) != FEC_EINVAL) {
+	fprintf(stderr, "test_encode_block: bad index accepted\n");
+	errors++ ;
+    }
+    for (i = 0 ; i < k ; i++)
+	free(src[i]);
+    for (i = 0 ; i < nout ; i++)
+	free(dst[i]);
+    free(ref);
+    fec_free(code);
+    return errors ;
+}
+
+/*
+ * variable length packets: lose sources of different lengths, some
+ * odd, and check data and lengths after fec_decode_var().
+ */
+int
+test_var(void)
+{
+    int k = 6, n = 10, sz = 0, i, j, errors = 0 ;
+    int len[6] = { 64, 1, 301, 0, 9000, 77 }, rlen[6], ix[6] ;
+    u_char *src[6], *pkt[6] ;
+    void *code = fec_new(k, n) ;
+
+    for (i = 0 ; i < k ; i++)
+	if (len[i] > sz)
+	    sz = len[i] ;
+    sz = (sz + 1) & ~1 ;
+    for (i = 0 ; i < k ; i++) {
+	src[i] = my_malloc(len[i] + 1, "var src");
+	pkt[i] = my_malloc(sz + FEC_LEN_TRAILER, "var pkt");
+	for (j = 0 ; j < len[i] ; j++)
+	    src[i][j] = random() ;
+    }
+    /* sources 1, 2, 4 are lost, received in a shuffled order */
+    for (i = 0 ; i < k ; i++) {
+	ix[i] = i == 1 ? 7 : i == 2 ? 9 : i == 4 ? 6 : 5 - i ;
+	if (fec_encode_var(code, (void **)src, len, pkt[i], ix[i], sz)
+		!= FEC_OK) {
+	    fprintf(stderr, "test_var: encode %d failed\n", ix[i]);
+	    errors++ ;
+	}
+	rlen[i] = ix[i] < k ? len[ix[i]] : -1 ;
+    }
+    if (fec_decode_var(code, (void **)pkt, ix, rlen, sz) != FEC_OK) {
+	fprintf(stderr, "test_var: decode failed\n");
+	errors++ ;
+    } else
+	for (i = 0 ; i < k ; i++)
+	    if (rlen[i] != len[i] || bcmp(pkt[i], src[i], len[i])) {
+		fprintf(stderr, "test_var: source %d len %d want %d\n",
+		    i, rlen[i], len[i]);
+		errors++ ;
+	    }
+    len[0] = sz + 2 ;
+    if (fec_encode_var(code, (void **)src, len, pkt[0], 8, sz) != FEC_EINVAL) {
+	fprintf(stderr, "test_var: source longer than sz accepted\n");
+	errors++ ;
+    }
+    for (i = 0 ; i < k ; i++) {
+	free(src[i]);
+	free(pkt[i]);
+    }
+    fec_free(code);
+    return errors ;
+}
+
+/*
+ * sliding window code: a stream with random losses and a burst, on
+ * sources and repairs alike. Everything must come out in order, and
+ * what comes out must be right.
+ */
+#define SW_N	3000
+#define SW_W	16
+#define SW_SZ	100
+
+struct sw_check {
+    uint32_t next ;
+    int errors ;
+} ;
+
+static void
+sw_fill(u_char *p, uint32_t seq)
+{
+    int j ;
+
+    for (j = 0 ; j < SW_SZ ; j++)
+	p[j] = (seq * 31 + j * 7) ^ (seq >> 8) ;
+}
+
+static void
+sw_deliver(void *arg, uint32_t seq, void *data, int sz)
+{
+    struct sw_check *c = arg ;
+    u_char want[SW_SZ] ;
+
+    if (seq != c->next++) {
+	fprintf(stderr, "test_sw: got %u, expected %u\n", seq, c->next - 1);
+	c->errors++ ;
+    }
+    sw_fill(want, seq);
+    if (data != NULL && bcmp(data, want, SW_SZ)) {
+	fprintf(stderr, "test_sw: source %u is wrong\n", seq);
+	c->errors++ ;
+    }
+}
+
+int
+test_sw(void)
+{
+    struct sw_check c = { 0, 0 } ;
+    struct sw_repair h ;
+    struct sw_stats st ;
+    u_char src[SW_SZ], rep[SW_SZ] ;
+    void *enc = sw_enc_new(SW_W, SW_SZ) ;
+    void *dec = sw_dec_new(SW_W, SW_SZ, sw_deliver, &c) ;
+    uint32_t seq ;
+    int i ;
+
+    srandom(41);
+    for (i = 0 ; i < SW_N ; i++) {
+	sw_fill(src, i);
+	seq = sw_enc_add(enc, src);
+	/* 5% random loss, and sources 1000..1002 */
+	if (random() % 100 >= 5 && (seq < 1000 || seq > 1002))
+	    sw_dec_source(dec, seq, src);
+	if (i % 4 == 3) {	/* a repair every 4 sources */
+	    sw_enc_repair(enc, rep, &h);
+	    if (random() % 100 >= 5)
+		sw_dec_repair(dec, &h, rep);
+	}
+    }
+    sw_dec_flush(dec);
+    sw_dec_stats(dec, &st);
+    if (c.next != SW_N || st.delivered + st.lost != SW_N ||
+	    st.recovered < 100 || st.lost > SW_N / 100) {
+	fprintf(stderr, "test_sw: %u out, %llu delivered, %llu rebuilt, "
+	    "%llu lost\n", c.next, (unsigned long long)st.delivered,
+	    (unsigned long long)st.recovered, (unsigned long long)st.lost);
+	c.errors++ ;
+    }
+    sw_enc_free(enc);
+    sw_dec_free(dec);
+    if ( (dec = sw_dec_new(SW_MAX_W + 1, SW_SZ, sw_deliver, &c)) != NULL) {
+	fprintf(stderr, "test_sw: window of %d accepted\n", SW_MAX_W + 1);
+	sw_dec_free(dec);
+	c.errors++ ;
+    }
+    return c.errors ;
+}
+
+/*
+ * GF(2^32) code: the field against a plain shift and add multiply,
+ * addmul against fec32_mul(), and a code with k > 65536 losing
+ * sources all over the block.
+ */
+#define F32_K	70000
+#define F32_L	40
+#define F32_SZ	16
+
+static uint32_t
+mul32_ref(uint32_t a, uint32_t b)
+{
+    uint32_t r = 0 ;
+
+    for ( ; b != 0 ; b >>= 1) {
+	if (b & 1)
+	    r ^= a ;
+	a = a << 1 ^ (a >> 31 ? 0x8d : 0) ;
+    }
+    return r ;
+}
+
+int
+test_fec32(void)
+{
+    int n = F32_K + F32_L, i, j, errors = 0 ;
+    uint32_t a, b, c, w[1000], ref[1000], got[1000] ;
+    u_char *buf = my_malloc((F32_K + F32_L) * F32_SZ, "fec32") ;
+    void **pkt = my_malloc(F32_K * sizeof(void *), "fec32 pkt") ;
+    void **src = my_malloc(F32_K * sizeof(void *), "fec32 src") ;
+    int *ix = my_malloc(F32_K * sizeof(int), "fec32 ix") ;
+    void *code = fec32_new(F32_K, n) ;
+
+    for (i = 0 ; i < 10000 ; i++) {
+	a = random() ^ (uint32_t)random() << 16 ;
+	b = random() ^ (uint32_t)random() << 16 ;
+	if (fec32_mul(a, b) != mul32_ref(a, b) ||
+		(a != 0 && fec32_mul(a, fec32_inv(a)) != 1)) {
+	    fprintf(stderr, "test_fec32: bad mul/inv %08x %08x\n", a, b);
+	    errors++ ;
+	    break ;
+	}
+    }
+    for (i = 0 ; i < 1000 ; i++) {
+	w[i] = random() ^ (uint32_t)random() << 16 ;
+	ref[i] = got[i] = i ;
+    }
+    c = random() ;
+    for (i = 0 ; i < 1000 ; i++)
+	ref[i] ^= fec32_mul(w[i], c);
+    fec32_addmul(got, w, c, 37 * 4);
+    fec32_addmul(got + 37, w + 37, c, (1000 - 37) * 4);
+    if (memcmp(ref, got, sizeof(ref))) {
+	fprintf(stderr, "test_fec32: addmul (%s) differs\n", fec32_kernel());
+	errors++ ;
+    }
+
+    for (i = 0 ; i < F32_K * F32_SZ ; i++)
+	buf[i] = random() ;
+    for (i = 0 ; i < F32_K ; i++)
+	src[i] = buf + (size_t)i * F32_SZ ;
+    /* lose every 1750th source, use parities from both ends */
+    for (j = 0, i = 0 ; i < F32_K ; i++) {
+	ix[F32_K - 1 - i] = i ;
+	pkt[F32_K - 1 - i] = src[i] ;
+	if (i % (F32_K / F32_L) == 7) {
+	    ix[F32_K - 1 - i] = j < F32_L / 2 ? F32_K + j :
+		n - 1 - (j - F32_L / 2) ;
+	    pkt[F32_K - 1 - i] = buf + (size_t)(F32_K + j++) * F32_SZ ;
+	    fec32_encode(code, src, pkt[F32_K - 1 - i], ix[F32_K - 1 - i],
+		F32_SZ);
+	}
+    }
+    if (fec32_decode(code, pkt, ix, F32_SZ) != FEC_OK) {
+	fprintf(stderr, "test_fec32: decode failed\n");
+	errors++ ;
+    } else
+	for (i = 0 ; i < F32_K ; i++)
+	    if (bcmp(pkt[i], src[i], F32_SZ)) {
+		fprintf(stderr, "test_fec32: source %d differs\n", i);
+		errors++ ;
+	    }
+    for (i = 0 ; i < F32_K ; i++)
+	ix[i] = i ;
+    ix[5] = ix[9] = n - 1 ;
+    if (fec32_decode(code, src, ix, F32_SZ) != FEC_EINVAL) {
+	fprintf(stderr, "test_fec32: duplicate parity accepted\n");
+	errors++ ;
+    }
+    fec32_free(code);
+    free(buf);
+    free(pkt);
+    free(src);
+    free(ix);
+    return errors ;
+}
+
+/*
+ * a decode plan made once for a pattern of received packets (not in
+ * order, three parities), executed on several blocks, the last one
+ * in two ranges.
+ */
+int
+test_plan(void)
+{
+    int k = 20, n = 30, sz = 1000, i, j, b, errors = 0 ;
+    int ix[20] ;
+    u_char *src[20], *par[20], *pkt[20], *pkt2[20] ;
+    void *code = fec_new(k, n), *plan ;
+
+    for (i = 0 ; i < k ; i++) {
+	src[i] = my_malloc(sz, "plan src");
+	par[i] = my_malloc(sz, "plan par");
+	ix[i] = k - 1 - i ;
+    }
+    ix[3] = 25 ;
+    ix[7] = 21 ;
+    ix[8] = 29 ;
+    plan = fec_plan_decode(code, ix, sz);
+    if (plan == NULL) {
+	fprintf(stderr, "test_plan: no plan\n");
+	errors++ ;
+    }
+    for (b = 0 ; b < 3 && plan != NULL ; b++) {
+	for (i = 0 ; i < k ; i++)
+	    for (j = 0 ; j < sz ; j++)
+		src[i][j] = random() ;
+	for (i = 0 ; i < k ; i++) {
+	    pkt[i] = ix[i] < k ? src[ix[i]] : par[i] ;
+	    if (ix[i] >= k)
+		fec_encode(code, (void **)src, par[i], ix[i], sz);
+	}
+	if (b < 2)
+	    fec_plan_execute(plan, (void **)pkt);
+	else {
+	    bcopy(pkt, pkt2, sizeof(pkt));
+	    fec_plan_execute_range(plan, (void **)pkt2, NULL, 384, sz - 384);
+	    fec_plan_execute_range(plan, (void **)pkt, NULL, 0, 384);
+	}
+	for (i = 0 ; i < k ; i++)
+	    if (bcmp(pkt[i], src[i], sz)) {
+		fprintf(stderr, "test_plan: block %d, source %d differs\n",
+		    b, i);
+		errors++ ;
+	    }
+    }
+    fec_plan_free(plan);
+    ix[0] = ix[1] ;
+    if ( (plan = fec_plan_decode(code, ix, sz)) != NULL) {
+	fprintf(stderr, "test_plan: duplicate index accepted\n");
+	fec_plan_free(plan);
+	errors++ ;
+    }
+    ix[0] = n ;
+    if ( (plan = fec_plan_decode(code, ix, sz)) != NULL) {
+	fprintf(stderr, "test_plan: index %d accepted\n", n);
+	fec_plan_free(plan);
+	errors++ ;
+    }
+    for (i = 0 ; i < k ; i++) {
+	free(src[i]);
+	free(par[i]);
+    }
+    fec_free(code);
+    return errors ;
+}
+
+/*
+ * choosing k out of 14 packets: all the sources there are, unless a
+ * source costs more to fetch than a parity plus a rebuild; then
+ * decode from the choice.
+ */
+int
+test_choose(void)
+{
+    int k = 10, n = 16, sz = 512, i, j, nsrc, errors = 0 ;
+    int avail[14] = { 15, 0, 12, 1, 2, 11, 4, 5, 6, 13, 8, 9, 10, 14 } ;
+    int ix[14], pick[10] ;
+    double cost[14] ;
+    u_char *src[10], *buf[14], *pkt[14] ;
+    void *code = fec_new(k, n) ;
+
+    for (i = 0 ; i < k ; i++) {
+	src[i] = my_malloc(sz, "choose src");
+	for (j = 0 ; j < sz ; j++)
+	    src[i][j] = random() ;
+    }
+    for (i = 0 ; i < 14 ; i++) {
+	buf[i] = my_malloc(sz, "choose buf");
+	fec_encode(code, (void **)src, buf[i], avail[i], sz);
+	cost[i] = 1 ;
+    }
+    cost[6] = 10 ;	/* source 4 is remote */
+    for (j = 0 ; j < 2 ; j++) {
+	if (fec_choose(code, avail, 14, j ? cost : NULL, 2, pick) != FEC_OK) {
+	    fprintf(stderr, "test_choose: failed\n");
+	    errors++ ;
+	    continue ;
+	}
+	for (nsrc = 0, i = 0 ; i < k ; i++) {
+	    ix[i] = avail[pick[i]] ;
+	    pkt[i] = buf[pick[i]] ;
+	    if (ix[i] < k && ix[i] != i)
+		errors++ ;
+	    nsrc += ix[i] < k ;
+	}
+	if (nsrc != (j ? 7 : 8) || (j && ix[4] == 4)) {
+	    fprintf(stderr, "test_choose: %d sources chosen\n", nsrc);
+	    errors++ ;
+	}
+	fec_decode(code, (void **)pkt, ix, sz);
+	for (i = 0 ; i < k ; i++)
+	    if (bcmp(pkt[i], src[i], sz)) {
+		fprintf(stderr, "test_choose: source %d differs\n", i);
+		errors++ ;
+	    }
+	for (i = 0 ; i < 14 ; i++)
+	    fec_encode(code, (void **)src, buf[i], avail[i], sz);
+    }
+    for (i = 0 ; i < 14 ; i++) {
+	ix[i] = avail[i] ;
+	pkt[i] = buf[i] ;
+    }
+    if (fec_decode_any(code, (void **)pkt, ix, 14, sz) != FEC_OK)
+	errors++ ;
+    for (i = 0 ; i < k ; i++)
+	if (bcmp(pkt[i], src[i], sz)) {
+	    fprintf(stderr, "test_choose: any, source %d differs\n", i);
+	    errors++ ;
+	}
+    avail[0] = 0 ;
+    if (fec_choose(code, avail, 14, NULL, 0, pick) != FEC_EINVAL) {
+	fprintf(stderr, "test_choose: duplicate accepted\n");
+	errors++ ;
+    }
+    for (i = 0 ; i < k ; i++)
+	free(src[i]);
+    for (i = 0 ; i < 14 ; i++)
+	free(buf[i]);
+    fec_free(code);
+    return errors ;
+}
+
+/*
+ * batches of small interleaved blocks: encode against fec_encode() on
+ * each block, and decode with most blocks complete and the others
+ * with two patterns of losses.
+ */
+#define BATCH_NB	100
+#define BATCH_K		8
+#define BATCH_N		12
+#define BATCH_SZ	32
+
+int
+test_batch(void)
+{
+    int nb = BATCH_NB, k = BATCH_K, sz = BATCH_SZ, i, j, b, e, errors = 0 ;
+    int esz = GF_BITS > 8 ? 2 : 1, ne = sz / esz ;
+    int *ix = my_malloc(nb * k * sizeof(int), "batch ix") ;
+    int *ix2 = my_malloc(nb * k * sizeof(int), "batch ix2"), pass ;
+    u_char *blk[BATCH_NB][BATCH_N], *src[BATCH_N], *ref ;
+    void *code = fec_new(k, BATCH_N) ;
+
+    ref = my_malloc(sz, "batch ref");
+    for (i = 0 ; i < BATCH_N ; i++)
+	src[i] = my_malloc(nb * sz, "batch src");
+    for (b = 0 ; b < nb ; b++) {
+	for (i = 0 ; i < BATCH_N ; i++) {
+	    blk[b][i] = my_malloc(sz, "batch blk");
+	    for (j = 0 ; i < k && j < sz ; j++)
+		blk[b][i][j] = random() ;
+	}
+	for (i = k ; i < BATCH_N ; i++)
+	    fec_encode(code, (void **)blk[b], blk[b][i], i, sz);
+	for (i = 0 ; i < k ; i++)	/* interleave the sources */
+	    for (e = 0 ; e < ne ; e++)
+		bcopy(blk[b][i] + e * esz, src[i] + (e * nb + b) * esz, esz);
+    }
+    for (i = k ; i < BATCH_N ; i++)
+	fec_encode_batch(code, (void **)src, src[i], i, sz, nb);
+    for (b = 0 ; b < nb ; b++)
+	for (i = k ; i < BATCH_N ; i++) {
+	    for (e = 0 ; e < ne ; e++)
+		bcopy(src[i] + (e * nb + b) * esz, ref + e * esz, esz);
+	    if (bcmp(ref, blk[b][i], sz)) {
+		fprintf(stderr, "test_batch: block %d parity %d differs\n",
+		    b, i);
+		errors++ ;
+	    }
+	}
+    /*
+     * blocks 10..59 lose source 3 (parity 9 in its slot), enough to
+     * be decoded at full width; every 7th other block has sources 0
+     * and 5 swapped and parities 11, 8 in slots 2 and 7, decoded one
+     * by one. Slots holding parities get them in the right lanes.
+     * Pass 1 has all the blocks like the 7th ones, pass 2 all losing
+     * source 3, and pass 3 is pass 0 with an invalid block, which
+     * must leave everything alone.
+     */
+    for (pass = 0 ; pass < 4 ; pass++) {
+	for (b = 0 ; b < nb ; b++) {
+	    for (i = 0 ; i < k ; i++)
+		ix[b * k + i] = i ;
+	    if (pass == 2 || (pass != 1 && b >= 10 && b < 60))
+		ix[b * k + 3] = 9 ;
+	    else if (pass == 1 || b % 7 == 0) {
+		ix[b * k + 0] = 5 ;
+		ix[b * k + 5] = 0 ;
+		ix[b * k + 2] = 11 ;
+		ix[b * k + 7] = 8 ;
+	    }
+	    for (i = 0 ; i < k ; i++)
+		for (e = 0 ; e < ne ; e++)
+		    bcopy(blk[b][ix[b * k + i]] + e * esz,
+			src[i] + (e * nb + b) * esz, esz);
+	}
+	if (pass == 3) {
+	    ix[70 * k + 1] = ix[70 * k + 4] ;
+	    bcopy(ix, ix2, nb * k * sizeof(int));
+	    if (fec_decode_batch(code, (void **)src, ix, sz, nb) != FEC_EINVAL
+		    || bcmp(ix, ix2, nb * k * sizeof(int))) {
+		fprintf(stderr, "test_batch: invalid block accepted\n");
+		errors++ ;
+	    }
+	    break ;
+	}
+	if (fec_decode_batch(code, (void **)src, ix, sz, nb) != FEC_OK) {
+	    fprintf(stderr, "test_batch: pass %d decode failed\n", pass);
+	    errors++ ;
+	}
+	for (b = 0 ; b < nb ; b++)
+	    for (i = 0 ; i < k ; i++) {
+		for (e = 0 ; e < ne ; e++)
+		    bcopy(src[i] + (e * nb + b) * esz, ref + e * esz, esz);
+		if (bcmp(ref, blk[b][i], sz) || ix[b * k + i] != i) {
+		    fprintf(stderr, "test_batch: pass %d block %d source %d "
+			"differs\n", pass, b, i);
+		    errors++ ;
+		}
+	    }
+    }
+    for (b = 0 ; b < nb ; b++)
+	for (i = 0 ; i < BATCH_N ; i++)
+	    free(blk[b][i]);
+    for (i = 0 ; i < BATCH_N ; i++)
+	free(src[i]);
+    free(ref);
+    free(ix);
+    free(ix2);
+    fec_free(code);
+    return errors ;
+}
+
+/*
+ * fec_verify() on a good stripe, then with one parity and with one
+ * source corrupted near the end.
+ */
+int
+test_verify(void)
+{
+    int k = 10, n = 16, sz = 1000, i, j, errors = 0 ;
+    int ix[6], bad[6], want ;
+    u_char *src[10], *par[6] ;
+    void *code = fec_new(k, n) ;
+
+    for (i = 0 ; i < k ; i++) {
+	src[i] = my_malloc(sz, "verify src");
+	for (j = 0 ; j < sz ; j++)
+	    src[i][j] = random() ;
+    }
+    for (i = 0 ; i < n - k ; i++) {
+	ix[i] = n - 1 - i ;
+	par[i] = my_malloc(sz, "verify par");
+	fec_encode(code, (void **)src, par[i], ix[i], sz);
+    }
+    if (fec_verify(code, (void **)src, (void **)par, ix, n - k, sz, bad)
+	    != FEC_OK) {
+	fprintf(stderr, "test_verify: good stripe rejected\n");
+	errors++ ;
+    }
+    par[2][sz - 1] ^= 0x10 ;
+    if (fec_verify(code, (void **)src, (void **)par, ix, n - k, sz, bad)
+	    != FEC_EMISMATCH)
+	errors++ ;
+    for (i = 0 ; i < n - k ; i++)
+	if (bad[i] != (i == 2)) {
+	    fprintf(stderr, "test_verify: parity %d bad %d\n", ix[i], bad[i]);
+	    errors++ ;
+	}
+    par[2][sz - 1] ^= 0x10 ;
+    src[4][sz - 2] ^= 1 ;	/* all parities involve all sources */
+    fec_verify(code, (void **)src, (void **)par, ix, n - k, sz, bad);
+    for (want = 1, i = 0 ; i < n - k ; i++)
+	want &= bad[i] ;
+    if (!want) {
+	fprintf(stderr, "test_verify: corrupted source not seen\n");
+	errors++ ;
+    }
+    ix[0] = 3 ;
+    if (fec_verify(code, (void **)src, (void **)par, ix, n - k, sz, NULL)
+	    != FEC_EINVAL)
+	errors++ ;
+    for (i = 0 ; i < k ; i++)
+	free(src[i]);
+    for (i = 0 ; i < n - k ; i++)
+	free(par[i]);
+    fec_free(code);
+    return errors ;
+}
+
+/*
+ * rateless code: a stream with losses, decoding attempted as packets
+ * arrive, must finish within a few packets of k; then again from
+ * repair packets only.
+ */
+#define RL_K	100
+#define RL_SZ	64
+
+int
+test_rl(void)
+{
+    int i, j, errors = 0, pass, got, err ;
+    uint32_t x ;
+    u_char *src[RL_K], *out[RL_K], pkt[RL_SZ] ;
+    void *enc, *dec ;
+
+    for (i = 0 ; i < RL_K ; i++) {
+	src[i] = my_malloc(RL_SZ, "rl src");
+	out[i] = my_malloc(RL_SZ, "rl out");
+	for (j = 0 ; j < RL_SZ ; j++)
+	    src[i][j] = random() ;
+    }
+    enc = rl_enc_new(RL_K, RL_SZ, (void **)src);
+    for (pass = 0 ; pass < 2 ; pass++) {
+	dec = rl_dec_new(RL_K, RL_SZ);
+	err = FEC_EMORE ;
+	for (got = 0, x = pass ? RL_K : 0 ; err == FEC_EMORE ; x++) {
+	    if (pass == 0 && random() % 4 == 0)	/* lost */
+		continue ;
+	    rl_enc_packet(enc, x, pkt);
+	    rl_dec_add(dec, x, pkt);
+	    got++ ;
+	    if (got >= RL_K)
+		err = rl_dec_decode(dec, (void **)out);
+	}
+	if (err != FEC_OK || got > RL_K + 3) {
+	    fprintf(stderr, "test_rl: pass %d err %d after %d packets\n",
+		pass, err, got);
+	    errors++ ;
+	}
+	for (i = 0 ; err == FEC_OK && i < RL_K ; i++)
+	    if (memcmp(src[i], out[i], RL_SZ)) {
+		fprintf(stderr, "test_rl: pass %d source %d differs\n",
+		    pass, i);
+		errors++ ;
+		break ;
+	    }
+	rl_dec_free(dec);
+    }
+    rl_enc_free(enc);
+    for (i = 0 ; i < RL_K ; i++) {
+	free(src[i]);
+	free(out[i]);
+    }
+    return errors ;
+}
+
+/*
+ * shared memory service, served and used by this process: an encode
+ * must match fec_encode(), a decode after losses must leave the
+ * sources in place, and a block outside the arena or with a bad index
+ * must be refused.
+ */
+#define SHM_K	10
+#define SHM_N	16
+#define SHM_SZ	64
+
+int
+test_shm(void)
+{
+    struct fec_shm_req r[4], c ;
+    int i, j, errors = 0, got, *index, bad[SHM_K] ;
+    u_char *src[SHM_K], par[SHM_SZ], *arena, *blk ;
+    void *srv, *cl, *code = fec_new(SHM_K, SHM_N) ;
+    char name[64] ;
+    size_t asz ;
+
+    snprintf(name, sizeof(name), "/fec_test.%d", (int)getpid());
+    srv = fec_shm_server_new(name, 2, 64 * 1024, 1, -1);
+    if (srv == NULL || (cl = fec_shm_attach(name)) == NULL) {
+	fprintf(stderr, "test_shm: cannot start\n");
+	if (srv != NULL)
+	    fec_shm_server_free(srv);
+	fec_free(code);
+	return 1 ;
+    }
+    arena = fec_shm_arena(cl, &asz);
+    for (i = 0 ; i < SHM_K ; i++) {
+	src[i] = arena + i * SHM_SZ ;
+	for (j = 0 ; j < SHM_SZ ; j++)
+	    src[i][j] = random() ;
+    }
+    /* block 0: encode parities k..n-1 after the sources */
+    index = (int *)(arena + SHM_N * SHM_SZ) ;
+    for (i = 0 ; i < SHM_N - SHM_K ; i++)
+	index[i] = SHM_K + i ;
+    memset(r, 0, sizeof(r));
+    r[0].op = FEC_SHM_ENCODE ;
+    r[0].k = SHM_K ;
+    r[0].n = SHM_N ;
+    r[0].sz = SHM_SZ ;
+    r[0].pkt = 0 ;
+    r[0].out = SHM_K * SHM_SZ ;
+    r[0].index = SHM_N * SHM_SZ ;
+    r[0].nout = SHM_N - SHM_K ;
+    r[0].tag = 0 ;
+    r[2] = r[0] ;	/* outside the arena */
+    r[2].pkt = asz - SHM_SZ ;
+    r[2].tag = 2 ;
+    /* a decode with a negative index, which shuffle() would follow */
+    index = (int *)(arena + 8192 + SHM_N * SHM_SZ) ;
+    for (i = 0 ; i < SHM_K ; i++)
+	bad[i] = index[i] = i ? i : -100000 ;
+    r[3] = r[0] ;
+    r[3].op = FEC_SHM_DECODE ;
+    r[3].pkt = 8192 ;
+    r[3].index = 8192 + SHM_N * SHM_SZ ;
+    r[3].tag = 3 ;
+    fec_shm_post(cl, &r[0]);
+    fec_shm_post(cl, &r[2]);
+    fec_shm_post(cl, &r[3]);
+    for (got = 0 ; got < 3 && fec_shm_poll(cl, &c, 1) ; got++)
+	if (c.error != (c.tag >= 2 ? FEC_EINVAL : FEC_OK)) {
+	    fprintf(stderr, "test_shm: tag %d error %d\n", (int)c.tag,
+		c.error);
+	    errors++ ;
+	}
+    for (i = 0 ; i < SHM_N - SHM_K ; i++) {
+	fec_encode(code, (void **)src, par, SHM_K + i, SHM_SZ);
+	if (memcmp(par, arena + (SHM_K + i) * SHM_SZ, SHM_SZ)) {
+	    fprintf(stderr, "test_shm: parity %d differs\n", SHM_K + i);
+	    errors++ ;
+	}
+    }
+    if (fec_decode(code, (void **)src, bad, SHM_SZ) != FEC_EINVAL) {
+	fprintf(stderr, "test_shm: fec_decode took a negative index\n");
+	errors++ ;
+    }
+    /* block 1: sources 1, 4, 7 lost, parities in their place */
+    blk = arena + 4096 ;
+    index = (int *)(blk + SHM_N * SHM_SZ) ;
+    for (i = j = 0 ; i < SHM_K ; i++) {
+	index[i] = (i % 3 == 1) ? SHM_K + j++ : i ;
+	memcpy(blk + i * SHM_SZ, arena + index[i] * SHM_SZ, SHM_SZ);
+    }
+    r[1] = r[0] ;
+    r[1].op = FEC_SHM_DECODE ;
+    r[1].pkt = 4096 ;
+    r[1].index = 4096 + SHM_N * SHM_SZ ;
+    r[1].tag = 1 ;
+    fec_shm_post(cl, &r[1]);
+    if (!fec_shm_poll(cl, &c, 1) || c.error != FEC_OK) {
+	fprintf(stderr, "test_shm: decode failed\n");
+	errors++ ;
+    } else
+	for (i = 0 ; i < SHM_K ; i++)
+	    if (memcmp(blk + i * SHM_SZ, src[i], SHM_SZ) || index[i] != i) {
+		fprintf(stderr, "test_shm: source %d differs\n", i);
+		errors++ ;
+		break ;
+	    }
+    fec_shm_detach(cl);
+    fec_shm_server_free(srv);
+    fec_free(code);
+    return errors ;
+}
+
 #if 0
 void
 test_gf()
@@ -213,6 +1816,7 @@ main(int argc, char *argv[])
 
     int kk ;
     int i ;
+    int errors = 0 ;
 
     int *ixs ;
 
@@ -223,16 +1827,37 @@ main(int argc, char *argv[])
 #if 0
     test_gf();
 #endif
+    errors += test_alloc_errors();
+    errors += test_pool();
+    errors += test_crc();
+    errors += test_range();
+    errors += test_sel();
+    errors += test_lrc();
+    errors += test_session();
+    errors += test_kernel();
+    errors += test_lazy();
+    errors += test_invert();
+    errors += test_file();
+    errors += test_encode_block();
+    errors += test_var();
+    errors += test_sw();
+    errors += test_fec32();
+    errors += test_plan();
+    errors += test_choose();
+    errors += test_batch();
+    errors += test_verify();
+    errors += test_rl();
+    errors += test_shm();
     for ( kk = KK ; kk > 2 ; kk-- ) {
 	code = fec_new(kk, lim);
 	ixs = my_malloc(kk * sizeof(int), "ixs" );
 
 	for (i=0; i<kk; i++) ixs[i] = kk - i ;
 	sprintf(buf, "kk=%d, kk - i", kk); 
-	test_decode(code, kk, ixs, SZ, buf);
+	errors += test_decode(code, kk, ixs, SZ, buf);
 
 	for (i=0; i<kk; i++) ixs[i] = i ;
-	test_decode(code, kk, ixs, SZ, "i");
+	errors += test_decode(code, kk, ixs, SZ, "i");
 
 if (0) {
 	for (i=0; i<kk; i++) ixs[i] = i ;
@@ -262,12 +1887,12 @@ if (1)  {
 	for (i= 0 ; i <= max_i0 ; i++) {
 	    for (j=0; j<kk; j++)
 		ixs[j] = j + i ;
-	    test_decode(code, kk, ixs, SZ, "shifted j");
+	    errors += test_decode(code, kk, ixs, SZ, "shifted j");
 	}
 	}
 	fprintf(stderr, "\n");
 	free(ixs);
 	fec_free(code);
     }
-    return 0;
+    return errors ? 1 : 0 ;
 }
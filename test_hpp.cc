@@ -0,0 +1,77 @@
+/*
+ * test_hpp.cc -- test code for the C++ interface in fec.hpp
+ *
+ * Checks that FecCodec<K, N> produces the same packets as the C
+ * library and that it decodes them.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include "fec.h"
+#include "fec.hpp"
+
+template <int K, int N>
+static int
+test_codec(size_t sz)
+{
+    using codec = fec::FecCodec<K, N> ;
+    std::vector<std::vector<uint8_t>> data(N, std::vector<uint8_t>(sz)) ;
+    std::vector<uint8_t> ref(sz) ;
+    std::array<std::span<const uint8_t>, K> src, rx ;
+    std::array<std::span<uint8_t>, K> out ;
+    std::vector<std::vector<uint8_t>> dec(K, std::vector<uint8_t>(sz)) ;
+    std::array<int, K> ix ;
+    void *csrc[K] ;
+    void *code = fec_new(K, N) ;
+    int errors = 0 ;
+
+    for (int i = 0 ; i < K ; i++) {
+	for (size_t b = 0 ; b < sz ; b++)
+	    data[i][b] = rand() ;
+	src[i] = data[i] ;
+	csrc[i] = data[i].data() ;
+    }
+    for (int i = 0 ; i < N ; i++) {
+	if (i >= K)
+	    codec::encode(src, data[i], i) ;
+	fec_encode(code, csrc, ref.data(), i, sz) ;
+	if (ref != data[i]) {
+	    fprintf(stderr, "FecCodec<%d,%d>: packet %d differs\n", K, N, i) ;
+	    errors++ ;
+	}
+    }
+    /*
+     * lose the first N-K source packets, decode from the parities.
+     */
+    for (int i = 0 ; i < K ; i++) {
+	ix[i] = i < N - K ? K + i : i ;
+	rx[i] = data[ix[i]] ;
+	out[i] = dec[i] ;
+    }
+    if (!codec::decode(rx, ix, out)) {
+	fprintf(stderr, "FecCodec<%d,%d>: decode failed\n", K, N) ;
+	errors++ ;
+    }
+    for (int i = 0 ; i < K ; i++)
+	if (dec[i] != data[i]) {
+	    fprintf(stderr, "FecCodec<%d,%d>: bad packet %d\n", K, N, i) ;
+	    errors++ ;
+	}
+    fec_free(code) ;
+    return errors ;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int errors = 0 ;
+
+#if GF_BITS == 8
+    errors += test_codec<1, 2>(100) ;
+    errors += test_codec<10, 14>(1024) ;
+    errors += test_codec<16, 20>(1000) ;
+    errors += test_codec<32, 40>(1500) ;
+#endif
+    return errors ? 1 : 0 ;
+}